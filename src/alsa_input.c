@@ -0,0 +1,338 @@
+/**
+ * \file alsa_input.c
+ *
+ * This file contains the capture of audio through ALSA. The samples are
+ * copied straight from the mmap'ed buffer of the pcm into the packets
+ * passed on to the audio encoding, a period per packet. Each packet is
+ * timestamped with the time the pcm's hardware pointer was last updated,
+ * so the capture time does not depend on when the reading thread gets to
+ * run. Any pcm works, including the null and file plugins that need no
+ * sound card.
+ */
+/*
+ * Copyright (C) 2003-07 Karl H. Beckers, Frankfurt
+ * EMail: khb@jarre-de-the.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif     // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_LIBASOUND
+#include <alsa/asoundlib.h>
+#endif     // HAVE_LIBASOUND
+
+#include "app_data.h"
+#include "alsa_input.h"
+#include "xvidcap-intl.h"
+
+/** \brief how long to wait for a period in msecs before waiting again */
+#define ALSA_WAIT_MSECS 1000
+
+/**
+ * \brief checks if an audio input is to be captured through ALSA
+ *
+ * @param device the name of the audio input
+ * @return TRUE if the name starts with ALSA_INPUT_PREFIX
+ */
+int
+xvc_is_alsa_device (const char *device)
+{
+    return (device &&
+            strncmp (device, ALSA_INPUT_PREFIX,
+                     strlen (ALSA_INPUT_PREFIX)) == 0);
+}
+
+#ifdef HAVE_LIBASOUND
+struct _xvc_AlsaInput
+{
+    snd_pcm_t *pcm;
+    snd_pcm_status_t *status;
+    /** \brief frames per period, a packet holds one period */
+    snd_pcm_uframes_t period;
+    int rate;
+    int frame_bytes;
+    /** \brief FALSE till the first read, nothing is captured before */
+    int started;
+    /** \brief TRUE if the pcm timestamps on the monotonic clock */
+    int monotonic;
+    /** \brief overruns of the pcm's buffer */
+    int xruns;
+};
+
+/**
+ * \brief get a pcm going again after an overrun or a suspend
+ *
+ * @param a the ALSA input
+ * @param err the error the pcm reported
+ * @return 0 on success, < 0 if the pcm cannot be recovered
+ */
+static int
+alsa_recover (XVC_AlsaInput * a, int err)
+{
+    if (err == -EPIPE)
+        a->xruns++;
+    err = snd_pcm_recover (a->pcm, err, 1);
+    if (err < 0) {
+        fprintf (stderr, _("ALSA capture failed: %s\n"), snd_strerror (err));
+        return err;
+    }
+    // a capture pcm is left prepared, but not started
+    if (snd_pcm_state (a->pcm) == SND_PCM_STATE_PREPARED)
+        snd_pcm_start (a->pcm);
+    return 0;
+}
+
+/**
+ * \brief open an ALSA pcm for capture with mmap access
+ *
+ * @param device the name of the pcm with ALSA_INPUT_PREFIX
+ * @param rate the sample rate wanted, gets the one the pcm runs at
+ * @param channels the channels wanted, gets the ones the pcm captures
+ * @param period_usecs the length of a period, 0 for the pcm's default
+ * @param buffer_usecs the length of the pcm's buffer, 0 for its default
+ * @return the ALSA input or NULL on failure
+ */
+XVC_AlsaInput *
+xvc_alsa_open (const char *device, int *rate, int *channels,
+               int period_usecs, int buffer_usecs)
+{
+    XVC_AlsaInput *a = calloc (1, sizeof (XVC_AlsaInput));
+    const char *name = device + strlen (ALSA_INPUT_PREFIX);
+    snd_pcm_hw_params_t *hw;
+    snd_pcm_sw_params_t *sw;
+    snd_pcm_uframes_t buffer;
+    unsigned int r = *rate, c = *channels, t;
+    int dir = 0, err;
+
+    if (!a) {
+        fprintf (stderr, _("Could not allocate ALSA input ... aborting\n"));
+        return NULL;
+    }
+    err = snd_pcm_open (&a->pcm, name, SND_PCM_STREAM_CAPTURE, 0);
+    if (err < 0) {
+        fprintf (stderr, _("Could not open ALSA pcm %s: %s\n"), name,
+                 snd_strerror (err));
+        free (a);
+        return NULL;
+    }
+
+    snd_pcm_hw_params_alloca (&hw);
+    if ((err = snd_pcm_hw_params_any (a->pcm, hw)) < 0 ||
+        (err = snd_pcm_hw_params_set_access (a->pcm, hw,
+                                             SND_PCM_ACCESS_MMAP_INTERLEAVED))
+        < 0 ||
+        (err = snd_pcm_hw_params_set_format (a->pcm, hw,
+                                             SND_PCM_FORMAT_S16)) < 0 ||
+        (err = snd_pcm_hw_params_set_channels_near (a->pcm, hw, &c)) < 0 ||
+        (err = snd_pcm_hw_params_set_rate_near (a->pcm, hw, &r, &dir)) < 0)
+        goto fail;
+    if (buffer_usecs > 0) {
+        t = buffer_usecs;
+        dir = 0;
+        if ((err = snd_pcm_hw_params_set_buffer_time_near (a->pcm, hw, &t,
+                                                           &dir)) < 0)
+            goto fail;
+    }
+    if (period_usecs > 0) {
+        t = period_usecs;
+        dir = 0;
+        if ((err = snd_pcm_hw_params_set_period_time_near (a->pcm, hw, &t,
+                                                           &dir)) < 0)
+            goto fail;
+    }
+    if ((err = snd_pcm_hw_params (a->pcm, hw)) < 0)
+        goto fail;
+    snd_pcm_hw_params_get_period_size (hw, &a->period, &dir);
+    snd_pcm_hw_params_get_buffer_size (hw, &buffer);
+
+    // wake up for whole periods and timestamp the hardware pointer on the
+    // clock the rest of the recording is timed with
+    snd_pcm_sw_params_alloca (&sw);
+    if ((err = snd_pcm_sw_params_current (a->pcm, sw)) < 0 ||
+        (err = snd_pcm_sw_params_set_avail_min (a->pcm, sw, a->period)) < 0 ||
+        (err = snd_pcm_sw_params_set_tstamp_mode (a->pcm, sw,
+                                                  SND_PCM_TSTAMP_ENABLE)) < 0)
+        goto fail;
+    a->monotonic =
+        (snd_pcm_sw_params_set_tstamp_type (a->pcm, sw,
+                                            SND_PCM_TSTAMP_TYPE_MONOTONIC) ==
+         0);
+    if ((err = snd_pcm_sw_params (a->pcm, sw)) < 0)
+        goto fail;
+    if ((err = snd_pcm_status_malloc (&a->status)) < 0)
+        goto fail;
+
+    a->rate = r;
+    a->frame_bytes = 2 * c;
+    *rate = r;
+    *channels = c;
+
+    if (xvc_appdata_ptr ()->verbose) {
+        printf ("alsa: %s at %u Hz with %u channels, %lu frames per period, %lu in the buffer%s\n",
+                name, r, c, (unsigned long) a->period,
+                (unsigned long) buffer,
+                (a->monotonic ? "" : ", not timestamped"));
+    }
+    return a;
+
+  fail:
+    fprintf (stderr, _("Could not set up ALSA pcm %s for capture: %s\n"),
+             name, snd_strerror (err));
+    snd_pcm_close (a->pcm);
+    free (a);
+    return NULL;
+}
+
+/**
+ * \brief read a period of samples from an ALSA input
+ *
+ * This blocks until the pcm captured a period and is the only place the
+ * audio reader thread can be cancelled at.
+ *
+ * @param a the ALSA input
+ * @param pkt the packet to read into, to be freed by the caller
+ * @param captured gets the master clock time in usecs the first sample
+ *      was captured at or AV_NOPTS_VALUE if the pcm has no timestamps
+ * @return 0 on success, < 0 on error
+ */
+int
+xvc_alsa_read (XVC_AlsaInput * a, AVPacket * pkt, int64_t * captured)
+{
+    snd_pcm_sframes_t avail;
+    snd_pcm_uframes_t done;
+    snd_htimestamp_t ts;
+    int err;
+
+    if (!a->started) {
+        if ((err = snd_pcm_start (a->pcm)) < 0 && alsa_recover (a, err) < 0)
+            return err;
+        a->started = TRUE;
+    }
+
+    for (;;) {
+        avail = snd_pcm_avail_update (a->pcm);
+        if (avail < 0) {
+            // what the overrun lost is made up for by the a/v sync
+            if ((err = alsa_recover (a, avail)) < 0)
+                return err;
+            continue;
+        }
+        if ((snd_pcm_uframes_t) avail < a->period) {
+            err = snd_pcm_wait (a->pcm, ALSA_WAIT_MSECS);
+            if (err < 0 && (err = alsa_recover (a, err)) < 0)
+                return err;
+            continue;
+        }
+
+        // the oldest frame waiting was captured the frames waiting before
+        // the hardware pointer's timestamp
+        *captured = AV_NOPTS_VALUE;
+        if (a->monotonic && snd_pcm_status (a->pcm, a->status) == 0) {
+            snd_pcm_status_get_htstamp (a->status, &ts);
+            if (ts.tv_sec != 0 || ts.tv_nsec != 0)
+                *captured = (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000
+                    - (int64_t) snd_pcm_status_get_avail (a->status) *
+                    1000000 / a->rate;
+        }
+
+        if (av_new_packet (pkt, a->period * a->frame_bytes) < 0)
+            return -1;
+        // the period may wrap around the end of the buffer
+        for (done = 0; done < a->period;) {
+            const snd_pcm_channel_area_t *areas;
+            snd_pcm_uframes_t offset, frames = a->period - done;
+
+            err = snd_pcm_mmap_begin (a->pcm, &areas, &offset, &frames);
+            if (err < 0)
+                break;
+            // interleaved, all channels are in the first area
+            memcpy (pkt->data + done * a->frame_bytes,
+                    (uint8_t *) areas[0].addr +
+                    (areas[0].first + offset * areas[0].step) / 8,
+                    frames * a->frame_bytes);
+            err = snd_pcm_mmap_commit (a->pcm, offset, frames);
+            if (err < 0)
+                break;
+            done += frames;
+        }
+        if (done == a->period)
+            return 0;
+
+        av_free_packet (pkt);
+        if ((err = alsa_recover (a, err)) < 0)
+            return err;
+    }
+}
+
+/**
+ * \brief get the overruns of an ALSA input's buffer
+ *
+ * @param a the ALSA input
+ * @return the number of overruns since the input was opened
+ */
+int
+xvc_alsa_xruns (XVC_AlsaInput * a)
+{
+    return a->xruns;
+}
+
+/**
+ * \brief stop capturing and close an ALSA input
+ *
+ * @param a the ALSA input
+ */
+void
+xvc_alsa_close (XVC_AlsaInput * a)
+{
+    snd_pcm_drop (a->pcm);
+    snd_pcm_close (a->pcm);
+    if (a->status)
+        snd_pcm_status_free (a->status);
+    free (a);
+}
+#else      // HAVE_LIBASOUND
+XVC_AlsaInput *
+xvc_alsa_open (const char *device, int *rate, int *channels,
+               int period_usecs, int buffer_usecs)
+{
+    fprintf (stderr, _("This xvidcap was built without ALSA, cannot capture from %s\n"),
+             device);
+    return NULL;
+}
+
+int
+xvc_alsa_read (XVC_AlsaInput * a, AVPacket * pkt, int64_t * captured)
+{
+    return -1;
+}
+
+int
+xvc_alsa_xruns (XVC_AlsaInput * a)
+{
+    return 0;
+}
+
+void
+xvc_alsa_close (XVC_AlsaInput * a)
+{
+}
+#endif     // HAVE_LIBASOUND
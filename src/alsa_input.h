@@ -0,0 +1,41 @@
+/**
+ * \file alsa_input.h
+ */
+/*
+ * Copyright (C) 2003-07 Karl H. Beckers, Frankfurt
+ * EMail: khb@jarre-de-the.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _xvc_ALSA_INPUT_H__
+#define _xvc_ALSA_INPUT_H__
+
+#include <libavcodec/avcodec.h>
+
+/** \brief prefix of the audio inputs captured through ALSA, e.g. alsa:hw:0 */
+#define ALSA_INPUT_PREFIX "alsa:"
+
+/** \brief an ALSA pcm captured from */
+typedef struct _xvc_AlsaInput XVC_AlsaInput;
+
+int xvc_is_alsa_device (const char *device);
+XVC_AlsaInput *xvc_alsa_open (const char *device, int *rate, int *channels,
+                              int period_usecs, int buffer_usecs);
+int xvc_alsa_read (XVC_AlsaInput * a, AVPacket * pkt, int64_t * captured);
+int xvc_alsa_xruns (XVC_AlsaInput * a);
+void xvc_alsa_close (XVC_AlsaInput * a);
+
+#endif     // _xvc_ALSA_INPUT_H__
@@ -44,6 +44,7 @@
 #include <string.h>
 #include <limits.h>
 #include <ctype.h>
+#include <math.h>
 #include <pthread.h>
 #include <signal.h>
 
@@ -57,10 +58,14 @@
 #include <X11/extensions/Xdamage.h>
 #include <X11/Xatom.h>
 #include <X11/extensions/XShm.h>
+#ifdef HAVE_LIBXRENDER
+#include <X11/extensions/Xrender.h>
+#endif     // HAVE_LIBXRENDER
 
 #include "app_data.h"
 #include "codecs.h"
 #include "frame.h"
+#include "outfile.h"
 #include "xvidcap-intl.h"
 
 
@@ -168,10 +173,26 @@ xvc_appdata_init (XVC_AppData * lapp)
     lapp->verbose = 0;
     lapp->flags = 0;
     lapp->rescale = 0;
+    lapp->threads = 0;
+    lapp->profile = PROFILE_BALANCED;
+    lapp->keyframe_interval = 10;
+    lapp->gop_encoders = 0;
+    lapp->gop_length = 0;
+    lapp->tile_cols = 1;
+    lapp->tile_rows = 1;
+    lapp->output_io = OUTPUT_IO_DEFAULT;
+    lapp->preallocate = 0;
+    lapp->fsync_interval = -1;
+    lapp->fragment_interval = 0;
     lapp->mouseWanted = 0;
     lapp->source = NULL;
     lapp->use_xdamage = -1;
+    lapp->shadow = NULL;
     lapp->snddev = NULL;
+    lapp->audio_gain = 100;
+    lapp->audio_mix = NULL;
+    lapp->audio_period = 0;
+    lapp->audio_buffer = 0;
     lapp->default_mode = 0;
     lapp->current_mode = -1;
     lapp->dpy = NULL;
@@ -256,10 +277,26 @@ xvc_appdata_set_defaults (XVC_AppData * lapp)
 
     // capture source related stuff
     lapp->source = "shm";
+    lapp->shadow = NULL;
     lapp->snddev = "/dev/dsp";
+    lapp->audio_gain = 100;
+    lapp->audio_mix = NULL;
+    lapp->audio_period = 0;
+    lapp->audio_buffer = 0;
 
     lapp->mouseWanted = 1;
     lapp->rescale = 100;
+    lapp->threads = 0;
+    lapp->profile = PROFILE_BALANCED;
+    lapp->keyframe_interval = 10;
+    lapp->gop_encoders = 0;
+    lapp->gop_length = 0;
+    lapp->tile_cols = 1;
+    lapp->tile_rows = 1;
+    lapp->output_io = OUTPUT_IO_DEFAULT;
+    lapp->preallocate = 0;
+    lapp->fsync_interval = -1;
+    lapp->fragment_interval = 0;
 
     // properties of the area to capture
     lapp->area = xvc_get_capture_area ();
@@ -350,6 +387,17 @@ xvc_appdata_copy (XVC_AppData * tapp, const XVC_AppData * sapp)
     tapp->verbose = sapp->verbose;
     tapp->flags = sapp->flags;
     tapp->rescale = sapp->rescale;
+    tapp->threads = sapp->threads;
+    tapp->profile = sapp->profile;
+    tapp->keyframe_interval = sapp->keyframe_interval;
+    tapp->gop_encoders = sapp->gop_encoders;
+    tapp->gop_length = sapp->gop_length;
+    tapp->tile_cols = sapp->tile_cols;
+    tapp->tile_rows = sapp->tile_rows;
+    tapp->output_io = sapp->output_io;
+    tapp->preallocate = sapp->preallocate;
+    tapp->fsync_interval = sapp->fsync_interval;
+    tapp->fragment_interval = sapp->fragment_interval;
     tapp->mouseWanted = sapp->mouseWanted;
     tapp->dpy = sapp->dpy;
     tapp->root_window = sapp->root_window;
@@ -363,7 +411,12 @@ xvc_appdata_copy (XVC_AppData * tapp, const XVC_AppData * sapp)
     tapp->dmg_event_base = sapp->dmg_event_base;
 
     tapp->source = strdup (sapp->source);
+    tapp->shadow = (sapp->shadow ? strdup (sapp->shadow) : NULL);
     tapp->snddev = strdup (sapp->snddev);
+    tapp->audio_gain = sapp->audio_gain;
+    tapp->audio_mix = (sapp->audio_mix ? strdup (sapp->audio_mix) : NULL);
+    tapp->audio_period = sapp->audio_period;
+    tapp->audio_buffer = sapp->audio_buffer;
 
     tapp->xso = sapp->xso;
 
@@ -379,6 +432,91 @@ xvc_appdata_copy (XVC_AppData * tapp, const XVC_AppData * sapp)
     xvc_captypeoptions_copy (&(tapp->multi_frame), &(sapp->multi_frame));
 }
 
+/**
+ * \brief checks a list of audio devices to mix into the audio capture source
+ *
+ * @param mix comma separated devices, each optionally followed by @ and a
+ *      gain in percent
+ * @return TRUE if there are 1 to MAX_AUDIO_MIX_INPUTS devices, none of them
+ *      a pipe and all gains within 0 to 400 percent, FALSE otherwise
+ */
+static int
+is_valid_audio_mix (const char *mix)
+{
+    char *list = strdup (mix), *entry, *save = NULL;
+    int n = 0, valid = (list != NULL);
+
+    for (entry = strtok_r (list, ",", &save); entry && valid;
+         entry = strtok_r (NULL, ",", &save)) {
+        char *at = rindex (entry, '@'), *end = NULL;
+
+        if (at) {
+            long gain = strtol (at + 1, &end, 10);
+
+            if (end == at + 1 || *end != '\0' || gain < 0 || gain > 400)
+                valid = FALSE;
+            *at = '\0';
+        }
+        if (*entry == '\0' || strcmp (entry, "-") == 0 ||
+            strncmp (entry, "pipe:", 5) == 0)
+            valid = FALSE;
+        n++;
+    }
+    free (list);
+
+    return (valid && n > 0 && n <= MAX_AUDIO_MIX_INPUTS);
+}
+
+/**
+ * \brief checks the part of the root window to keep a shadow of
+ *
+ * @param shadow "root" or a geometry WxH+X+Y, where the position may be
+ *      left out for the top left corner
+ * @return TRUE if the shadow is the root window or has a size and no
+ *      negative position, FALSE otherwise
+ */
+static int
+is_valid_shadow (const char *shadow)
+{
+    int x = 0, y = 0, mask;
+    unsigned int width = 0, height = 0;
+
+    if (strcmp (shadow, "root") == 0)
+        return TRUE;
+    mask = XParseGeometry (shadow, &x, &y, &width, &height);
+
+    return ((mask & WidthValue) && (mask & HeightValue) &&
+            !(mask & (XNegative | YNegative)) && width > 0 && height > 0);
+}
+
+#ifdef HAVE_LIBXRENDER
+/**
+ * \brief checks if the X server can scale the capture area for us
+ *
+ * This requires the Render extension in a version supporting picture
+ * transforms (0.6) and a true- or direct-color visual.
+ *
+ * @param lapp a pointer to the XVC_AppData struct to check
+ * @return TRUE if the xrender capture source can be used, FALSE otherwise
+ */
+static int
+xrender_supports_scaling (XVC_AppData * lapp)
+{
+    int event_base, error_base, major = 0, minor = 0;
+
+    if (!XRenderQueryExtension (lapp->dpy, &event_base, &error_base) ||
+        !XRenderQueryVersion (lapp->dpy, &major, &minor))
+        return FALSE;
+    if (major == 0 && minor < 6)
+        return FALSE;
+    if (lapp->win_attr.depth <= 8 ||
+        !XRenderFindVisualFormat (lapp->dpy, lapp->win_attr.visual))
+        return FALSE;
+
+    return TRUE;
+}
+#endif     // HAVE_LIBXRENDER
+
 /**
  * Checks an XVC_AppData struct for consistency
  *
@@ -439,10 +577,21 @@ xvc_appdata_validate(XVC_AppData *lapp, int mode, int *rc)
 
     // start: source
     if (strcasecmp (app->source, "x11") == 0) {
-        // empty
+        lapp->flags &= ~FLG_USE_XRENDER;
     }
-    else if (strcasecmp (app->source, "shm") == 0)
+    else if (strcasecmp (app->source, "shm") == 0) {
         lapp->flags |= FLG_USE_SHM;
+        lapp->flags &= ~FLG_USE_XRENDER;
+    }
+#ifdef HAVE_LIBXRENDER
+    // picture transforms need render 0.6, scaling palette indices makes
+    // no sense
+    else if (strcasecmp (app->source, "xrender") == 0 &&
+             xrender_supports_scaling (lapp)) {
+        lapp->flags |= FLG_USE_XRENDER;
+        lapp->flags &= ~FLG_USE_SHM;
+    }
+#endif     // HAVE_LIBXRENDER
 	else {
         errors = errorlist_append (8, errors, lapp);
         if (!errors) {
@@ -475,6 +624,156 @@ xvc_appdata_validate(XVC_AppData *lapp, int mode, int *rc)
     }
     // end: rescale
 
+    // start: threads
+    if (lapp->threads < 0 || lapp->threads > XVC_MAX_THREADS) {
+        errors = errorlist_append (44, errors, lapp);
+        if (!errors) {
+            *rc = -1;
+            return NULL;
+        }
+    }
+    // end: threads
+
+    // start: profile
+    if (lapp->profile < 0 || lapp->profile >= NUMPROFILES) {
+        errors = errorlist_append (45, errors, lapp);
+        if (!errors) {
+            *rc = -1;
+            return NULL;
+        }
+    }
+    // end: profile
+
+    // start: keyframe_interval
+    if (lapp->keyframe_interval < 0 || lapp->keyframe_interval > 3600) {
+        errors = errorlist_append (46, errors, lapp);
+        if (!errors) {
+            *rc = -1;
+            return NULL;
+        }
+    }
+    // end: keyframe_interval
+
+    // start: gop_encoders
+    if (lapp->gop_encoders < 0 || lapp->gop_encoders > XVC_MAX_THREADS) {
+        errors = errorlist_append (47, errors, lapp);
+        if (!errors) {
+            *rc = -1;
+            return NULL;
+        }
+    }
+    // end: gop_encoders
+
+    // start: gop_length
+    if (lapp->gop_length < 0 || lapp->gop_length > 600) {
+        errors = errorlist_append (48, errors, lapp);
+        if (!errors) {
+            *rc = -1;
+            return NULL;
+        }
+    }
+    // end: gop_length
+
+    // start: tiles
+    if (lapp->tile_cols < 1 || lapp->tile_cols > 8 ||
+        lapp->tile_rows < 1 || lapp->tile_rows > 8) {
+        errors = errorlist_append (49, errors, lapp);
+        if (!errors) {
+            *rc = -1;
+            return NULL;
+        }
+    }
+    // end: tiles
+
+    // start: output_io
+    if (lapp->output_io < 0 || lapp->output_io >= NUMOUTPUTIO
+#ifndef HAVE_LIBURING
+        || lapp->output_io == OUTPUT_IO_URING
+#endif     // HAVE_LIBURING
+        ) {
+        errors = errorlist_append (50, errors, lapp);
+        if (!errors) {
+            *rc = -1;
+            return NULL;
+        }
+    }
+    // end: output_io
+
+    // start: preallocate
+    if (lapp->preallocate < 0 || lapp->preallocate > 4096) {
+        errors = errorlist_append (51, errors, lapp);
+        if (!errors) {
+            *rc = -1;
+            return NULL;
+        }
+    }
+    // end: preallocate
+
+    // start: fsync_interval
+    if (lapp->fsync_interval < -1 || lapp->fsync_interval > 3600) {
+        errors = errorlist_append (52, errors, lapp);
+        if (!errors) {
+            *rc = -1;
+            return NULL;
+        }
+    }
+    // end: fsync_interval
+
+    // start: fragment_interval
+    if (lapp->fragment_interval < 0 || lapp->fragment_interval > 3600) {
+        errors = errorlist_append (56, errors, lapp);
+        if (!errors) {
+            *rc = -1;
+            return NULL;
+        }
+    }
+    // end: fragment_interval
+
+    // start: shadow
+    if (lapp->shadow && !is_valid_shadow (lapp->shadow)) {
+        errors = errorlist_append (62, errors, lapp);
+        if (!errors) {
+            *rc = -1;
+            return NULL;
+        }
+    }
+    // end: shadow
+
+    // start: audio_gain
+    if (lapp->audio_gain < 0 || lapp->audio_gain > 400) {
+        errors = errorlist_append (59, errors, lapp);
+        if (!errors) {
+            *rc = -1;
+            return NULL;
+        }
+    }
+    // end: audio_gain
+
+    // start: audio_mix
+    if (lapp->audio_mix && !is_valid_audio_mix (lapp->audio_mix)) {
+        errors = errorlist_append (60, errors, lapp);
+        if (!errors) {
+            *rc = -1;
+            return NULL;
+        }
+    }
+    // end: audio_mix
+
+    // start: audio_period
+    if ((lapp->audio_period != 0 &&
+         (lapp->audio_period < 1000 || lapp->audio_period > 1000000)) ||
+        lapp->audio_buffer < 0 || lapp->audio_buffer > 2000000 ||
+        (lapp->audio_buffer != 0 &&
+         lapp->audio_buffer <
+         2 * (lapp->audio_period > 0 ? lapp->audio_period : 1000))) {
+        errors = errorlist_append (61, errors, lapp);
+        if (!errors) {
+            *rc = -1;
+            return NULL;
+        }
+    }
+    // end: audio_period
+
 	
     /*
      * Now check target capture type options
@@ -815,7 +1114,7 @@ error_7_action (XVC_ErrorListItem * err)
 static void
 error_8_action (XVC_ErrorListItem * err)
 {
-    err->app->flags &= ~FLG_USE_SHM;
+    err->app->flags &= ~(FLG_USE_SHM | FLG_USE_XRENDER);
     err->app->source = "x11";
 }
 
@@ -1010,6 +1309,92 @@ error_42_action (XVC_ErrorListItem * err)
     target->audioWanted = 0;
 }
 
+static void
+error_44_action (XVC_ErrorListItem * err)
+{
+    err->app->threads = 0;
+}
+
+static void
+error_45_action (XVC_ErrorListItem * err)
+{
+    err->app->profile = PROFILE_BALANCED;
+}
+
+static void
+error_46_action (XVC_ErrorListItem * err)
+{
+    err->app->keyframe_interval = 10;
+}
+
+static void
+error_47_action (XVC_ErrorListItem * err)
+{
+    err->app->gop_encoders = 0;
+}
+
+static void
+error_48_action (XVC_ErrorListItem * err)
+{
+    err->app->gop_length = 0;
+}
+
+static void
+error_49_action (XVC_ErrorListItem * err)
+{
+    err->app->tile_cols = 1;
+    err->app->tile_rows = 1;
+}
+
+static void
+error_50_action (XVC_ErrorListItem * err)
+{
+    err->app->output_io = OUTPUT_IO_DEFAULT;
+}
+
+static void
+error_51_action (XVC_ErrorListItem * err)
+{
+    err->app->preallocate = 0;
+}
+
+static void
+error_52_action (XVC_ErrorListItem * err)
+{
+    err->app->fsync_interval = -1;
+}
+
+static void
+error_56_action (XVC_ErrorListItem * err)
+{
+    err->app->fragment_interval = 0;
+}
+
+static void
+error_59_action (XVC_ErrorListItem * err)
+{
+    err->app->audio_gain = 100;
+}
+
+static void
+error_60_action (XVC_ErrorListItem * err)
+{
+    err->app->audio_mix = NULL;
+}
+
+static void
+error_61_action (XVC_ErrorListItem * err)
+{
+    err->app->audio_period = 0;
+    err->app->audio_buffer = 0;
+}
+
+static void
+error_62_action (XVC_ErrorListItem * err)
+{
+    err->app->shadow = NULL;
+}
+
 /**
  * \brief an array of all preferences related errors known to xvidcap.
  *
@@ -1396,6 +1781,177 @@ const XVC_Error xvc_errors[NUMERRORS] = {
      ("For multi-frame capture you selected audio support but picked a file format without support for audio."),
      error_42_action,
      N_("Disable audio capture for multi-frame capture")
+     },
+    {
+     44,
+     XVC_ERR_WARN,
+     N_("Invalid number of encoder threads"),
+     N_
+     ("The number of encoder threads must be between 1 and 64, or 0 to use one thread per online processor."),
+     error_44_action,
+     N_("Set number of encoder threads to '0' (one per online processor)")
+     },
+    {
+     45,
+     XVC_ERR_WARN,
+     N_("Unknown encoder performance profile"),
+     N_
+     ("The encoder performance profile must be one of 'realtime', 'balanced', or 'archive'."),
+     error_45_action,
+     N_("Use the 'balanced' encoder performance profile")
+     },
+    {
+     46,
+     XVC_ERR_WARN,
+     N_("Invalid keyframe interval"),
+     N_
+     ("The maximum interval between keyframes must be between 1 and 3600 seconds, or 0 to leave keyframe placement to the encoder."),
+     error_46_action,
+     N_("Set maximum keyframe interval to '10' seconds")
+     },
+    {
+     47,
+     XVC_ERR_WARN,
+     N_("Invalid number of gop encoders"),
+     N_
+     ("The number of encoders working on consecutive gops in parallel must be between 2 and 64, or 0 for a single encoder."),
+     error_47_action,
+     N_("Set number of gop encoders to '0' (single encoder)")
+     },
+    {
+     48,
+     XVC_ERR_WARN,
+     N_("Invalid gop length"),
+     N_
+     ("The number of frames per gop for parallel gop encoding must be between 1 and 600, or 0 for one second worth of frames."),
+     error_48_action,
+     N_("Set gop length to '0' (one second worth of frames)")
+     },
+    {
+     49,
+     XVC_ERR_WARN,
+     N_("Invalid tile grid"),
+     N_
+     ("The capture area can be split into 1 to 8 columns and 1 to 8 rows of tiles for encoding."),
+     error_49_action,
+     N_("Do not split the capture area into tiles (1x1)")
+     },
+    {
+     50,
+     XVC_ERR_WARN,
+     N_("Invalid output io"),
+     N_
+     ("The output file can be written through 'avio', 'blocks' or, if this binary was built with liburing, 'uring'."),
+     error_50_action,
+     N_("Use the default output io")
+     },
+    {
+     51,
+     XVC_ERR_WARN,
+     N_("Invalid preallocation"),
+     N_
+     ("The output file can be preallocated by 1 to 4096 MB ahead of the writes, or 0 for no preallocation."),
+     error_51_action,
+     N_("Do not preallocate the output file")
+     },
+    {
+     52,
+     XVC_ERR_WARN,
+     N_("Invalid fsync interval"),
+     N_
+     ("The output file can be synced to disk every 1 to 3600 seconds, 0 to sync it when it is closed only, or -1 to leave syncing to the system."),
+     error_52_action,
+     N_("Leave syncing the output file to the system (-1)")
+     },
+    {
+     53,
+     XVC_ERR_WARN,
+     N_("Output storage too slow"),
+     N_
+     ("The disk the output file is written to does not keep up with the recording, encoded frames pile up in memory."),
+     error_null_action,
+     N_("Lower the video quality until the backlog clears")
+     },
+    {
+     54,
+     XVC_ERR_WARN,
+     N_("Frames dropped for slow storage"),
+     N_
+     ("The disk the output file is written to has fallen far behind the recording even with a lower video quality."),
+     error_null_action,
+     N_("Drop every other frame until the backlog is down again")
+     },
+    {
+     55,
+     XVC_ERR_INFO,
+     N_("Output storage caught up"),
+     N_
+     ("The disk the output file is written to keeps up with the recording again."),
+     error_null_action,
+     N_("Record with the video quality asked for")
+     },
+    {
+     56,
+     XVC_ERR_WARN,
+     N_("Invalid fragment interval"),
+     N_
+     ("The output file can be flushed in fragments of 1 to 3600 seconds, or 0 for no fragments."),
+     error_56_action,
+     N_("Do not write the output file in fragments")
+     },
+    {
+     57,
+     XVC_ERR_WARN,
+     N_("Audio encoding too slow"),
+     N_
+     ("The audio encoder does not keep up with the audio captured, the buffer between capturing and encoding is full."),
+     error_null_action,
+     N_("Drop captured audio until the encoder catches up")
+     },
+    {
+     58,
+     XVC_ERR_INFO,
+     N_("Audio encoding caught up"),
+     N_
+     ("The audio encoder keeps up with the audio captured again."),
+     error_null_action,
+     N_("Encode all audio captured")
+     },
+    {
+     59,
+     XVC_ERR_WARN,
+     N_("Invalid audio gain"),
+     N_
+     ("The audio capture source can be recorded at 0 to 400 percent of its volume."),
+     error_59_action,
+     N_("Record the audio capture source at its volume")
+     },
+    {
+     60,
+     XVC_ERR_WARN,
+     N_("Invalid audio devices to mix in"),
+     N_
+     ("Up to 3 audio devices can be mixed into the audio capture source, separated by commas and each optionally followed by @ and a gain of 0 to 400 percent. Pipes cannot be mixed in."),
+     error_60_action,
+     N_("Record the audio capture source only")
+     },
+    {
+     61,
+     XVC_ERR_WARN,
+     N_("Invalid ALSA period or buffer"),
+     N_
+     ("An ALSA period can be 1000 to 1000000 usecs and the buffer up to 2000000 usecs holding at least two periods, or 0 for the device's default."),
+     error_61_action,
+     N_("Use the device's default period and buffer")
+     },
+    {
+     62,
+     XVC_ERR_WARN,
+     N_("Invalid shadow"),
+     N_
+     ("The shadow captures are cropped from must be root for the whole screen or a geometry like 1920x1080+0+0."),
+     error_62_action,
+     N_("Capture without a shadow")
      }
 };
 
@@ -1905,3 +2461,27 @@ xvc_appdata_set_window_attributes (Window win)
 {
     xvc_get_window_attributes (app->dpy, win, &(app->win_attr));
 }
+
+/**
+ * \brief works out the factor the sides of the capture area are scaled by
+ *
+ * The area is scaled by the rescale percentage, which is snapped to the
+ * closest of 1, 1/2, 1/4, or 1/8 if FLG_RESCALE_SNAP is set, so a fast box
+ * filter can scale it down.
+ *
+ * @param lapp a pointer to the XVC_AppData struct with the rescale settings
+ * @return the factor the width and height of the area are multiplied by
+ */
+double
+xvc_appdata_get_rescale_factor (const XVC_AppData * lapp)
+{
+    double r = sqrt ((double) lapp->rescale / 100.0);
+
+    if (lapp->flags & FLG_RESCALE_SNAP) {
+        int ratio = 1 << (int) floor (log (1.0 / r) / log (2.0) + 0.5);
+
+        ratio = XVC_MAX (1, XVC_MIN (8, ratio));
+        r = 1.0 / ratio;
+    }
+    return r;
+}
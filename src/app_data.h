@@ -41,6 +41,11 @@ enum XVC_Flags
     FLG_RUN_VERBOSE = 1,
 /** \brief use shared memory access to X11 */
     FLG_USE_SHM = 2,
+/**
+ * \brief scale the capture area on the X server through XRender before
+ *      transferring it
+ */
+    FLG_USE_XRENDER = 4,
 
 /**
  * \brief should we record sound
@@ -59,6 +64,11 @@ enum XVC_Flags
     FLG_SHOW_TIME = 256,
 /** \brief always show the results dialog */
     FLG_ALWAYS_SHOW_RESULTS = 512,
+/**
+ * \brief snap the rescale percentage to the closest of 1/2, 1/4, or 1/8 of
+ *      the captured dimensions, which can be scaled down by a fast box filter
+ */
+    FLG_RESCALE_SNAP = 1024,
 /** \brief minimize xvidcap to the system tray while recording */
     FLG_TO_TRAY = 4096,
 /**
@@ -129,6 +139,51 @@ typedef struct
     int flags;
     /** \brief rescale to percentage */
     int rescale;
+    /** \brief number of encoder threads, 0 means one per online processor */
+    int threads;
+    /** \brief encoder performance profile
+     *
+     * @see XVC_ProfileId
+     */
+    int profile;
+    /**
+     * \brief maximum time in seconds between two intra frames when intra
+     *      frames are placed by the damaged share of the capture area, 0 to
+     *      leave that to the encoder
+     */
+    int keyframe_interval;
+    /**
+     * \brief number of encoders working on consecutive gops in parallel,
+     *      0 or 1 for a single encoder
+     */
+    int gop_encoders;
+    /**
+     * \brief frames per gop with parallel gop encoding, 0 for one second
+     *      worth of frames
+     */
+    int gop_length;
+    /**
+     * \brief number of columns and rows of tiles the capture area is split
+     *      into for encoding, 1x1 for no tiles
+     */
+    int tile_cols;
+    int tile_rows;
+    /** \brief how the output file is written
+     *
+     * @see XVC_OutputIoId
+     */
+    int output_io;
+    /** \brief MB to preallocate the output file by ahead of the writes, 0
+     *      for none */
+    int preallocate;
+    /** \brief secs between syncs of the output file to disk, 0 to sync when
+     *      closing the file only, -1 to leave syncing to the system */
+    int fsync_interval;
+    /**
+     * \brief secs between the fragments the output file is flushed in at
+     *      the next keyframe, 0 for no fragments
+     */
+    int fragment_interval;
     /**
      * \brief capture mouse pointer: 0 none, 1 white , 2 black.
      *
@@ -141,8 +196,28 @@ typedef struct
     /** \brief controls the use of the XDamage extension for screen capture
      * -1 == auto, 0 == off, 1 == on */
     int use_xdamage;
+    /**
+     * \brief part of the root window to keep a damage-maintained shadow of,
+     *      which captures are then cropped from: "root" or a geometry
+     *      WxH+X+Y, NULL for none
+     */
+    char *shadow;
     /** \brief audio capture source */
     char *snddev;
+    /** \brief gain in percent applied to the audio capture source */
+    int audio_gain;
+    /**
+     * \brief comma separated list of further audio devices mixed into the
+     *      audio track, each optionally followed by @ and its gain in
+     *      percent, NULL for none
+     */
+    char *audio_mix;
+    /**
+     * \brief usecs per period and in the buffer of audio inputs captured
+     *      through ALSA, 0 for the device's default
+     */
+    int audio_period;
+    int audio_buffer;
     /**
      * \brief window attributes for area to capture.
      *
@@ -260,7 +335,10 @@ typedef struct _xvc_Error
     const char *action_msg;
 } XVC_Error;
 
-#define NUMERRORS              43
+#define NUMERRORS              62
+
+/** \brief most audio devices mixed into the audio capture source */
+#define MAX_AUDIO_MIX_INPUTS   3
 
 extern const XVC_Error xvc_errors[NUMERRORS];
 
@@ -292,6 +370,7 @@ void xvc_appdata_merge_captypeoptions (XVC_CapTypeOptions * cto,
                                        XVC_AppData * lapp);
 XVC_ErrorListItem *xvc_appdata_validate (XVC_AppData * lapp, int mode, int *rc);
 void xvc_appdata_set_window_attributes (Window win);
+double xvc_appdata_get_rescale_factor (const XVC_AppData * lapp);
 
 void xvc_captypeoptions_copy (XVC_CapTypeOptions * topts,
                               const XVC_CapTypeOptions * sopts);
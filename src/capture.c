@@ -34,6 +34,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <limits.h>
+#include <math.h>
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
@@ -54,6 +55,9 @@
 #include <X11/extensions/XShm.h>
 #include <X11/extensions/shmstr.h>
 #include <X11/extensions/extutil.h>
+#ifdef HAVE_LIBXRENDER
+#include <X11/extensions/Xrender.h>
+#endif     // HAVE_LIBXRENDER
 
 #include <errno.h>
 
@@ -79,6 +83,54 @@ static unsigned char bottom[65536];
     of Xdamage */
 static XRectangle pointer_area;
 
+/** \brief serial of the cursor image painted into the previous frame, which
+ *      changes whenever the cursor image does */
+static unsigned long pointer_serial = 0;
+
+/** \brief number of frames captured and the total time spent on capturing
+ *      them in micro seconds, reported in verbose mode */
+static int capture_frames = 0;
+static long capture_usecs = 0;
+
+#ifdef HAVE_LIBXRENDER
+/** \brief picture on the root window the xrender source reads from */
+static Picture xr_root_pict = None;
+
+/** \brief offscreen pixmap the scaled capture area is rendered to */
+static Pixmap xr_pixmap = None;
+
+/** \brief picture on xr_pixmap */
+static Picture xr_pict = None;
+#endif     // HAVE_LIBXRENDER
+
+/**
+ * \brief damage-maintained copy of the part of the root window frames are
+ *      cropped from, NULL if no shadow is kept
+ */
+static XImage *shadow_image = NULL;
+static XShmSegmentInfo shadow_shminfo;
+
+/** \brief the part of the root window shadow_image holds */
+static XRectangle shadow_area;
+
+/**
+ * \brief bytes read from the X server while a shadow is kept, frames cropped
+ *      from the shadow and frames captured directly because the capture area
+ *      was not within it, reported in verbose mode
+ */
+static long long shadow_fetched = 0;
+static int shadow_frames = 0;
+static int shadow_misses = 0;
+
+/**
+ * \brief window moves applied to the pixels kept from the previous frame,
+ *      bytes moved there instead of being read and bytes read for the parts
+ *      of moved windows that were not kept, reported in verbose mode
+ */
+static int move_count = 0;
+static long long move_blitted = 0;
+static long long move_exposed = 0;
+
 /**
  * \brief since the capture functions have been merged, we need a way for the
  *      commonCapture() function to distinguish between the possible sources.
@@ -89,6 +141,8 @@ enum captureFunctions
     X11,
     /** \brief X11 with SHM extension */
     SHM,
+    /** \brief X11 with scaling through the XRender extension */
+    XRENDER,
     /** \brief element counter */
     NUMFUNCTIONS
 };
@@ -601,6 +655,166 @@ placeImageInImage (char *needle, int needle_x, int needle_y,
     }
 }
 
+/**
+ * \brief computes the number of pixels in a region
+ *
+ * @param region the region
+ * @return the number of pixels covered
+ */
+static long
+getRegionPixels (Region region)
+{
+    long pixels = 0;
+    int i;
+
+    // the rectangles of a Region never overlap
+    for (i = 0; i < region->numRects; i++)
+        pixels += (long) (region->rects[i].x2 - region->rects[i].x1) *
+            (region->rects[i].y2 - region->rects[i].y1);
+
+    return pixels;
+}
+
+/**
+ * \brief drops the windows moved since the last frame, which are of no use
+ *      when the frame is read completely
+ */
+static void
+dropWindowMoves ()
+{
+    XVC_DamageMove moves[MAX_DAMAGE_MOVES];
+    int i, num_moves = xvc_get_damage_moves (moves);
+
+    for (i = 0; i < num_moves; i++)
+        XDestroyRegion (moves[i].region);
+}
+
+/**
+ * \brief moves the pixels of a region within an image
+ *
+ * All sources are read before any destination is written, so they may
+ * overlap.
+ *
+ * @param image the image
+ * @param region the destinations in image coordinates
+ * @param dx the distance the pixels move horizontally
+ * @param dy the distance the pixels move vertically
+ * @return FALSE if there was no memory to buffer the sources
+ */
+static Boolean
+blitRegionInImage (XImage * image, Region region, int dx, int dy)
+{
+    int bytes_pp = image->bits_per_pixel >> 3;
+    long size = getRegionPixels (region) * bytes_pp;
+    char *buffer, *cursor;
+    int i, line;
+
+    if (size == 0)
+        return TRUE;
+    buffer = malloc (size);
+    if (!buffer)
+        return FALSE;
+
+    for (i = 0, cursor = buffer; i < region->numRects; i++) {
+        Box *box = &(region->rects[i]);
+        int bytes = (box->x2 - box->x1) * bytes_pp;
+
+        for (line = box->y1; line < box->y2; line++, cursor += bytes)
+            memcpy (cursor, image->data + (line - dy) * image->bytes_per_line +
+                    (box->x1 - dx) * bytes_pp, bytes);
+    }
+    for (i = 0, cursor = buffer; i < region->numRects; i++) {
+        Box *box = &(region->rects[i]);
+        int bytes = (box->x2 - box->x1) * bytes_pp;
+
+        for (line = box->y1; line < box->y2; line++, cursor += bytes)
+            memcpy (image->data + line * image->bytes_per_line +
+                    box->x1 * bytes_pp, cursor, bytes);
+    }
+    free (buffer);
+
+    return TRUE;
+}
+
+/**
+ * \brief applies the windows moved since the last frame to the pixels kept
+ *      from it instead of reading the moved windows again
+ *
+ * Only the parts of a moved window that were not within the kept pixels
+ * before the move are added to the region to read, along with whatever
+ * stale pixels later moves carried elsewhere.
+ *
+ * @param image the pixels kept from the last frame
+ * @param bounds the part of the root window image holds
+ * @param fetch the damaged region to read, in root window coordinates
+ * @param moved gets the parts of image changed by the moves
+ * @param painted an area of image painted over after it was read, like the
+ *      mouse pointer, or NULL
+ */
+static void
+applyWindowMoves (XImage * image, XRectangle * bounds, Region fetch,
+                  Region moved, XRectangle * painted)
+{
+    XVC_DamageMove moves[MAX_DAMAGE_MOVES];
+    Region inside = XCreateRegion (), stale = XCreateRegion ();
+    int i, num_moves = xvc_get_damage_moves (moves);
+    int bytes_pp = image->bits_per_pixel >> 3;
+
+    XUnionRectWithRegion (bounds, inside, inside);
+    if (painted)
+        XUnionRectWithRegion (painted, stale, stale);
+
+    for (i = 0; i < num_moves; i++) {
+        Region blit = XCreateRegion (), exposed = XCreateRegion ();
+        Region source = XCreateRegion ();
+        Boolean blitted;
+
+        // what was copied within the image can be moved there if it was
+        // within the image before, too
+        XIntersectRegion (moves[i].region, inside, exposed);
+        XUnionRegion (inside, source, source);
+        XOffsetRegion (source, moves[i].dx, moves[i].dy);
+        XIntersectRegion (exposed, source, blit);
+        XSubtractRegion (exposed, blit, exposed);
+
+        XOffsetRegion (blit, -bounds->x, -bounds->y);
+        blitted = blitRegionInImage (image, blit, moves[i].dx, moves[i].dy);
+        XOffsetRegion (blit, bounds->x, bounds->y);
+        if (blitted) {
+            move_blitted += getRegionPixels (blit) * bytes_pp;
+        } else {
+            // without memory to move it, the window is read again
+            XUnionRegion (blit, exposed, exposed);
+            XDestroyRegion (blit);
+            blit = XCreateRegion ();
+        }
+        move_exposed += getRegionPixels (exposed) * bytes_pp;
+
+        // stale pixels moved along stay stale
+        XDestroyRegion (source);
+        source = XCreateRegion ();
+        XUnionRegion (stale, source, source);
+        XOffsetRegion (source, moves[i].dx, moves[i].dy);
+        XIntersectRegion (source, blit, source);
+        XUnionRegion (source, stale, stale);
+        XUnionRegion (exposed, stale, stale);
+
+        XUnionRegion (blit, moved, moved);
+        XUnionRegion (exposed, moved, moved);
+
+        XDestroyRegion (source);
+        XDestroyRegion (exposed);
+        XDestroyRegion (blit);
+        XDestroyRegion (moves[i].region);
+    }
+    move_count += num_moves;
+
+    XIntersectRegion (stale, inside, stale);
+    XUnionRegion (stale, fetch, fetch);
+    XDestroyRegion (stale);
+    XDestroyRegion (inside);
+}
+
 /**
  * \brief compute the output filename depending on current capture mode and
  *      frame or movie number. Then open that file for writing.
@@ -648,6 +862,7 @@ captureFrameToImage(Display * dpy, XImage * image)
 	// get the damage up to now
     // we're assuming we're on a locked and synched display
     damaged_region = xvc_get_damage_region();
+    dropWindowMoves ();
 
     // get the image here
     if (XGetZPixmapToXImage(dpy, app->root_window, image, app->area->x, app->area->y)) {
@@ -729,6 +944,7 @@ captureFrameToImageSHM(Display * dpy, XImage * image)
 	// get the damage up to now
     // we're assuming we're on a locked and synched display
     damaged_region = xvc_get_damage_region();
+    dropWindowMoves ();
 
     // get the image here
     if (XShmGetImage(dpy, app->root_window, image, app->area->x, app->area->y, AllPlanes)) {
@@ -817,6 +1033,572 @@ captureFrameCreatingImageSHM(Display *dpy, XShmSegmentInfo *shminfo)
 }
 
 
+/**
+ * \brief gets the part of the root window damage needs to be tracked for
+ *
+ * While a shadow is kept this is all of the shadow, otherwise only the
+ * capture area.
+ *
+ * @return the rectangle damage is clipped to
+ */
+XRectangle *
+xvc_capture_damage_area ()
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+
+    return (shadow_image ? &shadow_area : app->area);
+}
+
+/**
+ * \brief works out the part of the root window to keep a shadow of
+ *
+ * @param rect gets the part of the root window clipped to the screen
+ * @return TRUE if a shadow is wanted, FALSE otherwise
+ */
+static Boolean
+getShadowArea (XRectangle * rect)
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+    int x = 0, y = 0, px, py, mask;
+    unsigned int width = app->max_width, height = app->max_height, pw, ph;
+
+    if (!app->shadow)
+        return FALSE;
+    // only what the geometry gives replaces the whole screen
+    if (strcmp (app->shadow, "root") != 0) {
+        mask = XParseGeometry (app->shadow, &px, &py, &pw, &ph);
+        if (mask & XValue)
+            x = px;
+        if (mask & YValue)
+            y = py;
+        if (mask & WidthValue)
+            width = pw;
+        if (mask & HeightValue)
+            height = ph;
+    }
+
+    rect->x = XVC_MIN (x, app->max_width - 1);
+    rect->y = XVC_MIN (y, app->max_height - 1);
+    rect->width = XVC_MIN ((int) width, app->max_width - rect->x);
+    rect->height = XVC_MIN ((int) height, app->max_height - rect->y);
+
+    return TRUE;
+}
+
+/**
+ * \brief creates the shadow of shadow_area and reads it completely
+ *
+ * @param dpy a pointer to the display to read from
+ * @param capfunc the source, either X11 or SHM
+ * @param dmg_shminfo gets the shared memory segment info of the image
+ *      returned for the SHM source
+ * @return a new image damaged rectangles are read into before they are
+ *      placed in the shadow, as large as the capture area and read through
+ *      in pieces by larger rectangles
+ */
+static XImage *
+createShadow (Display * dpy, enum captureFunctions capfunc,
+              XShmSegmentInfo * dmg_shminfo)
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+    XImage *dmg_image = NULL;
+    int dmg_width = XVC_MIN (app->area->width, shadow_area.width);
+    int dmg_height = XVC_MIN (app->area->height, shadow_area.height);
+
+    switch (capfunc) {
+    case SHM:
+        shadow_image = createImageSHM (dpy, &shadow_shminfo,
+                                       shadow_area.width, shadow_area.height);
+        if (shadow_image &&
+            !XShmGetImage (dpy, app->root_window, shadow_image, shadow_area.x,
+                           shadow_area.y, AllPlanes)) {
+            XShmDetach (dpy, &shadow_shminfo);
+            shmdt (shadow_shminfo.shmaddr);
+            shadow_image->data = NULL;
+            XDestroyImage (shadow_image);
+            shadow_image = NULL;
+        }
+        if (shadow_image)
+            dmg_image = createImageSHM (dpy, dmg_shminfo, dmg_width,
+                                        dmg_height);
+        break;
+    case X11:
+    default:
+        shadow_image = XGetImage (dpy, app->root_window, shadow_area.x,
+                                  shadow_area.y, shadow_area.width,
+                                  shadow_area.height, AllPlanes, ZPixmap);
+        if (shadow_image) {
+            dmg_image = XCreateImage (dpy, app->win_attr.visual,
+                                      shadow_image->depth, ZPixmap, 0, NULL,
+                                      dmg_width, dmg_height,
+                                      shadow_image->bitmap_pad, 0);
+            if (dmg_image)
+                dmg_image->data =
+                    malloc (dmg_image->bytes_per_line * dmg_image->height);
+        }
+    }
+    if (!shadow_image || !dmg_image || !dmg_image->data) {
+        fprintf (stderr, _("Can't get shadow: %dx%d+%d+%d\n"),
+                 shadow_area.width, shadow_area.height, shadow_area.x,
+                 shadow_area.y);
+        exit (1);
+    }
+    shadow_fetched +=
+        (long long) shadow_image->bytes_per_line * shadow_image->height;
+
+    if (app->verbose) {
+        printf ("shadow: %dx%d+%d+%d, %i KB, %i KB to read damage through\n",
+                shadow_area.width, shadow_area.height, shadow_area.x,
+                shadow_area.y,
+                shadow_image->bytes_per_line * shadow_image->height / 1024,
+                dmg_image->bytes_per_line * dmg_image->height / 1024);
+    }
+
+    return dmg_image;
+}
+
+/**
+ * \brief frees the shadow
+ *
+ * @param dpy a pointer to the display the shadow was read from
+ * @param capfunc the source, either X11 or SHM
+ */
+static void
+destroyShadow (Display * dpy, enum captureFunctions capfunc)
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+    XImage *image = shadow_image;
+    int bytes_pp;
+
+    if (!image)
+        return;
+    bytes_pp = image->bits_per_pixel >> 3;
+    // stop clipping damage to the shadow before it goes
+    shadow_image = NULL;
+    if (capfunc == SHM) {
+        XShmDetach (dpy, &shadow_shminfo);
+        shmdt (shadow_shminfo.shmaddr);
+        image->data = NULL;
+    }
+    XDestroyImage (image);
+
+    if (app->verbose && shadow_frames + shadow_misses > 0) {
+        long long full = (long long) (shadow_frames + shadow_misses) *
+            app->area->width * app->area->height * bytes_pp;
+
+        printf ("shadow: %i frames cropped, %i captured outside, %lli KB read (%lli KB for full frames)\n",
+                shadow_frames, shadow_misses, shadow_fetched / 1024,
+                full / 1024);
+    }
+    shadow_fetched = 0;
+    shadow_frames = shadow_misses = 0;
+}
+
+/**
+ * \brief reads what was damaged into the shadow
+ *
+ * @param dpy a pointer to the display to read from, locked and synched
+ * @param capfunc the source, either X11 or SHM
+ * @param shm_opcode the major opcode for the shm extension
+ * @param region the damaged region in root window coordinates, within
+ *      shadow_area
+ * @param dmg_image the image returned by createShadow()
+ * @param dmg_shminfo the shared memory segment info of dmg_image
+ */
+static void
+updateShadow (Display * dpy, enum captureFunctions capfunc, int shm_opcode,
+              Region region, XImage * dmg_image, XShmSegmentInfo * dmg_shminfo)
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+    int bytes_pp = shadow_image->bits_per_pixel >> 3;
+    int i;
+
+    for (i = 0; i < region->numRects; i++) {
+        int x1 = XVC_MIN (region->rects[i].x1, region->rects[i].x2);
+        int y1 = XVC_MIN (region->rects[i].y1, region->rects[i].y2);
+        int x2 = XVC_MAX (region->rects[i].x1, region->rects[i].x2);
+        int y2 = XVC_MAX (region->rects[i].y1, region->rects[i].y2);
+        int x, y;
+
+        // rectangles larger than dmg_image are read in pieces
+        for (y = y1; y < y2; y += dmg_image->height) {
+            for (x = x1; x < x2; x += dmg_image->width) {
+                int width = XVC_MIN (x2 - x, dmg_image->width);
+                int height = XVC_MIN (y2 - y, dmg_image->height);
+                // lines read without an XImage are aligned to 4 bytes
+                int bpl = ((width * bytes_pp + 3) / 4) * 4;
+
+                switch (capfunc) {
+                case SHM:
+                    XGetZPixmapSHM (dpy, app->root_window, dmg_shminfo,
+                                    shm_opcode, dmg_image->data, x, y, width,
+                                    height);
+                    break;
+                case X11:
+                default:
+                    XGetZPixmap (dpy, app->root_window, dmg_image->data, x,
+                                 y, width, height);
+                }
+                placeImageInImage (dmg_image->data, x - shadow_area.x,
+                                   y - shadow_area.y, width, bpl, height,
+                                   shadow_image->data, shadow_image->width,
+                                   shadow_image->bytes_per_line,
+                                   shadow_image->height, bytes_pp);
+                shadow_fetched += (long long) bpl * height;
+            }
+        }
+    }
+}
+
+/**
+ * \brief checks if the capture area can be cropped from the shadow
+ *
+ * @return TRUE if the capture area lies within shadow_area
+ */
+static Boolean
+isAreaInShadow ()
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+
+    return (app->area->x >= shadow_area.x && app->area->y >= shadow_area.y &&
+            app->area->x + app->area->width <=
+            shadow_area.x + shadow_area.width &&
+            app->area->y + app->area->height <=
+            shadow_area.y + shadow_area.height);
+}
+
+/**
+ * \brief copies a rectangle of the capture area from the shadow into the
+ *      frame
+ *
+ * @param image the frame as large as the capture area
+ * @param x the x position of the rectangle on the root window
+ * @param y the y position of the rectangle on the root window
+ * @param width the width of the rectangle
+ * @param height the height of the rectangle
+ */
+static void
+cropShadow (XImage * image, int x, int y, int width, int height)
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+    int bytes_pp = image->bits_per_pixel >> 3;
+
+    placeImageInImage (shadow_image->data +
+                       (x - shadow_area.x) * bytes_pp +
+                       (y - shadow_area.y) * shadow_image->bytes_per_line,
+                       x - app->area->x, y - app->area->y, width,
+                       shadow_image->bytes_per_line, height, image->data,
+                       image->width, image->bytes_per_line, image->height,
+                       bytes_pp);
+}
+
+
+#ifdef HAVE_LIBXRENDER
+/**
+ * \brief set a picture transform that maps the scaled destination back to
+ *      the source
+ *
+ * XRender transforms map destination to source coordinates, so this scales
+ * by 1/scale and then moves to the origin of the area on the source.
+ *
+ * @param dpy a pointer to the display
+ * @param pict the source picture
+ * @param scale the linear factor by which the source is scaled down
+ * @param x the x position on the source that is the destination's origin
+ * @param y the y position on the source that is the destination's origin
+ */
+static void
+setXRenderTransform (Display * dpy, Picture pict, double scale, int x, int y)
+{
+    XTransform xform = { {
+        {XDoubleToFixed (1.0 / scale), XDoubleToFixed (0), XDoubleToFixed (x)},
+        {XDoubleToFixed (0), XDoubleToFixed (1.0 / scale), XDoubleToFixed (y)},
+        {XDoubleToFixed (0), XDoubleToFixed (0), XDoubleToFixed (1)}
+    } };
+
+    XRenderSetPictureTransform (dpy, pict, &xform);
+}
+
+/**
+ * \brief composite the mouse pointer onto the scaled capture area
+ *
+ * The pointer shape from XFixes is uploaded as an argb picture and scaled
+ * by the same factor as the capture area. This way the pointer is painted
+ * on the server, too, and the client never touches the pixels.
+ *
+ * @param dpy a pointer to the display
+ * @param my_x_cursor the XFixesCursorImage of the current mouse pointer
+ * @param scale the linear factor by which the capture area is scaled
+ */
+static void
+compositeMousePointerXRender (Display * dpy, XFixesCursorImage * my_x_cursor,
+                              double scale)
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+    XRenderPictFormat *argb_format = NULL;
+    XImage *cursor_image = NULL;
+    Pixmap cursor_pixmap;
+    Picture cursor_pict;
+    GC gc;
+    uint32_t *pixels = NULL;
+    int x, y, i, dst_x, dst_y, dst_width, dst_height;
+
+    if (!my_x_cursor)
+        return;
+
+    x = my_x_cursor->x - my_x_cursor->xhot;
+    y = my_x_cursor->y - my_x_cursor->yhot;
+    // only composite the pointer if it is within the capture area
+    if ((x + my_x_cursor->width) < app->area->x ||
+        x >= (app->area->x + app->area->width) ||
+        (y + my_x_cursor->height) < app->area->y ||
+        y >= (app->area->y + app->area->height))
+        return;
+
+    argb_format = XRenderFindStandardFormat (dpy, PictStandardARGB32);
+    // XFixes hands out the pixels as longs
+    pixels = malloc (my_x_cursor->width * my_x_cursor->height * 4);
+    if (!argb_format || !pixels) {
+        free (pixels);
+        return;
+    }
+    for (i = 0; i < my_x_cursor->width * my_x_cursor->height; i++)
+        pixels[i] = (uint32_t) my_x_cursor->pixels[i];
+
+    cursor_pixmap = XCreatePixmap (dpy, app->root_window, my_x_cursor->width,
+                                   my_x_cursor->height, 32);
+    cursor_image = XCreateImage (dpy, NULL, 32, ZPixmap, 0, (char *) pixels,
+                                 my_x_cursor->width, my_x_cursor->height, 32,
+                                 0);
+    gc = XCreateGC (dpy, cursor_pixmap, 0, NULL);
+    XPutImage (dpy, cursor_pixmap, gc, cursor_image, 0, 0, 0, 0,
+               my_x_cursor->width, my_x_cursor->height);
+    XFreeGC (dpy, gc);
+    // this frees pixels, too
+    XDestroyImage (cursor_image);
+
+    cursor_pict = XRenderCreatePicture (dpy, cursor_pixmap, argb_format, 0,
+                                        NULL);
+    XRenderSetPictureFilter (dpy, cursor_pict, FilterBilinear, NULL, 0);
+    setXRenderTransform (dpy, cursor_pict, scale, app->area->x - x,
+                         app->area->y - y);
+
+    // the rectangle covered by the scaled pointer on the destination
+    dst_x = XVC_MAX (0, (int) floor ((x - app->area->x) * scale));
+    dst_y = XVC_MAX (0, (int) floor ((y - app->area->y) * scale));
+    dst_width = (int) ceil (my_x_cursor->width * scale) + 1;
+    dst_height = (int) ceil (my_x_cursor->height * scale) + 1;
+
+    XRenderComposite (dpy, PictOpOver, cursor_pict, None, xr_pict,
+                      dst_x, dst_y, 0, 0, dst_x, dst_y, dst_width, dst_height);
+
+    XRenderFreePicture (dpy, cursor_pict);
+    XFreePixmap (dpy, cursor_pixmap);
+}
+
+/**
+ * \brief scale the capture area to the offscreen pixmap on the X server
+ *
+ * @param dpy a pointer to the display
+ * @param width the width of the scaled area
+ * @param height the height of the scaled area
+ * @param my_x_cursor the XFixesCursorImage to composite onto the area or NULL
+ */
+static void
+renderScaledAreaXRender (Display * dpy, int width, int height,
+                         XFixesCursorImage * my_x_cursor)
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+    double scale = (double) width / app->area->width;
+
+    // the capture area may move between frames
+    setXRenderTransform (dpy, xr_root_pict, scale, app->area->x, app->area->y);
+    XRenderComposite (dpy, PictOpSrc, xr_root_pict, None, xr_pict,
+                      0, 0, 0, 0, 0, 0, width, height);
+    compositeMousePointerXRender (dpy, my_x_cursor, scale);
+}
+
+/**
+ * \brief creates a new XImage of the scaled capture area. This is the
+ *      XRender version.
+ *
+ * This also sets up the pictures and the offscreen pixmap used for all
+ * further frames. The dimensions are derived from the rescale percentage
+ * the same way the encoder would for client side scaling.
+ *
+ * @param dpy pointer to an open Display
+ * @param my_x_cursor the XFixesCursorImage to composite onto the area or NULL
+ * @return a pointer to the new XImage
+ */
+static XImage *
+captureFrameCreatingImageXRender (Display * dpy,
+                                  XFixesCursorImage * my_x_cursor)
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+    XRenderPictFormat *format = NULL;
+    XRenderPictureAttributes pa;
+    XImage *image = NULL;
+    Region damaged_region = NULL;
+    double r = xvc_appdata_get_rescale_factor (app);
+    int width = ((int) (app->area->width * r)) & ~1;
+    int height = ((int) (app->area->height * r)) & ~1;
+
+    format = XRenderFindVisualFormat (dpy, app->win_attr.visual);
+    if (!format || width < 2 || height < 2) {
+        fprintf (stderr, "Can't scale image through XRender: %dx%d\n", width,
+                 height);
+        exit (1);
+    }
+    // include child windows, otherwise we would only get the root
+    // window's background
+    pa.subwindow_mode = IncludeInferiors;
+    xr_root_pict = XRenderCreatePicture (dpy, app->root_window, format,
+                                         CPSubwindowMode, &pa);
+    XRenderSetPictureFilter (dpy, xr_root_pict, FilterBilinear, NULL, 0);
+
+    xr_pixmap = XCreatePixmap (dpy, app->root_window, width, height,
+                               app->win_attr.depth);
+    xr_pict = XRenderCreatePicture (dpy, xr_pixmap, format, 0, NULL);
+
+    // we capture complete frames, so the damage up to now can be
+    // discarded
+    damaged_region = xvc_get_damage_region ();
+    dropWindowMoves ();
+
+    renderScaledAreaXRender (dpy, width, height, my_x_cursor);
+    image = XGetImage (dpy, xr_pixmap, 0, 0, width, height, AllPlanes,
+                       ZPixmap);
+    if (!image) {
+        fprintf (stderr, "Can't get image: %dx%d\n", width, height);
+        exit (1);
+    }
+
+    XDestroyRegion (damaged_region);
+
+    return image;
+}
+
+/**
+ * \brief this captures the scaled capture area into an existing XImage.
+ *      This is the XRender version.
+ *
+ * @param dpy a pointer to the display to read from
+ * @param image a pointer to the image to write to
+ * @param my_x_cursor the XFixesCursorImage to composite onto the area or NULL
+ * @return 1 on success, 0 on failure
+ */
+static int
+captureFrameToImageXRender (Display * dpy, XImage * image,
+                            XFixesCursorImage * my_x_cursor)
+{
+    int ret = 0;
+    Region damaged_region = NULL;
+
+    // damage is tracked in unscaled coordinates and we always capture
+    // complete frames, so discard it
+    damaged_region = xvc_get_damage_region ();
+    dropWindowMoves ();
+
+    renderScaledAreaXRender (dpy, image->width, image->height, my_x_cursor);
+    if (XGetZPixmapToXImage (dpy, xr_pixmap, image, 0, 0)) {
+        ret = 1;
+    }
+
+    XDestroyRegion (damaged_region);
+
+    return ret;
+}
+
+/**
+ * \brief frees the pictures and the pixmap used by the XRender source
+ *
+ * @param dpy a pointer to the display
+ */
+static void
+cleanXRender (Display * dpy)
+{
+    if (xr_pict != None) {
+        XRenderFreePicture (dpy, xr_pict);
+        xr_pict = None;
+    }
+    if (xr_pixmap != None) {
+        XFreePixmap (dpy, xr_pixmap);
+        xr_pixmap = None;
+    }
+    if (xr_root_pict != None) {
+        XRenderFreePicture (dpy, xr_root_pict);
+        xr_root_pict = None;
+    }
+}
+#endif     // HAVE_LIBXRENDER
+
+/**
+ * \brief add the time spent on capturing the current frame to the totals
+ *      reported in verbose mode
+ *
+ * @param start the time the capture of the current frame started
+ */
+static void
+accountCaptureTime (const struct timeval *start)
+{
+    struct timeval end;
+
+    gettimeofday (&end, NULL);
+    capture_usecs += (end.tv_sec - start->tv_sec) * 1000000 +
+        (end.tv_usec - start->tv_usec);
+    capture_frames++;
+}
+
+/**
+ * \brief computes the share of the capture area covered by a damaged region
+ *
+ * @param region the damaged region in root window coordinates
+ * @return the damaged share of the capture area in 1/1000
+ */
+static int
+getDamagePermille (Region region)
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+    long area = 0, total = (long) app->area->width * app->area->height;
+    int i;
+
+    if (total <= 0)
+        return -1;
+
+    // the rectangles of a Region never overlap
+    for (i = 0; i < region->numRects; i++) {
+        int x1 = XVC_MAX (XVC_MIN (region->rects[i].x1, region->rects[i].x2),
+                          app->area->x);
+        int y1 = XVC_MAX (XVC_MIN (region->rects[i].y1, region->rects[i].y2),
+                          app->area->y);
+        int x2 = XVC_MIN (XVC_MAX (region->rects[i].x1, region->rects[i].x2),
+                          app->area->x + app->area->width);
+        int y2 = XVC_MIN (XVC_MAX (region->rects[i].y1, region->rects[i].y2),
+                          app->area->y + app->area->height);
+
+        if (x2 > x1 && y2 > y1)
+            area += (long) (x2 - x1) * (y2 - y1);
+    }
+
+    return (int) ((area * 1000) / total);
+}
+
+/**
+ * \brief replaces the region of the current frame that changed since the
+ *      previous one
+ *
+ * @param region the new region in capture area coordinates, NULL if unknown
+ */
+static void
+setFrameRegion (Region region)
+{
+    Job *job = xvc_job_ptr ();
+
+    if (job->frame_region)
+        XDestroyRegion (job->frame_region);
+    job->frame_region = region;
+}
+
 /**
  * Calculates in how many msecs the next capture is due based on fps
  * and the duration of the previous capture.
@@ -838,6 +1620,8 @@ checkCaptureDuration(long time, long time1)
 	}
     // this sets the frame monitor widget
     xvc_led_time = time1;
+    // and this lets the encoder adapt its speed
+    job->frame_time = time1;
 
     // calculate the remaining time we have till capture of next frame
     time1 = job->time_per_frame - time1;
@@ -886,6 +1670,7 @@ commonCapture (enum captureFunctions capfunc)
     Job *job = xvc_job_ptr ();
     int full_cleanup = TRUE;
     int frame_moved = FALSE;
+    int shadowed = FALSE;
 
     XFixesCursorImage *x_cursor = NULL;
 
@@ -1016,22 +1801,55 @@ commonCapture (enum captureFunctions capfunc)
             // lock the display for consistency
             XLockDisplay (app->dpy);
 
+            // the start frame is captured completely
+            job->damage_permille = -1;
+            job->frame_unchanged = FALSE;
+            setFrameRegion (NULL);
+
+            // a shadow is only kept up to date through damage
+            if (capfunc != XRENDER && getShadowArea (&shadow_area)) {
+                if (app->dmg_event_base != 0)
+                    shadowed = TRUE;
+                else
+                    fprintf (stderr, _("The shadow requires the XDamage extension, capturing without.\n"));
+            }
+
             // capture the start frame with whatever function applicable
             switch (capfunc) {
             case SHM:
                 image = captureFrameCreatingImageSHM (app->dpy, &shminfo);
                 // also initialize xdamage stuff
                 XQueryExtension(app->dpy, "MIT-SHM", &shm_opcode, &shm_event_base, &shm_error_base);
-                dmg_image = createImageSHM(app->dpy, &dmg_shminfo, app->area->width, app->area->height);
+                if (!shadowed)
+                    dmg_image = createImageSHM(app->dpy, &dmg_shminfo, app->area->width, app->area->height);
+                break;
+#ifdef HAVE_LIBXRENDER
+            case XRENDER:
+                // the pointer is composited on the server, too
+                if (app->mouseWanted > 0)
+                    x_cursor = getCurrentPointerImage ();
+                image = captureFrameCreatingImageXRender (app->dpy, x_cursor);
+                if (x_cursor) {
+                    XFree (x_cursor);
+                    x_cursor = NULL;
+                }
                 break;
+#endif     // HAVE_LIBXRENDER
             case X11:
             default:
                 image = captureFrameCreatingImage (app->dpy);
                 // also initialize xdamage stuff
-                dmg_image = createImage (app->dpy, app->area->width, app->area->height);
+                if (!shadowed)
+                    dmg_image = createImage (app->dpy, app->area->width, app->area->height);
             }
-
-            if (app->mouseWanted > 0) {
+            // the shadow starts out complete, damage read into it later
+            // goes through its own image
+            if (shadowed)
+                dmg_image = createShadow (app->dpy, capfunc, &dmg_shminfo);
+            // windows moved before are in the start frame where they are
+            dropWindowMoves ();
+
+            if (app->mouseWanted > 0 && capfunc != XRENDER) {
                     x_cursor = getCurrentPointerImage ();
             }
             // now, we have captured all we need and can unlock the display
@@ -1043,11 +1861,13 @@ commonCapture (enum captureFunctions capfunc)
 
             // now we can draw the mouse pointer
             if (image) {
-                if (app->mouseWanted > 0) {
+                if (app->mouseWanted > 0 && capfunc != XRENDER) {
                     pointer_area = paintMousePointer(image, x_cursor, 0, 0);
                 }
                 // we can allow state or frame changes after this
                 pthread_mutex_unlock (&(app->capturing_mutex));
+                if (app->verbose)
+                    accountCaptureTime (&curr_time);
                 // call the necessary XtoXYZ function to process the image
                 (*job->save) (fp, image);
                 job->state &= ~(VC_START);
@@ -1059,9 +1879,138 @@ commonCapture (enum captureFunctions capfunc)
         } else {
             // we're recording and not in the first frame ....
             // so we just read new data into the present image structure
-            if (! frame_moved) {
-                int num_dmg_rects, rcount;
+#ifdef HAVE_LIBXRENDER
+            if (capfunc == XRENDER) {
+                // lock the display for consistency
+                XLockDisplay (app->dpy);
+
+                if (app->mouseWanted > 0)
+                    x_cursor = getCurrentPointerImage ();
+                captureFrameToImageXRender (app->dpy, image, x_cursor);
+                // damage is not applied to server side scaled captures
+                job->damage_permille = -1;
+                job->frame_unchanged = FALSE;
+                setFrameRegion (NULL);
+
+                // unlock display again
+                XUnlockDisplay (app->dpy);
+
+                if (x_cursor) {
+                    XFree (x_cursor);
+                    x_cursor = NULL;
+                }
+            } else
+#endif     // HAVE_LIBXRENDER
+            if (shadow_image) {
+                int i, screen_changed, in_shadow;
+                XRectangle last_pointer_area = pointer_area;
+                Region area_region = XCreateRegion ();
+                Region moved_region = XCreateRegion ();
+
+                // then lock the display so we capture a consitent state
+                XLockDisplay (app->dpy);
+                // sync the display
+                XSync (app->dpy, False);
+                // bring the shadow up to date with all damage anywhere in it,
+                // windows moved within it are moved in it
+                damaged_region = xvc_get_damage_region ();
+                applyWindowMoves (shadow_image, &shadow_area, damaged_region,
+                                  moved_region, NULL);
+                updateShadow (app->dpy, capfunc, shm_opcode, damaged_region,
+                              dmg_image, &dmg_shminfo);
+                in_shadow = isAreaInShadow ();
+                if (in_shadow) {
+                    shadow_frames++;
+                } else {
+                    // the capture area left the shadow, read it directly
+                    switch (capfunc) {
+                    case SHM:
+                        captureFrameToImageSHM (app->dpy, image);
+                        break;
+                    case X11:
+                    default:
+                        captureFrameToImage (app->dpy, image);
+                    }
+                    shadow_fetched +=
+                        (long long) image->bytes_per_line * image->height;
+                    shadow_misses++;
+                }
+                if (app->mouseWanted > 0) {
+                    x_cursor = getCurrentPointerImage ();
+                }
+                // now we can release the lock on the display again, the
+                // frame is cropped from the shadow without it
+                XUnlockDisplay (app->dpy);
+
+                // only damage and moves within the capture area change the
+                // frame
+                XUnionRegion (moved_region, damaged_region, damaged_region);
+                XDestroyRegion (moved_region);
+                XUnionRectWithRegion (app->area, area_region, area_region);
+                XIntersectRegion (damaged_region, area_region, damaged_region);
+                screen_changed = !XEmptyRegion (damaged_region);
+
+                if (frame_moved || !in_shadow) {
+                    // a moved frame changes completely
+                    if (in_shadow)
+                        cropShadow (image, app->area->x, app->area->y,
+                                    app->area->width, app->area->height);
+                    job->damage_permille = 1000;
+                    setFrameRegion (NULL);
+                } else {
+                    Region frame_region = XCreateRegion ();
+
+                    // what the pointer covered in the previous frame is
+                    // restored, too
+                    if (app->mouseWanted > 0) {
+                        XUnionRectWithRegion (&pointer_area, damaged_region,
+                                              damaged_region);
+                        XIntersectRegion (damaged_region, area_region,
+                                          damaged_region);
+                    }
+                    for (i = 0; i < damaged_region->numRects; i++) {
+                        Box *box = &(damaged_region->rects[i]);
+
+                        cropShadow (image, box->x1, box->y1,
+                                    box->x2 - box->x1, box->y2 - box->y1);
+                    }
+                    job->damage_permille = getDamagePermille (damaged_region);
+                    XUnionRegion (damaged_region, frame_region, frame_region);
+                    setFrameRegion (frame_region);
+                }
+                XDestroyRegion (area_region);
+                XDestroyRegion (damaged_region);
+
+                // paint the mouse pointer here, outside the lock
+                pointer_area = paintMousePointer (image, x_cursor, 0, 0);
+
+                // the frame is the same as the previous one if neither the
+                // capture area nor the pointer changed
+                job->frame_unchanged = (!frame_moved && in_shadow &&
+                                        !screen_changed &&
+                                        pointer_area.x == last_pointer_area.x &&
+                                        pointer_area.y == last_pointer_area.y &&
+                                        pointer_area.width ==
+                                        last_pointer_area.width &&
+                                        pointer_area.height ==
+                                        last_pointer_area.height &&
+                                        (!x_cursor ||
+                                         x_cursor->cursor_serial ==
+                                         pointer_serial));
+                if (x_cursor)
+                    pointer_serial = x_cursor->cursor_serial;
+                // the pointer was painted at its new position, too
+                if (job->frame_region) {
+                    XUnionRectWithRegion (&pointer_area, job->frame_region,
+                                          job->frame_region);
+                    XOffsetRegion (job->frame_region, -app->area->x,
+                                   -app->area->y);
+                }
+            } else if (! frame_moved) {
+                int num_dmg_rects, rcount, screen_changed;
+                XRectangle last_pointer_area = pointer_area;
                 Box *dmg_rects;
+                Region changed_region = XCreateRegion ();
 
                 // then lock the display so we capture a consitent state
                 XLockDisplay (app->dpy);
@@ -1070,6 +2019,14 @@ commonCapture (enum captureFunctions capfunc)
                 // first get the consolidated region where stuff was damaged
                 // since the last frame
                 damaged_region = xvc_get_damage_region ();
+                // windows moved within the capture area are moved in the
+                // previous frame rather than read again
+                applyWindowMoves (image, app->area, damaged_region,
+                                  changed_region,
+                                  (app->mouseWanted > 0 ? &pointer_area :
+                                   NULL));
+                screen_changed = !XEmptyRegion (damaged_region) ||
+                    !XEmptyRegion (changed_region);
                 // add the last position of the mouse pointer to the damaged
                 // region
                 if (app->mouseWanted > 0) {
@@ -1108,6 +2065,21 @@ commonCapture (enum captureFunctions capfunc)
                     }
 
                 }
+                // what is read changes the frame as much as the moves
+                XUnionRegion (damaged_region, changed_region, changed_region);
+                // tell the encoder how much of the frame changed, which is
+                // only known if damage is actually tracked
+                job->damage_permille = (app->dmg_event_base != 0) ?
+                    getDamagePermille (changed_region) : -1;
+                // and keep the damage for the encoder, which can then
+                // limit its work to what changed
+                if (app->dmg_event_base != 0) {
+                    setFrameRegion (changed_region);
+                    changed_region = NULL;
+                } else {
+                    setFrameRegion (NULL);
+                }
+
                 // get individual rectangles from the damaged region
                 dmg_rects = damaged_region->rects;
                 num_dmg_rects = damaged_region->numRects;
@@ -1173,7 +2145,36 @@ commonCapture (enum captureFunctions capfunc)
                 // paint the mouse pointer here, outside the lock
                 pointer_area = paintMousePointer (image, x_cursor, 0, 0);
                 XDestroyRegion (damaged_region);
+                if (changed_region)
+                    XDestroyRegion (changed_region);
+
+                // the frame is the same as the previous one if neither the
+                // screen nor the pointer changed
+                job->frame_unchanged = (app->dmg_event_base != 0 &&
+                                        !screen_changed &&
+                                        pointer_area.x == last_pointer_area.x &&
+                                        pointer_area.y == last_pointer_area.y &&
+                                        pointer_area.width ==
+                                        last_pointer_area.width &&
+                                        pointer_area.height ==
+                                        last_pointer_area.height &&
+                                        (!x_cursor ||
+                                         x_cursor->cursor_serial ==
+                                         pointer_serial));
+                if (x_cursor)
+                    pointer_serial = x_cursor->cursor_serial;
+                // the pointer was painted at its new position, too
+                if (job->frame_region) {
+                    XUnionRectWithRegion (&pointer_area, job->frame_region,
+                                          job->frame_region);
+                    XOffsetRegion (job->frame_region, -app->area->x,
+                                   -app->area->y);
+                }
             } else {
+                // a moved frame changes completely
+                job->damage_permille = 1000;
+                job->frame_unchanged = FALSE;
+                setFrameRegion (NULL);
 
                 // lock the display for consistency
                 XLockDisplay (app->dpy);
@@ -1200,6 +2201,8 @@ commonCapture (enum captureFunctions capfunc)
             // we can allow state or frame changes after this
             pthread_mutex_unlock (&(app->capturing_mutex));
 
+            if (app->verbose)
+                accountCaptureTime (&curr_time);
             // call the necessary XtoXYZ function to process the image
             (*job->save) (fp, image);
         }
@@ -1240,6 +2243,7 @@ commonCapture (enum captureFunctions capfunc)
       CLEAN_CAPTURE:
 
         time = 0;
+        setFrameRegion (NULL);
         orig_state = job->state;       // store state here, esp. VC_CONTINUE
         job->state = VC_STOP;
         // we can allow state or frame changes after this
@@ -1255,8 +2259,30 @@ commonCapture (enum captureFunctions capfunc)
 
             if (capfunc == SHM)
                  XShmDetach (app->dpy, &dmg_shminfo);
-            if (dmg_image)
+            if (dmg_image) {
                  XDestroyImage (dmg_image);
+                 dmg_image = NULL;
+            }
+            destroyShadow (app->dpy, capfunc);
+#ifdef HAVE_LIBXRENDER
+            if (capfunc == XRENDER)
+                cleanXRender (app->dpy);
+#endif     // HAVE_LIBXRENDER
+
+            if (app->verbose && capture_frames > 0) {
+                printf ("frame capture (%s): %i frames, %li usecs per frame\n",
+                        app->source, capture_frames,
+                        capture_usecs / capture_frames);
+            }
+            if (app->verbose && move_count > 0) {
+                printf ("window moves: %i, %lli bytes per move moved instead of read, %lli KB of uncovered parts read\n",
+                        move_count, move_blitted / move_count,
+                        move_exposed / 1024);
+            }
+            capture_frames = 0;
+            capture_usecs = 0;
+            move_count = 0;
+            move_blitted = move_exposed = 0;
 
             // clean up the save routines in xtoXXX.c
             if (job->clean)
@@ -1302,3 +2328,11 @@ xvc_capture_shm ()
 {
     return commonCapture (SHM);
 }
+
+#ifdef HAVE_LIBXRENDER
+long
+xvc_capture_xrender ()
+{
+    return commonCapture (XRENDER);
+}
+#endif     // HAVE_LIBXRENDER
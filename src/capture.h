@@ -42,5 +42,25 @@ long xvc_capture_x11();
  */
 long xvc_capture_shm();
 
+/**
+ * Gets the part of the root window damage needs to be tracked for, which is
+ *      the shadow of the screen frames are cropped from if one is kept and
+ *      the capture area otherwise
+ *
+ * @return the rectangle damage is clipped to
+ */
+XRectangle *xvc_capture_damage_area();
+
+#ifdef HAVE_LIBXRENDER
+/**
+ * Function used for capturing. This one is used with source = xrender,
+ *      i. e. when the capture area is scaled on the X server before the
+ *      transfer
+ *
+ * @return the number of msecs in which the next capture is due
+ */
+long xvc_capture_xrender();
+#endif     // HAVE_LIBXRENDER
+
 
 #endif     // _xvc_CAPTURE_H__
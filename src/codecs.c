@@ -48,6 +48,57 @@ static const XVC_FpsRange fps_range[] = {
 #define fps_range (sizeof(fps_range) / sizeof(XVC_FpsRange))
 
 
+/*
+ * performance profiles for use in the codecs array, each with one element
+ * per XVC_ProfileId
+ */
+
+/** \brief the settings used for codecs without profiles of their own */
+static const XVC_CodecProfile generic_profiles[] = {
+	{ ME_ZERO, 8, FF_MB_DECISION_RD, 1, 100, 0, 0 },
+	{ ME_ZERO, 8, FF_MB_DECISION_RD, 1, 50, 0, 0 },
+	{ ME_ZERO, 8, FF_MB_DECISION_RD, 1, 250, 0, 0 }
+};
+
+/**
+ * \brief profiles for the mpegvideo encoders with B-frame support
+ *
+ * The archive profile keeps them single threaded because every additional
+ * thread starts another slice
+ */
+static const XVC_CodecProfile mpeg_profiles[] = {
+	{ ME_ZERO, 2, FF_MB_DECISION_SIMPLE, 0, 100, 0, 0 },
+	{ ME_ZERO, 8, FF_MB_DECISION_RD, 1, 50, 0, 0 },
+	{ ME_EPZS, 8, FF_MB_DECISION_RD, 1, 250, 2, 1 }
+};
+
+/** \brief profiles for the mpegvideo encoders without B-frame support */
+static const XVC_CodecProfile h263_profiles[] = {
+	{ ME_ZERO, 2, FF_MB_DECISION_SIMPLE, 0, 100, 0, 0 },
+	{ ME_ZERO, 8, FF_MB_DECISION_RD, 1, 50, 0, 0 },
+	{ ME_EPZS, 8, FF_MB_DECISION_RD, 1, 250, 0, 1 }
+};
+
+/**
+ * \brief profiles for libx264, which maps me_method to its own methods
+ *      (ME_EPZS is diamond, anything unknown hexagon), me_subpel_quality to
+ *      subme, and trellis to its trellis level
+ */
+static const XVC_CodecProfile h264_profiles[] = {
+	{ ME_EPZS, 1, FF_MB_DECISION_SIMPLE, 0, 250, 0, 0 },
+	{ ME_ZERO, 8, FF_MB_DECISION_RD, 1, 50, 0, 0 },
+	{ ME_UMH, 9, FF_MB_DECISION_RD, 2, 250, 3, 0 }
+};
+
+/**
+ * \brief names of the performance profiles in the order of XVC_ProfileId
+ */
+const char *xvc_profile_names[] = {
+	"realtime",
+	"balanced",
+	"archive"
+};
+
 /**
  * Available video codecs.
  */
@@ -80,7 +131,8 @@ const XVC_VidCodec xvc_video_codecs[] = {
     {
 		"MPEG1",
 		N_("MPEG 1"),
-		CODEC_ID_MPEG1VIDEO
+		CODEC_ID_MPEG1VIDEO,
+		mpeg_profiles
 	},
     {
 		"MJPEG",
@@ -90,17 +142,20 @@ const XVC_VidCodec xvc_video_codecs[] = {
     {
 		"MPEG4",
 		N_("MPEG 4 (DIVX)"),
-		CODEC_ID_MPEG4
+		CODEC_ID_MPEG4,
+		mpeg_profiles
 	},
     {
 		"MS_DIV2",
 		N_("Microsoft DIVX 2"),
-		CODEC_ID_MSMPEG4V2
+		CODEC_ID_MSMPEG4V2,
+		h263_profiles
 	},
     {
 		"MS_DIV3",
 		N_("Microsoft DIVX 3"),
-		CODEC_ID_MSMPEG4V3
+		CODEC_ID_MSMPEG4V3,
+		h263_profiles
 	},
     {
 		"FFV1",
@@ -110,7 +165,8 @@ const XVC_VidCodec xvc_video_codecs[] = {
     {
 		"FLASH_VIDEO",
 		N_("Flash Video"),
-		CODEC_ID_FLV1
+		CODEC_ID_FLV1,
+		h263_profiles
 	},
     {
 		"FLASH_SV",
@@ -130,7 +186,8 @@ const XVC_VidCodec xvc_video_codecs[] = {
     {
 		"MPEG2",
 		N_("MPEG2 Video"),
-		CODEC_ID_MPEG2VIDEO
+		CODEC_ID_MPEG2VIDEO,
+		mpeg_profiles
 	},
     {
 		"THEORA",
@@ -150,7 +207,8 @@ const XVC_VidCodec xvc_video_codecs[] = {
 	{
 		"H264",
 		N_("MPEG-4 Part 10 (h. 264)"),
-		CODEC_ID_H264
+		CODEC_ID_H264,
+		h264_profiles
 	}
 };
 
@@ -370,6 +428,28 @@ static const char *ogg_extensions[] = { "ogg" };
 
 
 
+static const XVC_VidCodecId *mkv_allowed_vid_codecs[] = {
+	VID_CODEC_NONE,
+	VID_CODEC_MPEG4,
+	VID_CODEC_MSDIV3,
+	VID_CODEC_FFV1,
+	VID_CODEC_MJPEG,
+	VID_CODEC_THEORA,
+	VID_CODEC_H264
+};
+static const XVC_AuCodecId *mkv_allowed_au_codecs[] = {
+	AU_CODEC_NONE,
+	AU_CODEC_PCM16,
+	AU_CODEC_MP2,
+	AU_CODEC_MP3,
+	AU_CODEC_VORBIS,
+	AU_CODEC_AC3,
+	AU_CODEC_AAC
+};
+static const char *mkv_extensions[] = { "mkv" };
+
+
+
 /**
  * Global array storing all available file formats and containers
  */
@@ -525,6 +605,16 @@ const XVC_FFormat xvc_formats[] = {
 		AU_CODEC_VORBIS,
 		ogg_allowed_au_codecs,
 		ogg_extensions,
+	},
+    {
+		"mkv",
+		N_("Matroska Format"),
+		"matroska",
+		VID_CODEC_MPEG4,
+		mkv_allowed_vid_codecs,
+		AU_CODEC_MP2,
+		mkv_allowed_au_codecs,
+		mkv_extensions
 	}
 };
 
@@ -723,3 +813,45 @@ int xvc_count_formats()
 {
 	return sizeof(xvc_formats) / sizeof(XVC_FFormat);
 }
+
+
+/**
+ * \brief find a performance profile by its name
+ *
+ * @param name the name of the profile, e.g. "realtime"
+ * @return the XVC_ProfileId of the profile or -1 if there is none of that
+ *      name
+ */
+int
+xvc_get_profile_from_name(const char *name)
+{
+	for (int i = 0; i < NUMPROFILES; i++) {
+		if (strcasecmp (name, xvc_profile_names[i]) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * \brief get the encoder settings of a performance profile for a codec
+ *
+ * @param codec the video codec specified as an index number pointing to a
+ *      codec in the global codecs array
+ * @param profile the XVC_ProfileId of the profile
+ * @return the codec's own settings for the profile if it has any, the
+ *      generic ones otherwise
+ */
+const XVC_CodecProfile *
+xvc_get_codec_profile(XVC_VidCodecId codec, int profile)
+{
+	if (profile < 0 || profile >= NUMPROFILES)
+		profile = PROFILE_BALANCED;
+
+	if (codec > VID_CODEC_NONE && codec < xvc_count_video_codecs() &&
+		xvc_video_codecs[codec].profiles != NULL)
+		return &(xvc_video_codecs[codec].profiles[profile]);
+
+	return &(generic_profiles[profile]);
+}
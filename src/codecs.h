@@ -83,6 +83,41 @@ typedef enum
 	VID_CODEC_H264
 } XVC_VidCodecId;
 
+/**
+ * Performance profile IDs. Because these are in the same order as the
+ * profiles in the profiles arrays of the video codecs, the elements of those
+ * arrays can be referenced using these telling names.
+ */
+typedef enum
+{
+    PROFILE_REALTIME,
+    PROFILE_BALANCED,
+    PROFILE_ARCHIVE,
+    NUMPROFILES
+} XVC_ProfileId;
+
+/**
+ * Struct containing the encoder settings of a performance profile.
+ */
+typedef struct _xvc_CodecProfile
+{
+    /** \brief libavcodec's motion estimation method (ME_*) */
+    const int me_method;
+    /** \brief subpel motion estimation quality */
+    const int me_subpel_quality;
+    /** \brief macroblock decision mode (FF_MB_DECISION_*) */
+    const int mb_decision;
+    /** \brief trellis quantisation level, 0 is off */
+    const int trellis;
+    /** \brief maximum distance between two intra frames */
+    const int gop_size;
+    /** \brief maximum number of consecutive B-frames */
+    const int max_b_frames;
+    /** \brief maximum number of encoder threads, 0 means no limit besides
+     *      the --threads option */
+    const int max_threads;
+} XVC_CodecProfile;
+
 /**
  * Struct containing codec properties.
  */
@@ -91,10 +126,15 @@ typedef struct _xvc_Codec
     const char *name;
     const char *longname;
     const int ffmpeg_id;
+    /** \brief NUMPROFILES performance profiles, NULL if the codec does
+     *      not have any of its own */
+    const XVC_CodecProfile *profiles;
 } XVC_VidCodec;
 
 extern const XVC_VidCodec xvc_video_codecs[];
 
+extern const char *xvc_profile_names[];
+
 /**
  * Audio codec IDs used by xvidcap. Because these are in the same
  * order as the elements of the global xvc_audio_codecs array, the
@@ -148,7 +188,8 @@ typedef enum
     CAP_SVCD,
     CAP_DVD,
     CAP_MOV,
-    CAP_OGG
+    CAP_OGG,
+    CAP_MKV
 } XVC_FFormatId;
 
 
@@ -194,4 +235,8 @@ int xvc_count_video_codecs();
 
 int xvc_count_formats();
 
+int xvc_get_profile_from_name(const char *name);
+
+const XVC_CodecProfile *xvc_get_codec_profile(XVC_VidCodecId codec, int profile);
+
 #endif     // _xvc_CODECS_H__
@@ -260,3 +260,31 @@ xvc_dbus_pause (XvcServerObject * server, GError ** error)
 
     return TRUE;
 }
+
+/**
+ * \brief implementation of the set profile method for remote execution
+ *      through dbus
+ *
+ * The profile is used from the next recording on.
+ *
+ * @param server a pointer to an instance of this class
+ * @param profile name of the encoder performance profile
+ * @param error pointer to a pointer to a GError
+ * @return gboolean
+ */
+gboolean
+xvc_dbus_set_profile (XvcServerObject * server, const char *profile,
+                      GError ** error)
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+    int p = xvc_get_profile_from_name (profile);
+
+    if (p < 0) {
+        g_set_error (error, DBUS_GERROR, DBUS_GERROR_INVALID_ARGS,
+                     "unknown encoder performance profile '%s'", profile);
+        return FALSE;
+    }
+    app->profile = p;
+
+    return TRUE;
+}
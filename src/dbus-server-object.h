@@ -34,6 +34,8 @@ extern "C"
     gboolean xvc_dbus_stop (XvcServerObject * server, GError ** error);
     gboolean xvc_dbus_start (XvcServerObject * server, GError ** error);
     gboolean xvc_dbus_pause (XvcServerObject * server, GError ** error);
+    gboolean xvc_dbus_set_profile (XvcServerObject * server,
+                                   const char *profile, GError ** error);
 
 /*
  * macros
@@ -48,6 +48,7 @@
 #include "led_meter.h"
 #include "job.h"
 #include "app_data.h"
+#include "capture.h"
 #include "control.h"
 #include "colors.h"
 #include "codecs.h"
@@ -445,6 +446,196 @@ xvc_undo_toggle_cap_type ()
     }
 }
 
+/**
+ * \brief geometries of the top-level windows damage is tracked for, to tell
+ *      their moves from ConfigureNotify events
+ */
+static GHashTable *toplevels = NULL;
+
+/**
+ * \brief windows a Damage object was created for, which lasts as long as
+ *      the window, so it is created only once however often the window is
+ *      mapped
+ */
+static GHashTable *damaged_windows = NULL;
+
+/**
+ * \brief the window that just moved and the index of its move in the job
+ *      while the damage reported for the move is still coming in, and
+ *      whether more of that damage is to come for the window itself and
+ *      for the root window, whose Damage includes its children
+ */
+static Window moving_window = None;
+static int moving_index = 0;
+static Boolean moving_window_more = FALSE;
+static Boolean moving_root_more = FALSE;
+
+/**
+ * \brief the part of the moving window the X server can have copied to
+ *      its new position, damage outside it was painted there instead
+ */
+static Region moving_copied = NULL;
+
+/**
+ * \brief tracks the damage of a window unless that is done already
+ *
+ * @param win the window
+ */
+static void
+track_window_damage (Window win)
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+
+    if (!damaged_windows)
+        damaged_windows = g_hash_table_new (g_direct_hash, g_direct_equal);
+    if (g_hash_table_lookup (damaged_windows, GUINT_TO_POINTER (win)))
+        return;
+    XDamageCreate (app->dpy, win, XDamageReportRawRectangles);
+    g_hash_table_insert (damaged_windows, GUINT_TO_POINTER (win),
+                         GUINT_TO_POINTER (TRUE));
+}
+
+/**
+ * \brief remembers the geometry of a top-level window damage is tracked for
+ *
+ * @param win the window
+ * @param attribs the window's attributes
+ */
+static void
+toplevel_add (Window win, XWindowAttributes * attribs)
+{
+    XRectangle *geom = g_new (XRectangle, 1);
+
+    geom->x = attribs->x;
+    geom->y = attribs->y;
+    geom->width = attribs->width + 2 * attribs->border_width;
+    geom->height = attribs->height + 2 * attribs->border_width;
+    g_hash_table_insert (toplevels, GUINT_TO_POINTER (win), geom);
+}
+
+/**
+ * \brief works out the part of a moved window the X server can have copied
+ *
+ * That is the part of the window that was on the screen and not covered by
+ * a window stacked above it before the move. Whatever else shows at the new
+ * position is painted there by the client or with the window's background.
+ *
+ * @param win the window
+ * @param old the window's geometry before the move
+ * @param dx the distance the window moved horizontally
+ * @param dy the distance the window moved vertically
+ * @return the region at the window's new position in root window
+ *      coordinates
+ */
+static Region
+get_copied_region (Window win, XRectangle * old, int dx, int dy)
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+    XRectangle screen = { 0, 0, app->max_width, app->max_height };
+    Region copied = XCreateRegion (), clip = XCreateRegion ();
+    Window root, parent, *children = NULL;
+    unsigned int i, num_children = 0;
+
+    XUnionRectWithRegion (old, copied, copied);
+    XUnionRectWithRegion (&screen, clip, clip);
+    XIntersectRegion (copied, clip, copied);
+    XDestroyRegion (clip);
+
+    // the children of the root window are listed bottom to top, those
+    // after the window covered it
+    gdk_error_trap_push ();
+    if (XQueryTree (app->dpy, app->root_window, &root, &parent, &children,
+                    &num_children)) {
+        for (i = 0; i < num_children && children[i] != win; i++);
+        for (i++; i < num_children; i++) {
+            XRectangle *geom = g_hash_table_lookup (toplevels,
+                                                    GUINT_TO_POINTER
+                                                    (children[i]));
+            XRectangle above;
+            XWindowAttributes attribs;
+
+            if (geom) {
+                above = *geom;
+            } else if (XGetWindowAttributes (app->dpy, children[i], &attribs)
+                       && attribs.map_state == IsViewable) {
+                above.x = attribs.x;
+                above.y = attribs.y;
+                above.width = attribs.width + 2 * attribs.border_width;
+                above.height = attribs.height + 2 * attribs.border_width;
+            } else {
+                continue;
+            }
+            clip = XCreateRegion ();
+            XUnionRectWithRegion (&above, clip, clip);
+            XSubtractRegion (copied, clip, copied);
+            XDestroyRegion (clip);
+        }
+        if (children)
+            XFree (children);
+    }
+    gdk_error_trap_pop ();
+
+    XOffsetRegion (copied, dx, dy);
+    return copied;
+}
+
+/**
+ * \brief records a top-level window that moved without changing its size
+ *
+ * The X server copies the window to its new position and reports the
+ * damage of the copy right after the ConfigureNotify. That damage is kept
+ * with the move, so the capture can move the window in the pixels it has
+ * rather than read it again. Only the damage within what the server can
+ * have copied is kept with the move, the rest is read as usual.
+ *
+ * @param win the window
+ * @param old the window's geometry before the move
+ * @param dx the distance the window moved horizontally
+ * @param dy the distance the window moved vertically
+ */
+static void
+track_window_move (Window win, XRectangle * old, int dx, int dy)
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+    Job *job = xvc_job_ptr ();
+    Region carried, clip, copied = get_copied_region (win, old, dx, dy);
+
+    pthread_mutex_lock (&(app->capturing_mutex));
+    pthread_mutex_lock (&(app->damage_regions_mutex));
+    if (job->dmg_num_moves < MAX_DAMAGE_MOVES) {
+        XVC_DamageMove *move = &(job->dmg_moves[job->dmg_num_moves]);
+
+        move->dx = dx;
+        move->dy = dy;
+        move->region = XCreateRegion ();
+        moving_window = win;
+        moving_index = job->dmg_num_moves++;
+        moving_window_more = TRUE;
+        moving_root_more = TRUE;
+        if (moving_copied)
+            XDestroyRegion (moving_copied);
+        moving_copied = copied;
+        copied = NULL;
+
+        // damage not captured yet moves along with the window, clipped to
+        // what the capture reads
+        carried = XCreateRegion ();
+        clip = XCreateRegion ();
+        XUnionRectWithRegion (old, carried, carried);
+        XIntersectRegion (job->dmg_region, carried, carried);
+        XOffsetRegion (carried, dx, dy);
+        XUnionRectWithRegion (xvc_capture_damage_area (), clip, clip);
+        XIntersectRegion (carried, clip, carried);
+        XUnionRegion (carried, job->dmg_region, job->dmg_region);
+        XDestroyRegion (clip);
+        XDestroyRegion (carried);
+    }
+    pthread_mutex_unlock (&(app->damage_regions_mutex));
+    pthread_mutex_unlock (&(app->capturing_mutex));
+    if (copied)
+        XDestroyRegion (copied);
+}
+
 /**
  * \brief event filter to register with gdk to retrieve X11 events
  *
@@ -461,6 +652,7 @@ xvc_xdamage_event_filter (GdkXEvent * xevent, GdkEvent * event, void *user_data)
     XDamageNotifyEvent *e = (XDamageNotifyEvent *) (xevent);
     static XserverRegion region = None;
     Job *job = xvc_job_ptr ();
+    XRectangle *area;
 
     // the following bits are purely for perormance reasons
     if (!app->recording_thread_running || job == NULL) {
@@ -474,6 +666,13 @@ xvc_xdamage_event_filter (GdkXEvent * xevent, GdkEvent * event, void *user_data)
     if (region == None)
         region = XFixesCreateRegion (app->dpy, 0, 0);
 
+    // only the damage reported right after a move belongs to it, that of
+    // the window itself and that of the root window including it
+    if (moving_window != None &&
+        (xev->type != app->dmg_event_base ||
+         (e->drawable != moving_window && e->drawable != app->root_window)))
+        moving_window = None;
+
     if (xev->type == MapNotify) {
         XWindowAttributes attribs;
         XWindowAttributes root_attrs;
@@ -481,20 +680,54 @@ xvc_xdamage_event_filter (GdkXEvent * xevent, GdkEvent * event, void *user_data)
 
         gdk_error_trap_push ();
         XGetWindowAttributes (app->dpy, app->root_window, &root_attrs);
-        ret = XGetWindowAttributes (app->dpy,
-                                    xev->xcreatewindow.window, &attribs);
+        ret = XGetWindowAttributes (app->dpy, xev->xmap.window, &attribs);
         gdk_error_trap_pop ();
 
-//        XSelectInput (app->dpy, xev->xcreatewindow.window, StructureNotifyMask);
-        if (!attribs.override_redirect && attribs.depth == root_attrs.depth) {
-//            gdk_error_trap_push ();
-            XDamageCreate (app->dpy, xev->xcreatewindow.window,
-                           XDamageReportRawRectangles);
-//            gdk_error_trap_pop ();
+        // the window may be gone already
+        if (ret && !attribs.override_redirect &&
+            attribs.depth == root_attrs.depth) {
+            track_window_damage (xev->xmap.window);
+            if (toplevels)
+                toplevel_add (xev->xmap.window, &attribs);
+        }
+    } else if (xev->type == UnmapNotify || xev->type == DestroyNotify) {
+        if (toplevels)
+            g_hash_table_remove (toplevels,
+                                 GUINT_TO_POINTER (xev->xunmap.window));
+        // a destroyed window takes its Damage with it
+        if (xev->type == DestroyNotify && damaged_windows)
+            g_hash_table_remove (damaged_windows,
+                                 GUINT_TO_POINTER (xev->xdestroywindow.
+                                                   window));
+    } else if (xev->type == ConfigureNotify) {
+        XConfigureEvent *ce = &(xev->xconfigure);
+        XRectangle *geom = (toplevels ?
+                            g_hash_table_lookup (toplevels,
+                                                 GUINT_TO_POINTER (ce->
+                                                                   window)) :
+                            NULL);
+
+        if (geom) {
+            int width = ce->width + 2 * ce->border_width;
+            int height = ce->height + 2 * ce->border_width;
+
+            // a resized window is redrawn and reports its damage as usual,
+            // and the xrender source always reads complete frames
+            if ((ce->x != geom->x || ce->y != geom->y) &&
+                width == geom->width && height == geom->height &&
+                !(job->flags & FLG_USE_XRENDER))
+                track_window_move (ce->window, geom, ce->x - geom->x,
+                                   ce->y - geom->y);
+            geom->x = ce->x;
+            geom->y = ce->y;
+            geom->width = width;
+            geom->height = height;
         }
     } else if (xev->type == app->dmg_event_base) {
+        // damage is reported relative to the damaged drawable
         XRectangle rect = {
-            e->area.x, e->area.y, e->area.width, e->area.height
+            e->area.x + e->geometry.x, e->area.y + e->geometry.y,
+            e->area.width, e->area.height
 /*
             XVC_MAX (e->area.x - 10, 0),
             XVC_MAX (e->area.y - 10, 0),
@@ -522,32 +755,61 @@ xvc_xdamage_event_filter (GdkXEvent * xevent, GdkEvent * event, void *user_data)
         // the full capture. And then the area of the event may be outside the
         // new capture area and anyway, we don't need this anymore because
         // we've captured this change in the full frame captured
-        if (rect.x < app->area->x && (rect.x + rect.width) > app->area->x) {
-            rect.width -= (app->area->x - rect.x);
-            rect.x = app->area->x;
+        // while a shadow of the screen is kept, all damage within it counts
+        area = xvc_capture_damage_area ();
+        if (rect.x < area->x && (rect.x + rect.width) > area->x) {
+            rect.width -= (area->x - rect.x);
+            rect.x = area->x;
         }
-        if ((rect.x + rect.width) > (app->area->x + app->area->width)) {
-            rect.width = (app->area->x + app->area->width) - rect.x;
+        if ((rect.x + rect.width) > (area->x + area->width)) {
+            rect.width = (area->x + area->width) - rect.x;
         }
-        if (rect.y < app->area->y && (rect.y + rect.height) > app->area->y) {
-            rect.height -= (app->area->y - rect.y);
-            rect.y = app->area->y;
+        if (rect.y < area->y && (rect.y + rect.height) > area->y) {
+            rect.height -= (area->y - rect.y);
+            rect.y = area->y;
         }
-        if ((rect.y + rect.height) > (app->area->y + app->area->height)) {
-            rect.height = (app->area->y + app->area->height) - rect.y;
+        if ((rect.y + rect.height) > (area->y + area->height)) {
+            rect.height = (area->y + area->height) - rect.y;
         }
 
-        if ((rect.x + rect.width) < app->area->x ||
-            rect.x > (app->area->x + app->area->width) ||
-            (rect.y + rect.height) < app->area->y ||
-            rect.y > (app->area->y + app->area->height)) {
+        if ((rect.x + rect.width) < area->x ||
+            rect.x > (area->x + area->width) ||
+            (rect.y + rect.height) < area->y ||
+            rect.y > (area->y + area->height)) {
             rect.x = rect.width = rect.y = rect.height = 0;
         } else {
-            // remember the damage done
+            // remember the damage done, with the move it was reported for
+            // if the capture has not taken that yet
             pthread_mutex_lock (&(app->damage_regions_mutex));
-            XUnionRectWithRegion (&rect, job->dmg_region, job->dmg_region);
+            if (moving_window != None && moving_index < job->dmg_num_moves) {
+                Region damage = XCreateRegion (), copy = XCreateRegion ();
+
+                // what the server cannot have copied, like the background
+                // painted where the window was covered, is read as usual
+                XUnionRectWithRegion (&rect, damage, damage);
+                XIntersectRegion (damage, moving_copied, copy);
+                XSubtractRegion (damage, copy, damage);
+                XUnionRegion (copy, job->dmg_moves[moving_index].region,
+                              job->dmg_moves[moving_index].region);
+                XUnionRegion (damage, job->dmg_region, job->dmg_region);
+                XDestroyRegion (copy);
+                XDestroyRegion (damage);
+            } else {
+                XUnionRectWithRegion (&rect, job->dmg_region,
+                                      job->dmg_region);
+            }
             pthread_mutex_unlock (&(app->damage_regions_mutex));
         }
+        // the move's damage is complete once both the window's and the
+        // root window's are
+        if (moving_window != None && !e->more) {
+            if (e->drawable == moving_window)
+                moving_window_more = FALSE;
+            else
+                moving_root_more = FALSE;
+            if (!moving_window_more && !moving_root_more)
+                moving_window = None;
+        }
         pthread_mutex_unlock (&(app->capturing_mutex));
     }
 
@@ -1209,9 +1471,16 @@ start_recording_nongui_stuff ()
             unsigned int nchildren, i;
 
             XGetWindowAttributes (app->dpy, app->root_window, &root_attrs);
-            XSelectInput (app->dpy, app->root_window, StructureNotifyMask);
-            XDamageCreate (app->dpy, app->root_window,
-                           XDamageReportRawRectangles);
+            // the top-level windows' events tell their moves
+            XSelectInput (app->dpy, app->root_window,
+                          StructureNotifyMask | SubstructureNotifyMask);
+            if (toplevels)
+                g_hash_table_remove_all (toplevels);
+            else
+                toplevels = g_hash_table_new_full (g_direct_hash,
+                                                   g_direct_equal, NULL,
+                                                   g_free);
+            track_window_damage (app->root_window);
             XQueryTree (app->dpy, app->root_window,
                         &root_return, &parent_return, &children, &nchildren);
 
@@ -1228,10 +1497,8 @@ start_recording_nongui_stuff ()
                     if (!attribs.
                         override_redirect
                         && attribs.depth == root_attrs.depth) {
-//                        gdk_error_trap_push ();
-                        XDamageCreate (app->dpy, children[i],
-                                       XDamageReportRawRectangles);
-//                        gdk_error_trap_pop ();
+                        track_window_damage (children[i]);
+                        toplevel_add (children[i], &attribs);
                     }
                 }
             }
@@ -37,6 +37,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
@@ -53,6 +54,7 @@
 #include "codecs.h"
 #include "control.h"
 #include "app_data.h"
+#include "alsa_input.h"
 #include "xvidcap-intl.h"
 # include "xtoffmpeg.h"
 
@@ -77,7 +79,8 @@ job_set_sound_dev (char *snd, int rate, int size, int channels)
 
     job->snd_device = snd;
     if (job->flags & FLG_REC_SOUND) {
-        if (strcmp (snd, "-") != 0) {
+        // ALSA names a pcm, not a file
+        if (strcmp (snd, "-") != 0 && !xvc_is_alsa_device (snd)) {
             stat_ret = stat (snd, &statbuf);
 
             if (stat_ret != 0) {
@@ -126,6 +129,12 @@ job_new ()
     job->movie_no = 0;
 
     job->time_per_frame = 0;
+    job->frame_time = 0;
+    job->damage_permille = -1;
+    job->frame_unchanged = FALSE;
+    job->frame_region = NULL;
+    job->stop_time.tv_sec = 0;
+    job->stop_time.tv_usec = 0;
     job->snd_device = NULL;
 
     job->get_colors = (void *(*)(XColor *, int)) NULL;
@@ -143,6 +152,7 @@ job_new ()
     job->c_info = NULL;
 
     job->dmg_region = XCreateRegion ();
+    job->dmg_num_moves = 0;
 
     job->capture_returned_errno = 0;
     job->frame_moved_x = 0;
@@ -157,11 +167,15 @@ job_new ()
 void
 xvc_job_free ()
 {
+    int i;
+
     if (job != NULL) {
         if (job->color_table)
             free (job->color_table);
 
         XDestroyRegion (job->dmg_region);
+        for (i = 0; i < job->dmg_num_moves; i++)
+            XDestroyRegion (job->dmg_moves[i].region);
 
         if (job->c_info)
             free (job->c_info);
@@ -217,6 +231,9 @@ xvc_job_set_from_app_data (XVC_AppData * app)
 
     job->time_per_frame = (int) (1000 /
                                  ((float) cto->fps.num / (float) cto->fps.den));
+    job->frame_time = 0;
+    job->damage_permille = -1;
+    job->frame_unchanged = FALSE;
 
     job->state = VC_STOP;              // FIXME: better move this outta here?
     job->pic_no = cto->start_no;
@@ -349,12 +366,17 @@ xvc_job_set_save_function (XVC_FFormatId type)
 static void
 job_set_capture (void)
 {
-    int input = job->flags & FLG_USE_SHM;
+    int input = job->flags & (FLG_USE_SHM | FLG_USE_XRENDER);
 
     switch (input) {
     case FLG_USE_SHM:
         job->capture = xvc_capture_shm;
         break;
+#ifdef HAVE_LIBXRENDER
+    case FLG_USE_XRENDER:
+        job->capture = xvc_capture_xrender;
+        break;
+#endif     // HAVE_LIBXRENDER
     default:
         job->capture = xvc_capture_x11;
         break;
@@ -378,6 +400,10 @@ job_state_change_signals_thread (int orig_state, int new_state)
         ((orig_state & VC_STOP) == 0 && (new_state & VC_STOP) > 0) ||
         ((orig_state & VC_STEP) == 0 && (new_state & VC_STEP) > 0)
         ) {
+        // remember when a stop was asked for, to report how long the
+        // output took to close
+        if ((orig_state & VC_STOP) == 0 && (new_state & VC_STOP) > 0)
+            gettimeofday (&(job->stop_time), NULL);
         // signal potentially paused thread
         pthread_cond_broadcast (&(app->recording_condition_unpaused));
     }
@@ -505,4 +531,25 @@ xvc_get_damage_region ()
     job->dmg_region = region;
     pthread_mutex_unlock (&(app->damage_regions_mutex));
     return dmg_region;
-}
\ No newline at end of file
+}
+
+/**
+ * \brief takes the windows moved since the last call
+ *
+ * @param moves gets the moves in the order the windows moved, the caller
+ *      destroys their regions
+ * @return the number of moves
+ */
+int
+xvc_get_damage_moves (XVC_DamageMove * moves)
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+    int num_moves;
+
+    pthread_mutex_lock (&(app->damage_regions_mutex));
+    num_moves = job->dmg_num_moves;
+    memcpy (moves, job->dmg_moves, num_moves * sizeof (XVC_DamageMove));
+    job->dmg_num_moves = 0;
+    pthread_mutex_unlock (&(app->damage_regions_mutex));
+    return num_moves;
+}
@@ -28,6 +28,7 @@
 #ifndef DOXYGEN_SHOULD_SKIP_THIS
 #include <X11/Intrinsic.h>
 #include <stdio.h>
+#include <sys/time.h>
 #include "app_data.h"
 #include "colors.h"
 
@@ -56,6 +57,24 @@ enum JobStates
     VC_CONTINUE = 64
 };
 
+/** \brief most window moves kept between two frames */
+#define MAX_DAMAGE_MOVES 16
+
+/**
+ * \brief a top-level window moved on the screen
+ */
+typedef struct
+{
+    /** \brief the distance the window moved */
+    int dx;
+    int dy;
+    /**
+     * \brief the part of the window at its new position the X server copied
+     *      there from the old one, in root window coordinates
+     */
+    Region region;
+} XVC_DamageMove;
+
 /**
  * \brief keeps data about the current recording job
  *
@@ -83,6 +102,31 @@ typedef struct  //_job
     int movie_no;
     /** \brief time per frame in milli secs */
     int time_per_frame;
+    /**
+     * \brief time the last frame took to capture and save in milli secs,
+     *      0 if unknown
+     */
+    int frame_time;
+    /**
+     * \brief share of the capture area that changed since the previous
+     *      frame in 1/1000, -1 if unknown
+     */
+    int damage_permille;
+    /**
+     * \brief TRUE if neither the screen nor the mouse pointer changed since
+     *      the previous frame
+     */
+    int frame_unchanged;
+    /**
+     * \brief region of the frame that changed since the previous one in
+     *      capture area coordinates, NULL if unknown
+     */
+    Region frame_region;
+    /**
+     * \brief time the user asked the recording to stop, zero if the
+     *      recording stopped on its own
+     */
+    struct timeval stop_time;
     /** \brief sound device */
     char *snd_device;
 
@@ -134,6 +178,12 @@ typedef struct  //_job
 
 	// XserverRegion dmg_region;
     Region dmg_region;
+    /**
+     * \brief windows moved since the last frame in the order they moved,
+     *      guarded by the damage_regions_mutex like dmg_region
+     */
+    XVC_DamageMove dmg_moves[MAX_DAMAGE_MOVES];
+    int dmg_num_moves;
 
     /** \brief the last capture session returned this errno */
     int capture_returned_errno;
@@ -157,5 +207,6 @@ void xvc_job_keep_state (int state);
 void xvc_job_keep_and_merge_state (int merge_state, int remove_state);
 
 //XserverRegion xvc_get_damage_region ();
+int xvc_get_damage_moves (XVC_DamageMove * moves);
 Region xvc_get_damage_region ();
 #endif     // _xvc_JOB_H__
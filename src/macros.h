@@ -28,6 +28,8 @@
 
 #define XVC_MIN(a,b) ((a)<(b)? (a):(b))
 
+#define XVC_MAX_THREADS 64
+
 #define XVC_GLADE_FILE PACKAGE_DATA_DIR"/xvidcap/glade/gnome-xvidcap.glade"
 
 #define PATH_MAX 4096
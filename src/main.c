@@ -45,6 +45,7 @@
 #include "codecs.h"
 #include "job.h"
 #include "frame.h"
+#include "outfile.h"
 #include "xvidcap-intl.h"
 
 typedef void (*sighandler_t) (int);
@@ -85,9 +86,31 @@ usage (char *prog)
             ("[--window <hex-window-id>] a hexadecimal window id (ref. xwininfo)\n"));
     printf (_
             ("[--rescale #]    relative output size in percent compared to input (1-100)\n"));
+    printf (_
+            ("[--rescale_snap [yes|no]] snap rescale to 1/2, 1/4, or 1/8 of the input size for faster scaling\n"));
     printf (_("[--quality #]    recording quality (1-100)\n"));
+    printf (_
+            ("[--threads #]    encoder threads, 0 means one per online processor\n"));
+    printf (_
+            ("[--profile <p>]  encoder performance profile: realtime, balanced, archive\n"));
+    printf (_
+            ("[--keyframe_interval #] maximum seconds between keyframes placed on screen changes, 0 is off\n"));
+    printf (_
+            ("[--gop_encoders #] encoders working on consecutive gops in parallel, 0 is off\n"));
+    printf (_
+            ("[--gop_length #] frames per gop for parallel gop encoding, 0 for one second\n"));
+    printf (_
+            ("[--tiles <c>x<r>] split the capture area into tiles encoded in parallel\n"));
+    printf (_
+            ("[--output_io <io>] write the output file through: avio, blocks, uring\n"));
+    printf (_
+            ("[--preallocate #] MB to preallocate the output file by, 0 is off\n"));
+    printf (_
+            ("[--fsync #]      seconds between syncs to disk, 0 on close only, -1 never\n"));
+    printf (_
+            ("[--fragment #]   seconds between fragments flushed at keyframes, 0 is off\n"));
     printf (_("[--start_no #]   start number for the file names\n"));
-    printf (_("[--source <src>] select input source: x11, shm\n"));
+    printf (_("[--source <src>] select input source: x11, shm, xrender\n"));
     printf (_("[--file <file>]  file pattern, e.g. out%%03d.xwd\n"));
     printf (_("[--gui [yes|no]] turn on/off gui\n"));
     printf (_
@@ -110,10 +133,20 @@ usage (char *prog)
     printf (_("[--audio [yes|no]] turn on/off audio capture\n"));
     printf
         (_
-         ("[--audio_in <src>] specify audio input device or '-' for pipe input\n"));
+         ("[--audio_in <src>] specify audio input device, alsa:<pcm> or '-' for pipe input\n"));
     printf (_("[--audio_rate #] sample rate for audio capture\n"));
     printf (_("[--audio_bits #] bit rate for audio capture\n"));
     printf (_("[--audio_channels #] number of audio channels\n"));
+    printf (_
+            ("[--audio_gain #] gain in percent applied to the audio input, 100 is unchanged\n"));
+    printf (_
+            ("[--audio_mix <dev>[@#],...] further audio devices mixed in, with their gain in percent\n"));
+    printf (_
+            ("[--audio_period #] usecs per period of ALSA audio inputs, 0 for the default\n"));
+    printf (_
+            ("[--audio_buffer #] usecs in the buffer of ALSA audio inputs, 0 for the default\n"));
+    printf (_
+            ("[--shadow <root|WxH+X+Y|off>] crop captures from a damage-maintained copy of that part of the screen\n"));
    
     exit (1);
 }
@@ -229,6 +262,22 @@ parse_cli_options (XVC_CapTypeOptions * tmp_capture_options, int argc,
         {"auto", no_argument, NULL, 0},
         {"rescale", required_argument, NULL, 0},
         {"window", required_argument, NULL, 0},
+        {"rescale_snap", optional_argument, NULL, 0},
+        {"threads", required_argument, NULL, 0},
+        {"profile", required_argument, NULL, 0},
+        {"keyframe_interval", required_argument, NULL, 0},
+        {"gop_encoders", required_argument, NULL, 0},
+        {"gop_length", required_argument, NULL, 0},
+        {"tiles", required_argument, NULL, 0},
+        {"output_io", required_argument, NULL, 0},
+        {"preallocate", required_argument, NULL, 0},
+        {"fsync", required_argument, NULL, 0},
+        {"fragment", required_argument, NULL, 0},
+        {"audio_gain", required_argument, NULL, 0},
+        {"audio_mix", required_argument, NULL, 0},
+        {"audio_period", required_argument, NULL, 0},
+        {"audio_buffer", required_argument, NULL, 0},
+        {"shadow", required_argument, NULL, 0},
         {NULL, 0, NULL, 0},
     };
     int opt_index = 0, c;
@@ -550,6 +599,82 @@ parse_cli_options (XVC_CapTypeOptions * tmp_capture_options, int argc,
                     capture_window = (Window) win_id;
                     break;
                 }
+            case 28:                  // rescale_snap
+                {
+                    char *tmp;
+
+                    if (!optarg) {
+                        if (optind < argc) {
+                            tmp =
+                                (_argv[optind][0] ==
+                                 '-') ? "yes" : _argv[optind++];
+                        } else {
+                            tmp = "yes";
+                        }
+                    } else {
+                        tmp = strdup (optarg);
+                    }
+                    if (strstr (tmp, "no") != NULL) {
+                        app->flags &= ~FLG_RESCALE_SNAP;
+                    } else {
+                        app->flags |= FLG_RESCALE_SNAP;
+                    }
+                }
+                break;
+            case 29:                  // threads
+                app->threads = atoi (optarg);
+                break;
+            case 30:                  // profile
+                app->profile = xvc_get_profile_from_name (optarg);
+                if (app->profile < 0)
+                    usage (_argv[0]);
+                break;
+            case 31:                  // keyframe_interval
+                app->keyframe_interval = atoi (optarg);
+                break;
+            case 32:                  // gop_encoders
+                app->gop_encoders = atoi (optarg);
+                break;
+            case 33:                  // gop_length
+                app->gop_length = atoi (optarg);
+                break;
+            case 34:                  // tiles
+                if (sscanf (optarg, "%ix%i", &app->tile_cols,
+                            &app->tile_rows) != 2)
+                    usage (_argv[0]);
+                break;
+            case 35:                  // output_io
+                app->output_io = xvc_get_output_io_from_name (optarg);
+                if (app->output_io < 0)
+                    usage (_argv[0]);
+                break;
+            case 36:                  // preallocate
+                app->preallocate = atoi (optarg);
+                break;
+            case 37:                  // fsync
+                app->fsync_interval = atoi (optarg);
+                break;
+            case 38:                  // fragment
+                app->fragment_interval = atoi (optarg);
+                break;
+            case 39:                  // audio_gain
+                tmp_capture_options->audioWanted = 1;
+                app->audio_gain = atoi (optarg);
+                break;
+            case 40:                  // audio_mix
+                tmp_capture_options->audioWanted = 1;
+                app->audio_mix = (*optarg ? strdup (optarg) : NULL);
+                break;
+            case 41:                  // audio_period
+                app->audio_period = atoi (optarg);
+                break;
+            case 42:                  // audio_buffer
+                app->audio_buffer = atoi (optarg);
+                break;
+            case 43:                  // shadow
+                app->shadow = ((*optarg && strcmp (optarg, "off") != 0) ?
+                               strdup (optarg) : NULL);
+                break;
             default:
                 usage (_argv[0]);
                 break;
@@ -742,6 +867,22 @@ print_current_settings (XVC_CapTypeOptions * target)
         printf ("+%i+%i", app->area->x, app->area->y);
     printf ("\n");
     printf (_(" rescale output to = %i\n"), app->rescale);
+    printf (_(" snap rescale = %s\n"), ((app->flags & FLG_RESCALE_SNAP) ? "yes" : "no"));
+    printf (_(" encoder threads = %i\n"), app->threads);
+    printf (_(" encoder profile = %s\n"),
+            xvc_profile_names[(app->profile >= 0 && app->profile < NUMPROFILES) ?
+                              app->profile : PROFILE_BALANCED]);
+    printf (_(" max keyframe interval = %i\n"), app->keyframe_interval);
+    printf (_(" gop encoders = %i\n"), app->gop_encoders);
+    printf (_(" gop length = %i\n"), app->gop_length);
+    printf (_(" tiles = %ix%i\n"), app->tile_cols, app->tile_rows);
+    printf (_(" output io = %s\n"),
+            xvc_output_io_names[(app->output_io >= 0 &&
+                                 app->output_io < NUMOUTPUTIO) ?
+                                app->output_io : OUTPUT_IO_DEFAULT]);
+    printf (_(" preallocate = %i MB\n"), app->preallocate);
+    printf (_(" fsync = %i\n"), app->fsync_interval);
+    printf (_(" fragment = %i\n"), app->fragment_interval);
     printf (_(" frames per second = %.2f\n"), ((float) target->fps.num / (float) target->fps.den));
     printf (_(" file pattern = %s\n"), target->file);
     printf (_(" file format = %s\n"),  xvc_formats[target->target].longname);
@@ -753,12 +894,17 @@ print_current_settings (XVC_CapTypeOptions * target)
     printf (_(" time to capture = %i sec\n"), target->time);
     printf (_(" autocontinue = %s\n"), ((app->flags & FLG_AUTO_CONTINUE) ? "yes" : "no"));
     printf (_(" input source = %s (%d)\n"), app->source, app->flags & FLG_USE_SHM);
+    printf (_(" shadow = %s\n"), (app->shadow ? app->shadow : "off"));
     printf (_(" capture pointer = %s\n"), mp);
     printf (_(" capture audio = %s\n"), ((target->audioWanted == 1) ? "yes" : "no"));
     printf (_(" - input = %s\n"), app->snddev);
     printf (_(" - sample rate = %i\n"), target->sndrate);
     printf (_(" - bit rate = %i\n"), target->sndsize);
     printf (_(" - channels = %i\n"), target->sndchannels);
+    printf (_(" - gain = %i%%\n"), app->audio_gain);
+    printf (_(" - mixed in = %s\n"), (app->audio_mix ? app->audio_mix : "none"));
+    printf (_(" - alsa period = %i usecs\n"), app->audio_period);
+    printf (_(" - alsa buffer = %i usecs\n"), app->audio_buffer);
     printf (_(" animate command = %s\n"), target->play_cmd);
     printf (_(" make video command= %s\n"), target->video_cmd);
     printf (_(" edit frame command= %s\n"), target->edit_cmd);
@@ -0,0 +1,661 @@
+/**
+ * \file outfile.c
+ *
+ * This file contains the writing of the output file for libavformat. Instead
+ * of many small synchronous write () calls through libavformat's file
+ * protocol the output is collected in large page aligned blocks. Full blocks
+ * are written with a single pwrite () or, with io_uring, submitted to the
+ * kernel and written while the next block fills. The file can be
+ * preallocated ahead of the writes and synced to disk as configured.
+ */
+/*
+ * Copyright (C) 2003-07 Karl H. Beckers, Frankfurt
+ * EMail: khb@jarre-de-the.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif     // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif     // HAVE_LIBURING
+
+#include "app_data.h"
+#include "outfile.h"
+#include "xvidcap-intl.h"
+
+/** \brief size of a block, the output is written in writes of this size */
+#define OUT_BLOCK_SIZE (1024 * 1024)
+
+/** \brief number of blocks, one is filled while the others are written */
+#define OUT_BLOCKS 4
+
+/** \brief alignment of the blocks in memory */
+#define OUT_BLOCK_ALIGN 4096
+
+/** \brief size of the buffer libavformat writes through */
+#define OUT_AVIO_BUFFER_SIZE 32768
+
+/**
+ * \brief names of the output io modes in the order of XVC_OutputIoId
+ */
+const char *xvc_output_io_names[] = {
+    "avio",
+    "blocks",
+    "uring"
+};
+
+/** \brief a block of output to be written at one offset of the file */
+typedef struct
+{
+    uint8_t *data;
+    int64_t offset;
+    /* bytes collected */
+    int size;
+    /* bytes written so far, writes can come back short */
+    int written;
+    /* TRUE while the write is in flight */
+    int busy;
+} XVC_OutBlock;
+
+static XVC_OutBlock out_blocks[OUT_BLOCKS];
+
+/** \brief the block being filled */
+static int out_cur = 0;
+
+/** \brief descriptor of the open output file, -1 if the file was opened
+ *      through libavformat's file protocol */
+static int out_fd = -1;
+
+/** \brief output io mode of the open file */
+static int out_io = OUTPUT_IO_AVIO;
+
+/** \brief buffer libavformat writes through, kept for the next file */
+static uint8_t *out_avio_buf = NULL;
+
+/** \brief write position and size of the file */
+static int64_t out_pos = 0;
+static int64_t out_size = 0;
+
+/** \brief bytes to preallocate ahead of the writes, 0 for none, and how
+ *      far the file is preallocated */
+static int64_t out_prealloc_step = 0;
+static int64_t out_prealloc_end = 0;
+
+/** \brief secs between syncs, 0 to sync when closing only, -1 never */
+static int out_fsync_interval = -1;
+static struct timeval out_last_sync;
+
+/** \brief errno of the first failed write, 0 if none failed */
+static int out_error = 0;
+
+/** \brief for the summary when closing the file */
+static long out_writes = 0;
+static int out_syncs = 0;
+
+#ifdef HAVE_LIBURING
+static struct io_uring out_ring;
+static int out_ring_ready = FALSE;
+
+/** \brief writes and syncs submitted to the ring and not completed yet */
+static int out_inflight = 0;
+
+/** \brief TRUE while a sync is in flight */
+static int out_sync_busy = FALSE;
+#endif     // HAVE_LIBURING
+
+/**
+ * \brief find an output io mode by its name
+ *
+ * @param name the name of the mode, e.g. "uring"
+ * @return the XVC_OutputIoId of the mode or -1 if there is none of that name
+ */
+int
+xvc_get_output_io_from_name (const char *name)
+{
+    int i;
+
+    for (i = 0; i < NUMOUTPUTIO; i++) {
+        if (strcasecmp (name, xvc_output_io_names[i]) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+/**
+ * \brief remember a failed write, only the first one is reported
+ *
+ * @param err the errno of the failure
+ */
+static void
+write_failed (int err)
+{
+    if (!out_error) {
+        fprintf (stderr, _("Error writing the output file: %s\n"),
+                 strerror (err));
+        out_error = err;
+    }
+}
+
+/**
+ * \brief preallocate the file some way ahead of a write
+ *
+ * The space is allocated without changing the file size, so a file that is
+ * not closed properly has no garbage at the end.
+ *
+ * @param end where the write ends
+ */
+static void
+preallocate (int64_t end)
+{
+    if (out_prealloc_step <= 0 || end <= out_prealloc_end)
+        return;
+    while (out_prealloc_end < end)
+        out_prealloc_end += out_prealloc_step;
+
+#ifdef FALLOC_FL_KEEP_SIZE
+    if (fallocate (out_fd, FALLOC_FL_KEEP_SIZE, 0, out_prealloc_end) == 0)
+        return;
+    fprintf (stderr,
+             _("Cannot preallocate the output file (%s), writing without\n"),
+             strerror (errno));
+#endif     // FALLOC_FL_KEEP_SIZE
+    out_prealloc_step = 0;
+}
+
+/**
+ * \brief write what is left of a block right away
+ *
+ * @param b the block
+ */
+static void
+write_block_sync (XVC_OutBlock * b)
+{
+    while (b->written < b->size && !out_error) {
+        ssize_t ret = pwrite (out_fd, b->data + b->written,
+                              b->size - b->written, b->offset + b->written);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            write_failed (ret < 0 ? errno : ENOSPC);
+            break;
+        }
+        b->written += ret;
+        out_writes++;
+    }
+    b->size = 0;
+    b->written = 0;
+}
+
+#ifdef HAVE_LIBURING
+/**
+ * \brief submit what is left of a block to the ring
+ *
+ * @param b the block
+ */
+static void
+submit_block_uring (XVC_OutBlock * b)
+{
+    // the ring has room for every block and a sync
+    struct io_uring_sqe *sqe = io_uring_get_sqe (&out_ring);
+
+    if (!sqe) {
+        write_block_sync (b);
+        return;
+    }
+    io_uring_prep_write (sqe, out_fd, b->data + b->written,
+                         b->size - b->written, b->offset + b->written);
+    io_uring_sqe_set_data (sqe, b);
+    b->busy = TRUE;
+    out_inflight++;
+    io_uring_submit (&out_ring);
+}
+
+/**
+ * \brief wait for a write or sync submitted to the ring to complete
+ *
+ * A short write is submitted again for the rest of the block.
+ */
+static void
+complete_uring ()
+{
+    struct io_uring_cqe *cqe;
+    XVC_OutBlock *b;
+    int ret, i;
+
+    do {
+        ret = io_uring_wait_cqe (&out_ring, &cqe);
+    } while (ret == -EINTR);
+    if (ret < 0) {
+        // nothing will complete anymore
+        write_failed (-ret);
+        out_inflight = 0;
+        out_sync_busy = FALSE;
+        for (i = 0; i < OUT_BLOCKS; i++)
+            out_blocks[i].busy = FALSE;
+        return;
+    }
+
+    b = io_uring_cqe_get_data (cqe);
+    ret = cqe->res;
+    io_uring_cqe_seen (&out_ring, cqe);
+    out_inflight--;
+
+    // a sync
+    if (!b) {
+        out_sync_busy = FALSE;
+        if (ret < 0)
+            write_failed (-ret);
+        return;
+    }
+
+    b->busy = FALSE;
+    out_writes++;
+    if (ret <= 0) {
+        write_failed (ret < 0 ? -ret : ENOSPC);
+    } else {
+        b->written += ret;
+        if (b->written < b->size && !out_error) {
+            submit_block_uring (b);
+            return;
+        }
+    }
+    b->size = 0;
+    b->written = 0;
+}
+#endif     // HAVE_LIBURING
+
+/**
+ * \brief wait for all writes and syncs in flight to complete
+ */
+static void
+drain ()
+{
+#ifdef HAVE_LIBURING
+    while (out_inflight > 0)
+        complete_uring ();
+#endif     // HAVE_LIBURING
+}
+
+/**
+ * \brief write a block, with io_uring it is only submitted
+ *
+ * @param b the block
+ */
+static void
+submit_block (XVC_OutBlock * b)
+{
+    if (b->size == 0)
+        return;
+    preallocate (b->offset + b->size);
+#ifdef HAVE_LIBURING
+    if (out_io == OUTPUT_IO_URING) {
+        submit_block_uring (b);
+        return;
+    }
+#endif     // HAVE_LIBURING
+    write_block_sync (b);
+}
+
+/**
+ * \brief write the block being filled and continue with the next one once
+ *      that is free
+ */
+static void
+next_block ()
+{
+    XVC_OutBlock *b;
+
+    submit_block (&out_blocks[out_cur]);
+    out_cur = (out_cur + 1) % OUT_BLOCKS;
+    b = &out_blocks[out_cur];
+#ifdef HAVE_LIBURING
+    while (b->busy)
+        complete_uring ();
+#endif     // HAVE_LIBURING
+    b->size = 0;
+    b->written = 0;
+}
+
+/**
+ * \brief sync the file to disk
+ *
+ * With io_uring the sync is submitted behind the writes in flight and not
+ * waited for.
+ */
+static void
+sync_file ()
+{
+    gettimeofday (&out_last_sync, NULL);
+    out_syncs++;
+#ifdef HAVE_LIBURING
+    if (out_io == OUTPUT_IO_URING) {
+        struct io_uring_sqe *sqe;
+
+        if (out_sync_busy || !(sqe = io_uring_get_sqe (&out_ring)))
+            return;
+        io_uring_prep_fsync (sqe, out_fd, IORING_FSYNC_DATASYNC);
+        // only sync once the writes before are done
+        sqe->flags |= IOSQE_IO_DRAIN;
+        io_uring_sqe_set_data (sqe, NULL);
+        out_sync_busy = TRUE;
+        out_inflight++;
+        io_uring_submit (&out_ring);
+        return;
+    }
+#endif     // HAVE_LIBURING
+    if (fdatasync (out_fd) < 0)
+        write_failed (errno);
+}
+
+/**
+ * \brief write callback of the io context
+ *
+ * @param opaque unused
+ * @param buf the data to write
+ * @param size the size of the data
+ * @return size or a negative error code
+ */
+static int
+outfile_write (void *opaque, uint8_t * buf, int size)
+{
+    int done = 0;
+
+    while (done < size) {
+        XVC_OutBlock *b = &out_blocks[out_cur];
+        int n = FFMIN (size - done, OUT_BLOCK_SIZE - b->size);
+
+        if (b->size == 0)
+            b->offset = out_pos;
+        memcpy (b->data + b->size, buf + done, n);
+        b->size += n;
+        done += n;
+        out_pos += n;
+        if (b->size == OUT_BLOCK_SIZE)
+            next_block ();
+    }
+    out_size = FFMAX (out_size, out_pos);
+
+    if (out_fsync_interval > 0) {
+        struct timeval now;
+
+        gettimeofday (&now, NULL);
+        if (now.tv_sec - out_last_sync.tv_sec >= out_fsync_interval) {
+            next_block ();
+            sync_file ();
+        }
+    }
+
+    return (out_error ? AVERROR (out_error) : size);
+}
+
+/**
+ * \brief seek callback of the io context
+ *
+ * Muxers seek back to fill in headers. The blocks in flight are written
+ * before anything at another position, so writes cannot overtake each
+ * other.
+ *
+ * @param opaque unused
+ * @param offset where to seek to
+ * @param whence SEEK_SET, SEEK_CUR, SEEK_END or AVSEEK_SIZE
+ * @return the new position, or the file size for AVSEEK_SIZE
+ */
+static int64_t
+outfile_seek (void *opaque, int64_t offset, int whence)
+{
+#ifdef AVSEEK_FORCE
+    whence &= ~AVSEEK_FORCE;
+#endif     // AVSEEK_FORCE
+    if (whence == AVSEEK_SIZE)
+        return out_size;
+    if (whence == SEEK_CUR)
+        offset += out_pos;
+    else if (whence == SEEK_END)
+        offset += out_size;
+    if (offset < 0)
+        return AVERROR (EINVAL);
+    if (offset == out_pos)
+        return offset;
+
+    next_block ();
+    drain ();
+    out_pos = offset;
+
+    return offset;
+}
+
+/**
+ * \brief allocate the blocks and set up the ring for the first file
+ *
+ * @param output_io the output io mode wanted
+ * @return the output io mode that can be used
+ */
+static int
+setup_blocks (int output_io)
+{
+    int i;
+
+    if (!out_avio_buf) {
+        out_avio_buf = av_malloc (OUT_AVIO_BUFFER_SIZE);
+        for (i = 0; i < OUT_BLOCKS && out_avio_buf; i++) {
+            if (posix_memalign ((void **) &(out_blocks[i].data),
+                                OUT_BLOCK_ALIGN, OUT_BLOCK_SIZE) != 0)
+                out_blocks[i].data = NULL;
+            if (!out_blocks[i].data) {
+                xvc_outfile_release ();
+                break;
+            }
+        }
+        if (!out_avio_buf) {
+            fprintf (stderr,
+                     _("Could not alloc the output blocks, writing through libavformat\n"));
+            return OUTPUT_IO_AVIO;
+        }
+    }
+#ifdef HAVE_LIBURING
+    if (output_io == OUTPUT_IO_URING && !out_ring_ready) {
+        int ret = io_uring_queue_init (OUT_BLOCKS + 1, &out_ring, 0);
+
+        if (ret < 0) {
+            fprintf (stderr,
+                     _("Cannot use io_uring (%s), writing blocks synchronously\n"),
+                     strerror (-ret));
+            return OUTPUT_IO_BLOCKS;
+        }
+        out_ring_ready = TRUE;
+    }
+#else
+    if (output_io == OUTPUT_IO_URING)
+        output_io = OUTPUT_IO_BLOCKS;
+#endif     // HAVE_LIBURING
+
+    return output_io;
+}
+
+/**
+ * \brief open the output file of a format context
+ *
+ * Pipes and other protocols than files always go through libavformat.
+ *
+ * @param oc the format context with the url of the file in oc->filename
+ * @param output_io the XVC_OutputIoId of the way to write the file
+ * @param preallocate MB to preallocate ahead of the writes, 0 for none
+ * @param fsync_interval secs between syncs to disk, 0 to sync when closing
+ *      only, -1 to leave syncing to the system
+ * @return 0 on success, < 0 on error
+ */
+int
+xvc_outfile_open (AVFormatContext * oc, int output_io, int preallocate,
+                  int fsync_interval)
+{
+    const char *path = oc->filename;
+
+    out_fd = -1;
+    if (output_io != OUTPUT_IO_AVIO && strncmp (path, "file://", 7) == 0)
+        output_io = setup_blocks (output_io);
+    else
+        output_io = OUTPUT_IO_AVIO;
+    out_io = output_io;
+    if (output_io == OUTPUT_IO_AVIO)
+        return url_fopen (&oc->pb, oc->filename, URL_WRONLY);
+
+    path += 7;
+    out_fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out_fd < 0)
+        return AVERROR (errno);
+
+    oc->pb = av_alloc_put_byte (out_avio_buf, OUT_AVIO_BUFFER_SIZE, 1, NULL,
+                                NULL, outfile_write, outfile_seek);
+    if (!oc->pb) {
+        close (out_fd);
+        out_fd = -1;
+        return AVERROR (ENOMEM);
+    }
+
+    out_cur = 0;
+    out_blocks[0].size = 0;
+    out_blocks[0].written = 0;
+    out_pos = 0;
+    out_size = 0;
+    out_prealloc_step = (int64_t) preallocate * 1024 * 1024;
+    out_prealloc_end = 0;
+    out_fsync_interval = fsync_interval;
+    gettimeofday (&out_last_sync, NULL);
+    out_error = 0;
+    out_writes = 0;
+    out_syncs = 0;
+
+    return 0;
+}
+
+/**
+ * \brief write everything muxed so far to the output file of a format
+ *      context
+ *
+ * This is called at fragment boundaries, so that a crash loses no more
+ * than the fragment being recorded. Unless syncing is left to the system,
+ * the file is synced to disk, too.
+ *
+ * @param oc the format context
+ * @return 0 on success, < 0 if writing the file failed
+ */
+int
+xvc_outfile_flush (AVFormatContext * oc)
+{
+    put_flush_packet (oc->pb);
+    if (out_fd < 0)
+        return url_ferror (oc->pb);
+
+    next_block ();
+    drain ();
+    if (out_fsync_interval >= 0)
+        sync_file ();
+
+    return (out_error ? AVERROR (out_error) : 0);
+}
+
+/**
+ * \brief write what is still buffered and close the output file of a
+ *      format context
+ *
+ * @param oc the format context
+ * @return 0 on success, < 0 if writing the file failed
+ */
+int
+xvc_outfile_close (AVFormatContext * oc)
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+    int ret;
+
+    if (out_fd < 0)
+        return url_fclose (oc->pb);
+
+    put_flush_packet (oc->pb);
+    next_block ();
+    drain ();
+    if (out_fsync_interval >= 0) {
+        sync_file ();
+        drain ();
+    }
+    // give back what was preallocated beyond the end
+    if (out_prealloc_end > out_size && ftruncate (out_fd, out_size) < 0)
+        write_failed (errno);
+    if (close (out_fd) < 0)
+        write_failed (errno);
+    out_fd = -1;
+    av_free (oc->pb);
+    oc->pb = NULL;
+
+    if (app->verbose > 1) {
+        printf ("output file (%s io): %lli bytes in %li writes, %i syncs\n",
+                xvc_output_io_names[out_io], (long long) out_size,
+                out_writes, out_syncs);
+    }
+    ret = (out_error ? AVERROR (out_error) : 0);
+    out_error = 0;
+
+    return ret;
+}
+
+/**
+ * \brief get the way the latest output file was written
+ *
+ * This differs from what was asked for if xvc_outfile_open () fell back
+ * to libavformat.
+ *
+ * @return the XVC_OutputIoId used
+ */
+int
+xvc_outfile_get_io ()
+{
+    return out_io;
+}
+
+/**
+ * \brief free the blocks and the ring kept from file to file
+ */
+void
+xvc_outfile_release ()
+{
+    int i;
+
+    for (i = 0; i < OUT_BLOCKS; i++) {
+        free (out_blocks[i].data);
+        out_blocks[i].data = NULL;
+    }
+    av_free (out_avio_buf);
+    out_avio_buf = NULL;
+#ifdef HAVE_LIBURING
+    if (out_ring_ready) {
+        io_uring_queue_exit (&out_ring);
+        out_ring_ready = FALSE;
+    }
+#endif     // HAVE_LIBURING
+}
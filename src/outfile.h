@@ -0,0 +1,56 @@
+/**
+ * \file outfile.h
+ */
+/*
+ * Copyright (C) 2003-07 Karl H. Beckers, Frankfurt
+ * EMail: khb@jarre-de-the.net
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _xvc_OUTFILE_H__
+#define _xvc_OUTFILE_H__
+
+#include <libavformat/avformat.h>
+
+/**
+ * \brief ways of writing the output file
+ */
+typedef enum
+{
+    /** \brief libavformat's own file protocol */
+    OUTPUT_IO_AVIO,
+    /** \brief large aligned blocks written with pwrite () */
+    OUTPUT_IO_BLOCKS,
+    /** \brief large aligned blocks submitted through io_uring */
+    OUTPUT_IO_URING,
+    NUMOUTPUTIO
+} XVC_OutputIoId;
+
+/** \brief the output io used unless configured otherwise, libavformat's
+ *      until the block writers have proven faster on real recordings */
+#define OUTPUT_IO_DEFAULT OUTPUT_IO_AVIO
+
+extern const char *xvc_output_io_names[];
+
+int xvc_get_output_io_from_name (const char *name);
+int xvc_outfile_open (AVFormatContext * oc, int output_io, int preallocate,
+                      int fsync_interval);
+int xvc_outfile_flush (AVFormatContext * oc);
+int xvc_outfile_close (AVFormatContext * oc);
+int xvc_outfile_get_io ();
+void xvc_outfile_release ();
+
+#endif     // _xvc_OUTFILE_H__
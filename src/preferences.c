@@ -53,6 +53,9 @@ xvc_write_options_file ()
 	fprintf (fp, _("# capture source\n"));
     fprintf (fp, "source: %s\n", app->source);
 
+	fprintf (fp, _("# part of the screen captures are cropped from, root, WxH+X+Y or off\n"));
+    fprintf (fp, "shadow: %s\n", (app->shadow ? app->shadow : "off"));
+
     fprintf (fp, _("# hide GUI\n"));
     fprintf (fp, "nogui: %d\n", ((app->flags & FLG_NOGUI) ? 1 : 0));
 	
@@ -62,6 +65,16 @@ xvc_write_options_file ()
 	fprintf (fp, _("# device to grab audio from\n"));
     fprintf (fp, "audio_in: %s\n", ((strcmp (app->snddev, "pipe:") == 0) ? "-" : app->snddev));
 
+	fprintf (fp, _("# gain in percent applied to the audio input\n"));
+    fprintf (fp, "audio_gain: %i\n", app->audio_gain);
+
+	fprintf (fp, _("# further audio devices mixed in, comma separated, each with an optional @gain in percent\n"));
+    fprintf (fp, "audio_mix: %s\n", (app->audio_mix ? app->audio_mix : ""));
+
+	fprintf (fp, _("# usecs per period and in the buffer of ALSA audio inputs, 0 for the device's default\n"));
+    fprintf (fp, "audio_period: %i\n", app->audio_period);
+    fprintf (fp, "audio_buffer: %i\n", app->audio_buffer);
+
 	// TODO: Add a third and fourth mode (yellow highlight and activation)
 	fprintf (fp, _("# what kind of mouse pointer should be recorded? 0 = none, 1 = white, 2 = black\n"));
     fprintf (fp, "mouse_wanted: %i\n", app->mouseWanted);
@@ -92,6 +105,39 @@ xvc_write_options_file ()
     fprintf (fp, _("# rescale the captured area to n percent of the original\n"));
     fprintf (fp, "rescale: %i\n", (app->rescale));
 
+    fprintf (fp, _("# snap rescale to 1/2, 1/4, or 1/8 of the captured area for faster scaling (0/1)\n"));
+    fprintf (fp, "rescale_snap: %i\n", ((app->flags & FLG_RESCALE_SNAP) ? 1 : 0));
+
+    fprintf (fp, _("# number of encoder threads, 0 means one per online processor\n"));
+    fprintf (fp, "threads: %i\n", (app->threads));
+
+    fprintf (fp, _("# encoder performance profile (realtime, balanced, archive)\n"));
+    fprintf (fp, "profile: %s\n", xvc_profile_names[app->profile]);
+
+    fprintf (fp, _("# maximum seconds between keyframes placed on screen changes, 0 leaves keyframes to the encoder\n"));
+    fprintf (fp, "keyframe_interval: %i\n", (app->keyframe_interval));
+
+    fprintf (fp, _("# number of encoders working on consecutive gops in parallel, 0 for a single encoder\n"));
+    fprintf (fp, "gop_encoders: %i\n", (app->gop_encoders));
+
+    fprintf (fp, _("# frames per gop with parallel gop encoding, 0 for one second worth of frames\n"));
+    fprintf (fp, "gop_length: %i\n", (app->gop_length));
+
+    fprintf (fp, _("# columns x rows of tiles the capture area is split into for encoding, 1x1 for no tiles\n"));
+    fprintf (fp, "tiles: %ix%i\n", app->tile_cols, app->tile_rows);
+
+    fprintf (fp, _("# how the output file is written (avio, blocks, uring)\n"));
+    fprintf (fp, "output_io: %s\n", xvc_output_io_names[app->output_io]);
+
+    fprintf (fp, _("# MB to preallocate the output file by ahead of the writes, 0 for none\n"));
+    fprintf (fp, "preallocate: %i\n", (app->preallocate));
+
+    fprintf (fp, _("# seconds between syncs of the output file to disk, 0 syncs when closing only, -1 never\n"));
+    fprintf (fp, "fsync: %i\n", (app->fsync_interval));
+
+    fprintf (fp, _("# seconds between the fragments the output file is flushed in at keyframes, 0 for none\n"));
+    fprintf (fp, "fragment: %i\n", (app->fragment_interval));
+
 	fprintf (fp, _("# minimize the main control to the system tray while recording\n"));
     fprintf (fp, "minimize_to_tray: %i\n", ((app->flags & FLG_TO_TRAY) ? 1 : 0));
 
@@ -250,7 +296,10 @@ xvc_read_options_file()
 		    if (strstr (low_token, "_animate_cmd") != NULL
 		        || strstr (low_token, "_edit_cmd") != NULL
 		        || strstr (low_token, "_video_cmd") != NULL
-		        || strcasecmp (token, "help_cmd") == 0) {
+		        || strcasecmp (token, "help_cmd") == 0
+		        // ALSA device names have colons
+		        || strcasecmp (token, "audio_in") == 0
+		        || strcasecmp (token, "audio_mix") == 0) {
 		        int x = 1;
 
 		        while (line[strlen (token) + x] == ' '
@@ -270,6 +319,12 @@ xvc_read_options_file()
 		    }
 		    if (strcasecmp (token, "source") == 0) {
 		        app->source = strdup (value);
+		    }
+		    if (strcasecmp (token, "shadow") == 0) {
+		        if (value && *value && strcasecmp (value, "off") != 0)
+		            app->shadow = strdup (value);
+		        else
+		            app->shadow = NULL;
 		    }
 			if (strcasecmp (token, "nogui") == 0) {
 		        if (atoi (value) == 1)
@@ -293,6 +348,22 @@ xvc_read_options_file()
 		    }
 			if (strcasecmp (token, "audio_in") == 0) {
 		        app->snddev = strdup (value);
+		    }
+			if (strcasecmp (token, "audio_gain") == 0) {
+		        if (value)
+		            app->audio_gain = atoi (value);
+		    }
+			if (strcasecmp (token, "audio_mix") == 0) {
+		        if (value && *value)
+		            app->audio_mix = strdup (value);
+		    }
+			if (strcasecmp (token, "audio_period") == 0) {
+		        if (value)
+		            app->audio_period = atoi (value);
+		    }
+			if (strcasecmp (token, "audio_buffer") == 0) {
+		        if (value)
+		            app->audio_buffer = atoi (value);
 		    }
 		    if (strcasecmp (token, "mouse_wanted") == 0) {
 		        app->mouseWanted = atoi (value);
@@ -354,6 +425,67 @@ xvc_read_options_file()
 			if (strcasecmp (token, "rescale") == 0) {
 		        if (value)
 		            app->rescale = atoi (value);
+		    }
+			if (strcasecmp (token, "rescale_snap") == 0) {
+		        if (atoi (value) == 1)
+		            app->flags |= FLG_RESCALE_SNAP;
+		        else if (atoi (value) == 0)
+		            app->flags &= ~FLG_RESCALE_SNAP;
+		        else {
+		            app->flags &= ~FLG_RESCALE_SNAP;
+		            fprintf (stderr, _("reading unsupported rescale_snap value from options file\nresetting to not snapping rescale.\n"));
+		        }
+		    }
+			if (strcasecmp (token, "threads") == 0) {
+		        if (value)
+		            app->threads = atoi (value);
+		    }
+			if (strcasecmp (token, "profile") == 0) {
+		        if (value)
+		            app->profile = xvc_get_profile_from_name (value);
+		        if (app->profile < 0) {
+		            app->profile = PROFILE_BALANCED;
+		            fprintf (stderr, _("reading unsupported profile value from options file\nresetting to the balanced profile.\n"));
+		        }
+		    }
+			if (strcasecmp (token, "keyframe_interval") == 0) {
+		        if (value)
+		            app->keyframe_interval = atoi (value);
+		    }
+			if (strcasecmp (token, "gop_encoders") == 0) {
+		        if (value)
+		            app->gop_encoders = atoi (value);
+		    }
+			if (strcasecmp (token, "gop_length") == 0) {
+		        if (value)
+		            app->gop_length = atoi (value);
+		    }
+			if (strcasecmp (token, "tiles") == 0) {
+		        if (!value ||
+		            sscanf (value, "%ix%i", &app->tile_cols, &app->tile_rows) != 2) {
+		            app->tile_cols = app->tile_rows = 1;
+		            fprintf (stderr, _("reading unsupported tiles value from options file\nresetting to no tiles.\n"));
+		        }
+		    }
+			if (strcasecmp (token, "output_io") == 0) {
+		        if (value)
+		            app->output_io = xvc_get_output_io_from_name (value);
+		        if (app->output_io < 0) {
+		            app->output_io = OUTPUT_IO_DEFAULT;
+		            fprintf (stderr, _("reading unsupported output_io value from options file\nresetting to the default output io.\n"));
+		        }
+		    }
+			if (strcasecmp (token, "preallocate") == 0) {
+		        if (value)
+		            app->preallocate = atoi (value);
+		    }
+			if (strcasecmp (token, "fsync") == 0) {
+		        if (value)
+		            app->fsync_interval = atoi (value);
+		    }
+			if (strcasecmp (token, "fragment") == 0) {
+		        if (value)
+		            app->fragment_interval = atoi (value);
 		    }
 			if (strcasecmp (token, "minimize_to_tray") == 0) {
 		        if (atoi (value) == 1)
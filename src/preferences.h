@@ -39,6 +39,7 @@
 #include "job.h"
 #include "app_data.h"
 #include "codecs.h"
+#include "outfile.h"
 #include "xvidcap-intl.h"
 
 #define OPS_FILE ".xvidcaprc"
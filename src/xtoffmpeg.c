@@ -36,10 +36,16 @@
 #include <fcntl.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <math.h>
 #include <X11/Intrinsic.h>
+#include <X11/Xutil.h>
+#include <X11/Xregion.h>
 #include <pthread.h>
-#include <signal.h>
+#include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif     // __SSE2__
 
 // xvidcap specific
 #include "app_data.h"
@@ -47,6 +53,8 @@
 #include "colors.h"
 #include "frame.h"
 #include "codecs.h"
+#include "outfile.h"
+#include "alsa_input.h"
 #include "xvidcap-intl.h"
 
 // ffmpeg stuff
@@ -56,6 +64,7 @@
 #include <libswscale/swscale.h>
 #include <libavutil/pixfmt.h>
 #include <libavutil/fifo.h>
+#include <libavutil/avstring.h>
 #define swscale_isRGB(x) ((x)==PIX_FMT_BGR32 || (x)==PIX_FMT_RGB24 \
                         || (x)==PIX_FMT_RGB565 || (x)==PIX_FMT_RGB555 \
                         || (x)==PIX_FMT_RGB8 || (x)==PIX_FMT_RGB4 \
@@ -75,7 +84,9 @@
                         || (x)==PIX_FMT_YUV422P || (x)==PIX_FMT_YUV411P \
                         || (x)==PIX_FMT_PAL8 || (x)==PIX_FMT_BGR8 \
                         || (x)==PIX_FMT_RGB8 || (x)==PIX_FMT_BGR4_BYTE \
-                        || (x)==PIX_FMT_RGB4_BYTE)
+                        || (x)==PIX_FMT_RGB4_BYTE || (x)==PIX_FMT_ARGB \
+                        || (x)==PIX_FMT_RGBA || (x)==PIX_FMT_ABGR \
+                        || (x)==PIX_FMT_BGRA)
 // added jpeg stuff myself (yuvj*) because swscale actually DOES accept them
 #define swscale_isSupportedOut(x) ((x)==PIX_FMT_YUV420P \
                         || (x)==PIX_FMT_YUYV422 || (x)==PIX_FMT_UYVY422 \
@@ -88,10 +99,17 @@
                         || (x)==PIX_FMT_YUVJ420P || (x)==PIX_FMT_YUVJ422P \
                         || (x)==PIX_FMT_YUVJ444P)
 
-#define PIX_FMT_ARGB32 PIX_FMT_RGB32   /* this is just my personal convenience */
-
 #define MAX_AUDIO_PACKET_SIZE (128 * 1024)
 
+/* dimensions of the cropped input picture and of the picture within the
+ * padded output frame, cf. set_video_geometry() */
+#define VIDEO_IN_WIDTH(image) ((image)->width - vid_out_st->leftBand \
+                        - vid_out_st->rightBand)
+#define VIDEO_IN_HEIGHT(image) ((image)->height - vid_out_st->topBand \
+                        - vid_out_st->bottomBand)
+#define VIDEO_OUT_WIDTH (out_st->codec->width - vid_out_st->padright)
+#define VIDEO_OUT_HEIGHT (out_st->codec->height - vid_out_st->padbottom)
+
 
 
 /*
@@ -134,8 +152,312 @@ static int input_pixfmt;
 /** \brief store current video_pts for a/v sync */
 static double video_pts;
 
-/** \brief buffer memory used during 8bit palette conversion */
-static uint8_t *scratchbuf8bit;
+/** \brief palette lookup tables for converting 8bit pseudo-color input
+ *      straight to yuv. Entries are kept as ints because chroma is summed
+ *      over blocks of pixels before being written */
+static int pal8_to_y[256], pal8_to_u[256], pal8_to_v[256];
+
+/** \brief TRUE if pal8 input is converted to p_outpic through the lookup
+ *      tables above rather than through libswscale */
+static int pal8_direct = FALSE;
+
+/** \brief ratio (2, 4, or 8) if packed rgb input is scaled down to p_outpic
+ *      by box filtering rather than through libswscale, 0 otherwise */
+static int box_ratio = 0;
+
+/** \brief number of frames converted and the total time spent on the
+ *      conversion in micro seconds, reported in verbose mode */
+static int conv_frames = 0;
+static long conv_usecs = 0;
+
+/** \brief TRUE if only the rows of the input picture that changed since the
+ *      previous frame are converted, which requires unscaled libswscale
+ *      conversion */
+static int damage_convert = FALSE;
+
+/** \brief rows the converters for damaged bands are sized in, and rows
+ *      converted above and below the damage for the chroma filter */
+#define DAMAGE_BAND_ROWS 64
+#define DAMAGE_MARGIN_ROWS 8
+
+/** \brief the converters for damaged bands indexed by their height in
+ *      DAMAGE_BAND_ROWS and the picture the bands are converted to */
+static struct SwsContext **damage_ctx = NULL;
+static int damage_nb_ctx = 0;
+static AVPicture damage_pic;
+
+/** \brief number of rows converted and number of rows in the frames
+ *      converted by damage, reported in verbose mode */
+static long damage_rows = 0;
+static long damage_total_rows = 0;
+
+/** \brief number of threads the video encoder runs with, the number of
+ *      frames encoded and the total time spent encoding them in micro
+ *      seconds, reported in verbose mode */
+static int enc_threads = 1;
+static int enc_frames = 0;
+static long enc_usecs = 0;
+
+/**
+ * \brief one step on the ladder the encoder speed controller moves along
+ *
+ * The first step leaves the settings of the performance profile
+ * add_video_stream() opens the encoder with, every following one caps them
+ * further. Only settings the mpegvideo based encoders re-read for every frame
+ * are on it. Things like trellis quantisation, motion estimation method, or
+ * gop size are fixed when the encoder is opened.
+ */
+typedef struct
+{
+    /** \brief name for logging */
+    const char *name;
+    /** \brief macroblock decision mode */
+    int mb_decision;
+    /** \brief subpel motion estimation quality */
+    int me_subpel_quality;
+} XVC_SpeedStep;
+
+static const XVC_SpeedStep speed_ladder[] = {
+    {"profile settings", FF_MB_DECISION_RD, 8},
+    {"fewest bits mb decision", FF_MB_DECISION_BITS, 8},
+    {"fewest bits mb decision, coarse subpel search", FF_MB_DECISION_BITS, 4},
+    {"simple mb decision, coarse subpel search", FF_MB_DECISION_SIMPLE, 2}
+};
+
+#define NUM_SPEED_STEPS ((int) (sizeof (speed_ladder) / sizeof (XVC_SpeedStep)))
+
+/** \brief TRUE if the encoder speed controller is active for the current
+ *      video stream */
+static int speed_adapt = FALSE;
+
+/**
+ * \brief TRUE if frames can be left out of the video stream
+ *
+ * The next encoded frame then carries a timestamp that leaves a gap, which
+ * works for containers with per packet timestamps (avi fills the gap with
+ * empty chunks) and encoders passing the timestamps through to
+ * coded_frame. MPEG program streams for (S)VCD and DVD players need a
+ * constant frame rate and never get gaps.
+ */
+static int pts_gaps = FALSE;
+
+/** \brief TRUE if frames that did not change are not encoded at all */
+static int skip_unchanged = FALSE;
+
+/** \brief timestamp of the next frame in codec time base units, used as
+ *      its pts if pts_gaps */
+static int64_t frame_pts = 0;
+
+/** \brief number of frames skipped since the last encoded one, only used
+ *      by the thread saving the frames */
+static int skipped_pending = 0;
+
+/** \brief number of unchanged frames skipped or encoded without
+ *      conversion, reported in verbose mode */
+static int unchanged_frames = 0;
+
+/** \brief share of the capture area in 1/1000 that must have changed to
+ *      force an intra frame */
+#define KEYFRAME_DAMAGE_PERMILLE 500
+
+/** \brief TRUE if intra frames are placed by the damaged share of the
+ *      capture area with a long gop as the upper bound */
+static int damage_keyframes = FALSE;
+
+/** \brief damaged share of the previous frame in 1/1000, -1 if unknown */
+static int last_damage = -1;
+
+/** \brief number of intra frames forced because of screen changes, reported
+ *      in verbose mode */
+static int forced_keyframes = 0;
+
+/** \brief the performance profile the encoder was opened with */
+static const XVC_CodecProfile *speed_base = NULL;
+
+/** \brief current step on the speed_ladder */
+static int speed_level = 0;
+
+/** \brief number of frames and their accumulated capture and save time in
+ *      milli secs since the controller last looked at them */
+static int speed_frames = 0;
+static long speed_time = 0;
+
+/** \brief packets waiting for the muxer thread at which the quality is
+ *      lowered by a step, restored by a step, and frames are dropped */
+#define BACKLOG_HIGH (MUX_QUEUE_SIZE / 8)
+#define BACKLOG_LOW (MUX_QUEUE_SIZE / 32)
+#define BACKLOG_DROP (MUX_QUEUE_SIZE / 2)
+
+/** \brief steps the quality can be lowered by and qscale added per step */
+#define MAX_BACKLOG_LEVEL 5
+#define BACKLOG_QSCALE_STEP 3
+
+/** \brief steps the quality is lowered by because the disk does not keep
+ *      up, 0 for the quality asked for, and the most steps it took */
+static int backlog_level = 0;
+static int backlog_max_level = 0;
+
+/** \brief qmin and qmax of the video encoders for the quality asked for */
+static int backlog_qmin = 0;
+static int backlog_qmax = 0;
+
+/** \brief frames since the backlog level was last looked at */
+static int backlog_frames = 0;
+
+/** \brief TRUE while every other frame is dropped to let the disk catch
+ *      up, and the frame to drop next */
+static int backlog_dropping = FALSE;
+static int backlog_drop_next = FALSE;
+
+/** \brief frames dropped because of the backlog */
+static int dropped_frames = 0;
+
+/** \brief an encoded packet held back until its gop is written */
+typedef struct _xvc_GopPacket
+{
+    /** \brief the encoded data */
+    uint8_t *data;
+    /** \brief size of the encoded data */
+    int size;
+    /** \brief presentation time stamp in the time base of the encoder */
+    int64_t pts;
+    /** \brief TRUE if the packet holds a key frame */
+    int key;
+    /** \brief next packet of the same gop */
+    struct _xvc_GopPacket *next;
+} XVC_GopPacket;
+
+/**
+ * \brief one of the encoder instances used for parallel gop encoding
+ *
+ * Every instance encodes a whole closed gop with an encoder of its own,
+ * instance i takes gops i, i + gop_encoders, i + 2 * gop_encoders, ...
+ * The capture thread copies the pictures of a gop into frames as they come
+ * in and the instance's thread encodes them as soon as they are there.
+ * Everything but frames[queued...] is protected by mutex.
+ */
+typedef struct
+{
+    /** \brief the thread encoding the gops */
+    pthread_t thread;
+    /** \brief protects the state of the instance */
+    pthread_mutex_t mutex;
+    /** \brief signalled on new pictures, the end of a gop and when done */
+    pthread_cond_t cond;
+    /** \brief the pictures of the current gop, gop_length of them */
+    AVFrame **frames;
+    /** \brief the buffer encoded pictures go to */
+    uint8_t *outbuf;
+    /** \brief number of pictures of the current gop queued */
+    int queued;
+    /** \brief number of pictures of the current gop encoded */
+    int encoded;
+    /** \brief TRUE once the last picture of the gop is queued */
+    int gop_end;
+    /** \brief TRUE once all packets of the gop are in packets */
+    int done;
+    /** \brief TRUE if the thread is to end */
+    int stop;
+    /** \brief encoded packets of the current gop in the order encoded */
+    XVC_GopPacket *packets;
+    /** \brief where to append the next packet */
+    XVC_GopPacket **tail;
+    /** \brief time spent encoding in micro secs, reported in verbose mode */
+    long busy_usecs;
+} XVC_GopEncoder;
+
+/** \brief number of encoder instances encoding gops in parallel, 1 if the
+ *      video stream's encoder encodes every frame itself */
+static int gop_encoders = 1;
+
+/** \brief number of frames per gop with parallel gop encoding */
+static int gop_length = 0;
+
+/** \brief the encoder instances for parallel gop encoding */
+static XVC_GopEncoder *gop_enc = NULL;
+
+/**
+ * \brief gop the next picture goes to, its number of pictures queued so far
+ *      and the number of gops written to the file
+ *
+ * Gops are written in order, so encoded packets of at most gop_encoders gops
+ * are held back.
+ */
+static int gop_no = 0;
+static int gop_frame = 0;
+static int gop_written = 0;
+
+/** \brief avcodec_open and avcodec_close must not run concurrently */
+static pthread_mutex_t gop_codec_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** \brief time the first gop was queued, to report the average number of
+ *      instances busy */
+static struct timeval gop_start;
+
+/**
+ * \brief one tile of a capture area split into a grid by --tiles
+ *
+ * Every tile is converted and encoded into a video stream of its own by a
+ * thread of its own.
+ */
+typedef struct
+{
+    /** \brief the thread converting and encoding the tile */
+    pthread_t thread;
+    /** \brief position of the tile in the capture area */
+    int x, y;
+    /** \brief size of the tile, the encoded picture may be padded */
+    int width, height;
+    /** \brief the video stream of the tile and the padding fitting the
+     *      tile to the codec */
+    AVStream *st;
+    struct AVOutputStream *ost;
+    /** \brief converts the tile to the picture format of the encoder */
+    struct SwsContext *sws;
+    /** \brief the picture to encode and its buffer */
+    AVFrame *pic;
+    uint8_t *pic_buf;
+    /** \brief the buffer encoded pictures go to and its size */
+    uint8_t *outbuf;
+    int outbuf_size;
+    /** \brief size of the last encoded picture */
+    int out_size;
+    /** \brief number of the last frame the tile was encoded for */
+    int frame_no;
+    /** \brief time spent converting and encoding in micro secs, reported
+     *      in verbose mode */
+    long busy_usecs;
+} XVC_Tile;
+
+/** \brief number of tiles the capture area is split into, 1 if it is not */
+static int num_tiles = 1;
+
+/** \brief columns and rows of the tile grid */
+static int tile_cols = 1;
+static int tile_rows = 1;
+
+/** \brief the tiles of the capture area */
+static XVC_Tile *tiles = NULL;
+
+/**
+ * \brief state shared by the capture thread and the tile threads, protected
+ *      by tile_mutex
+ *
+ * The capture thread hands a frame to the tile threads by increasing
+ * tile_frame_no and waits till tiles_pending dropped to 0 again.
+ */
+static pthread_mutex_t tile_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tile_cond = PTHREAD_COND_INITIALIZER;
+static XImage *tile_image = NULL;
+static int64_t tile_pts = 0;
+static int tile_frame_no = 0;
+static int tiles_pending = 0;
+static int tiles_stop = FALSE;
+
+/** \brief number of frames encoded in tiles and the time the capture
+ *      thread waited for them in micro secs, reported in verbose mode */
+static int tile_frames = 0;
+static long tile_wait_usecs = 0;
 
 /** \brief pointer to the XVC_CapTypeOptions representing the currently
  * active capture mode (which certainly is mf here) */
@@ -208,6 +530,11 @@ typedef struct AVOutputStream {
 /** \brief audio output stream */
 static AVOutputStream *au_out_st = NULL;
 
+/** \brief video output stream. This only carries the cropping and padding
+ *      geometry of the frames passed to the video encoder, the AVStream
+ *      itself is out_st. Tiles keep their own, this is NULL then */
+static AVOutputStream *vid_out_st = NULL;
+
 
 typedef struct AVInputStream {
     int file_index;
@@ -239,23 +566,447 @@ static uint8_t *audio_out = NULL;
 static pthread_attr_t tattr;
 
 /** \brief thread coordination variables for interleaving audio and video
- *      capture. This is the mutex lock */
-static pthread_mutex_t mp = PTHREAD_MUTEX_INITIALIZER;
-
-/** \brief thread coordination variables for interleaving audio and video
- *      capture. This is the thread's id */
+ *      capture. This is the id of the thread encoding the audio */
 static pthread_t tid = 0;
 
-static int audio_thread_running = FALSE;
+/** \brief TRUE once the audio threads are asked to end, the encoding thread
+ *      drains its encoder first. It is set with app->recording_paused_mutex
+ *      held, so a paused audio thread cannot miss it */
+static volatile int audio_thread_stop = FALSE;
+
+/**
+ * \brief number of captured packets the audio ring holds, about 6 secs of
+ *      44.1 kHz stereo in the 4 KB packets of the oss input
+ */
+#define AUDIO_RING_SIZE 256
+
+/**
+ * \brief a packet read from the audio input with its capture time
+ */
+typedef struct
+{
+    AVPacket pkt;
+    /* master clock time in usecs the first sample was captured at */
+    int64_t captured;
+} XVC_AudioPacket;
+
+/** \brief most audio inputs recorded into the audio track */
+#define MAX_AUDIO_INPUTS (MAX_AUDIO_MIX_INPUTS + 1)
+
+/**
+ * \brief an audio input with the thread reading from it
+ *
+ * The ring of captured packets passes them from the input's reader thread
+ * to the audio encoding thread. Like the muxer queues, it has a single
+ * producer and a single consumer and needs no lock: the reader only moves
+ * tail and the encoding thread only moves head. audio_ring_mutex is only
+ * taken to sleep on an empty or full ring.
+ */
+typedef struct
+{
+    /** \brief the device, and the gain in 1/4096 */
+    char *device;
+    int gain;
+    AVFormatContext *ic;
+    /** \brief the pcm if captured through ALSA, ic then only describes
+     *      the samples */
+    XVC_AlsaInput *alsa;
+    pthread_t tid;
+
+    XVC_AudioPacket ring[AUDIO_RING_SIZE];
+    volatile unsigned int head;
+    volatile unsigned int tail;
+    /** \brief TRUE while the reader sleeps on a full ring */
+    volatile int full;
+
+    /**
+     * \brief inputs mixed in only: samples taken off the ring but not
+     *      mixed yet, the master clock time in usecs the fifo was last
+     *      started at and the samples per channel taken out since
+     */
+    AVFifoBuffer *fifo;
+    int64_t fifo_start;
+    int64_t fifo_taken;
+
+    /** \brief packets read, most packets waiting at once and the CPU time
+     *      in usecs of the reader, for the summary */
+    long packets;
+    unsigned int max_fill;
+    long cpu_usecs;
+    /**
+     * \brief TRUE while captured audio is dropped because the ring is
+     *      full, the number of times that happened and the usecs of audio
+     *      dropped
+     */
+    int overflowing;
+    int overflows;
+    int64_t overflow_usecs;
+} XVC_AudioInput;
+
+/** \brief the audio inputs, the first is the one in ic, the others are
+ *      mixed into it */
+static XVC_AudioInput audio_inputs[MAX_AUDIO_INPUTS];
+static int num_audio_inputs = 0;
+
+/** \brief TRUE while the encoding thread sleeps on an empty ring */
+static volatile int audio_ring_idle = FALSE;
+
+static pthread_mutex_t audio_ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t audio_ring_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t audio_ring_space_cond = PTHREAD_COND_INITIALIZER;
+
+/** \brief CPU time in usecs of the encoding thread and of mixing the
+ *      inputs, and the audio mixed in usecs, for the summary */
+static long audio_encoder_cpu_usecs = 0;
+static long audio_mix_cpu_usecs = 0;
+static int64_t audio_mixed_usecs = 0;
+
+/** \brief buffer the samples of an input are scaled or mixed in from and
+ *      its size */
+static int16_t *mix_buf = NULL;
+static unsigned int mix_buf_size = 0;
+
+/** \brief inputs mixed in are realigned to the first input when their
+ *      capture times differ by more than this many usecs */
+#define AUDIO_MIX_TOLERANCE_USECS 20000
+
+/** \brief when the audio threads were started */
+static struct timeval audio_start;
+
+/** \brief TRUE if the audio is captured from a device in real time, FALSE
+ *      for a pipe */
+static int audio_from_device = FALSE;
+
+/** \brief a/v offsets in usecs below this are left alone, larger ones are
+ *      absorbed by resampling the audio */
+#define AV_SYNC_THRESHOLD_USECS 10000
+
+/** \brief a/v offsets in usecs beyond this are corrected at once by
+ *      dropping audio or inserting silence */
+#define AV_SYNC_MAX_OFFSET_USECS 100000
+
+/** \brief most the audio is sped up or slowed down by to absorb drift, in
+ *      1/1000 */
+#define AV_SYNC_MAX_SKEW_PERMILLE 5
+
+/** \brief usecs between two reports of the a/v offset in verbose mode */
+#define AV_SYNC_REPORT_USECS 10000000
+
+/**
+ * \brief the latest video frame on the master clock: when it was captured
+ *      and where it is in the video stream, both in usecs. Written by the
+ *      thread saving the frames, read by the audio encoding thread.
+ */
+static int64_t av_sync_clock = 0;
+static int64_t av_sync_video = 0;
+static pthread_mutex_t av_sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** \brief master clock time of the first frame after the latest pause, in
+ *      usecs, less the stream time of that frame, and TRUE while paused */
+static int64_t video_clock_start = 0;
+static int video_clock_paused = FALSE;
+
+/** \brief frames captured too late for their time slot, which are moved
+ *      to their slot if the container allows gaps */
+static int late_frames = 0;
+
+/** \brief the a/v offset in usecs, smoothed, and statistics of it for the
+ *      report */
+static int64_t av_sync_offset = 0;
+static int64_t av_sync_max_offset = 0;
+static int64_t av_sync_offset_sum = 0;
+static long av_sync_measures = 0;
+static int64_t av_sync_last_report = 0;
+
+/** \brief audio packets dropped and usecs of silence inserted because the
+ *      offset got too large to resample it away */
+static int av_sync_dropped = 0;
+static int64_t av_sync_silence = 0;
+
+/** \brief time the encoders started draining at */
+static struct timeval drain_start;
+
+/** \brief upper bound in milli secs for draining the encoders when a
+ *      recording stops, whatever they still hold back after that is dropped
+ *      so the file gets closed in time */
+#define STOP_DRAIN_MSECS 2000
 
 /** \brief store current audio_pts for a/v sync */
 static double audio_pts;
 
+/** \brief number of packets the queue of a stream holds, some 20 secs of
+ *      video at 25 fps */
+#define MUX_QUEUE_SIZE 512
+
+/** \brief an encoded packet on its way to the muxer thread */
+typedef struct
+{
+    uint8_t *data;
+    int size;
+    int64_t pts;                       /* in the time base of the stream */
+    double time;                       /* start in secs, for interleaving */
+    int key;
+} XVC_MuxPacket;
+
+/** \brief lock-free queue of the encoded packets of one output stream.
+ *      Only the thread encoding the stream moves the tail and only the
+ *      muxer thread moves the head */
+typedef struct
+{
+    XVC_MuxPacket pkt[MUX_QUEUE_SIZE];
+    volatile unsigned int head;
+    volatile unsigned int tail;
+    /* TRUE while the encoding thread waits for the muxer to make room */
+    volatile int full;
+    /* end of the last packet queued in secs, used for a/v sync */
+    volatile double end;
+    /* most packets waiting at once */
+    unsigned int max_fill;
+    /* times the encoding thread had to wait for room */
+    int full_waits;
+} XVC_MuxQueue;
+
+/** \brief one queue per output stream, indexed by the stream index */
+static XVC_MuxQueue *mux_queues = NULL;
+static int mux_nb_queues = 0;
+
+/** \brief the muxer thread, the only one writing to output_file while it
+ *      runs */
+static pthread_t mux_tid;
+static int mux_running = FALSE;
+
+/** \brief TRUE while the muxer thread sleeps on mux_cond */
+static volatile int mux_idle = FALSE;
+
+/** \brief TRUE once no more packets get queued, the muxer thread ends when
+ *      the queues are empty */
+static volatile int mux_stop = FALSE;
+
+/** \brief mutex and conditions to sleep on for the muxer thread with empty
+ *      queues and for an encoding thread with a full queue */
+static pthread_mutex_t mux_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mux_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t mux_space_cond = PTHREAD_COND_INITIALIZER;
+
+/** \brief usecs the muxer thread spent writing */
+static long mux_write_usecs = 0;
+static long mux_packets = 0;
+static long mux_bytes = 0;
+
+/** \brief longest write of a packet in usecs and the number of writes per
+ *      power of two of usecs, for the tail latency of the output */
+static long mux_write_max_usecs = 0;
+static long mux_write_hist[32];
+
+/** \brief secs between fragments of the output file, 0 for none, and the
+ *      time from which on the next video keyframe starts a new fragment */
+static int mux_fragment_interval = 0;
+static double mux_fragment_end = 0;
+static int mux_fragments = 0;
+
 /*
  * functions ...
  *
  */
 
+/**
+ * \brief get the milli secs elapsed since a given time
+ *
+ * @param start the time to measure from
+ * @return milli secs since start
+ */
+static long
+msecs_since (const struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday (&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000 +
+        (now.tv_usec - start->tv_usec) / 1000;
+}
+
+/**
+ * \brief make up the input context of an audio input captured through ALSA
+ *
+ * libavformat does not read from it, it only describes the s16 samples
+ * in the byte order of the CPU the ALSA input delivers.
+ *
+ * @param rate the sample rate
+ * @param channels the number of channels
+ * @return the context or NULL on failure
+ */
+static AVFormatContext *
+alloc_alsa_context (int rate, int channels)
+{
+    AVFormatContext *s = avformat_alloc_context ();
+    AVStream *st = (s ? av_new_stream (s, 0) : NULL);
+
+    if (!st) {
+        av_free (s);
+        return NULL;
+    }
+    st->codec->codec_type = CODEC_TYPE_AUDIO;
+    st->codec->codec_id = AV_NE (CODEC_ID_PCM_S16BE, CODEC_ID_PCM_S16LE);
+    st->codec->sample_rate = rate;
+    st->codec->channels = channels;
+    av_set_pts_info (st, 64, 1, 1000000);
+
+    return s;
+}
+
+/**
+ * \brief open the device or pipe of an audio input
+ *
+ * Devices named with ALSA_INPUT_PREFIX are captured through ALSA, the
+ * others through libavformat's oss input.
+ *
+ * @param in the audio input with the device set
+ * @param rate the sample rate to capture a device at
+ * @param channels the channels to capture from a device
+ * @param grab_audio FALSE if the input is a pipe
+ * @return 0 on success or smth. else on failure
+ */
+static int
+open_audio_device (XVC_AudioInput * in, int rate, int channels,
+                   Boolean grab_audio)
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+    AVFormatParameters params, *ap = &params;
+    int err;
+
+    if (grab_audio && xvc_is_alsa_device (in->device)) {
+        in->alsa = xvc_alsa_open (in->device, &rate, &channels,
+                                  app->audio_period, app->audio_buffer);
+        if (!in->alsa)
+            return 1;
+        in->ic = alloc_alsa_context (rate, channels);
+        if (!in->ic) {
+            fprintf (stderr, _("Could not alloc input stream ... aborting\n"));
+            return 1;
+        }
+        return 0;
+    }
+
+    memset (ap, 0, sizeof (*ap));
+    if (grab_audio) {
+        ap->sample_rate = rate;
+        ap->channels = channels;
+    }
+    err = av_open_input_file (&in->ic, in->device,
+                              (grab_audio ? av_find_input_format ("oss") :
+                               NULL), 0, ap);
+    if (err < 0) {
+        fprintf (stderr, _("error opening input file %s: %i\n"), in->device,
+                 err);
+        return 1;
+    }
+    // If not enough info to get the stream parameters, we decode
+    // the first frames to get it. (used in mpeg case for example)
+    if (av_find_stream_info (in->ic) < 0) {
+        fprintf (stderr, _("could not find codec parameters\n"));
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * \brief close the device or pipe of an audio input
+ *
+ * What the input read and mixed stays around for the summary.
+ *
+ * @param in the audio input
+ */
+static void
+close_audio_device (XVC_AudioInput * in)
+{
+    if (in->alsa) {
+        xvc_alsa_close (in->alsa);
+        in->alsa = NULL;
+        if (in->ic) {
+            av_free (in->ic->streams[0]->codec);
+            av_free (in->ic->streams[0]);
+            av_free (in->ic);
+        }
+    } else if (in->ic) {
+        av_close_input_file (in->ic);
+    }
+    in->ic = NULL;
+    if (in->fifo) {
+        av_fifo_free (in->fifo);
+        in->fifo = NULL;
+    }
+    if (in->device) {
+        av_free (in->device);
+        in->device = NULL;
+    }
+}
+
+/**
+ * \brief open the devices to mix into the first audio input
+ *
+ * The devices are opened with the sample rate and channels of the first
+ * input, so their samples can be mixed without resampling.
+ *
+ * @return 0 on success or smth. else on failure
+ */
+static int
+open_audio_mix_inputs ()
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+    AVCodecContext *c = ic->streams[0]->codec;
+    char *list, *entry, *save = NULL;
+    int failed = FALSE;
+
+    if (!app->audio_mix || !audio_from_device)
+        return 0;
+
+    list = av_strdup (app->audio_mix);
+    for (entry = strtok_r (list, ",", &save);
+         entry && num_audio_inputs < MAX_AUDIO_INPUTS;
+         entry = strtok_r (NULL, ",", &save)) {
+        XVC_AudioInput *in = &audio_inputs[num_audio_inputs];
+        char *at = rindex (entry, '@');
+        int gain = 100;
+
+        if (at) {
+            *at = '\0';
+            gain = atoi (at + 1);
+        }
+        in->device = av_strdup (entry);
+        in->gain = gain * 4096 / 100;
+        // counted from here, so a failed input is closed with the others
+        num_audio_inputs++;
+
+        if (open_audio_device (in, c->sample_rate, c->channels, TRUE) != 0) {
+            fprintf (stderr, _("error opening audio input %s to mix in\n"),
+                     in->device);
+            failed = TRUE;
+            break;
+        }
+        if (in->ic->streams[0]->codec->sample_rate != c->sample_rate ||
+            in->ic->streams[0]->codec->channels != c->channels) {
+            fprintf (stderr, _("audio input %s does not capture at %i Hz with %i channels\n"),
+                     in->device, c->sample_rate, c->channels);
+            failed = TRUE;
+            break;
+        }
+        in->fifo = av_fifo_alloc (2 * MAX_AUDIO_PACKET_SIZE);
+        if (!in->fifo) {
+            fprintf (stderr, _("Can't initialize fifo for audio recording\n"));
+            failed = TRUE;
+            break;
+        }
+    }
+    av_free (list);
+
+    if (failed) {
+        while (num_audio_inputs > 1)
+            close_audio_device (&audio_inputs[--num_audio_inputs]);
+        return 1;
+    }
+    return 0;
+}
+
 /**
  * \brief adds an audio stream to AVFormatContext output_file
  *
@@ -265,10 +1016,7 @@ static double audio_pts;
 static int
 add_audio_stream (Job * job)
 {
-    AVInputFormat *grab_iformat = NULL;
     Boolean grab_audio = TRUE;
-    AVFormatParameters params, *ap = &params;   // audio stream params
-    int err, ret;
 
     if (!strcmp (job->snd_device, "-")) {
         job->snd_device = "pipe:";
@@ -278,41 +1026,24 @@ add_audio_stream (Job * job)
     }
 
     // prepare input stream
-    memset (ap, 0, sizeof (*ap));
-//    ap->device = job->snd_device;
-
-    if (grab_audio) {
-        ap->sample_rate = target->sndrate;
-        ap->channels = target->sndchannels;
-
-        grab_iformat = av_find_input_format ("oss");
-    }
-
-    err =
-        av_open_input_file (&ic, job->snd_device,
-                            (grab_audio ? grab_iformat : NULL), 0, ap);
-    if (err < 0) {
-        fprintf (stderr, _("error opening input file %s: %i\n"), job->snd_device, err);
+    memset (audio_inputs, 0, sizeof (audio_inputs));
+    audio_inputs[0].device = av_strdup (job->snd_device);
+    audio_inputs[0].gain = xvc_appdata_ptr ()->audio_gain * 4096 / 100;
+    if (open_audio_device (&audio_inputs[0], target->sndrate,
+                           target->sndchannels, grab_audio) != 0) {
+        close_audio_device (&audio_inputs[0]);
         return 1;
     }
+    ic = audio_inputs[0].ic;
+    num_audio_inputs = 1;
+
     au_in_st = av_mallocz (sizeof (AVInputStream));
-    if (!au_in_st || !ic) {
+    if (!au_in_st) {
         fprintf (stderr, _("Could not alloc input stream ... aborting\n"));
         return 1;
     }
     au_in_st->st = ic->streams[0];
 
-    // If not enough info to get the stream parameters, we decode
-    // the first frames to get it. (used in mpeg case for example)
-    ret = av_find_stream_info (ic);
-    if (ret < 0) {
-        fprintf (stderr, _("could not find codec parameters\n"));
-        if (au_in_st) {
-            av_free (au_in_st);
-            au_in_st = NULL;
-        }
-        return 1;
-    }
     // init pts stuff
     au_in_st->next_pts = 0;
     au_in_st->is_start = 1;
@@ -375,7 +1106,25 @@ add_audio_stream (Job * job)
     // file, we might have different sample rates or no of
     // channels
     // in the input file.....
+    // Self-sampled audio still goes through a resampler of the same rate,
+    // which absorbs the drift of the sound card's clock.
+    audio_from_device = grab_audio;
     if (au_c->channels == au_in_st->st->codec->channels &&
+        au_c->sample_rate == au_in_st->st->codec->sample_rate &&
+        audio_from_device) {
+        au_out_st->audio_resample = 1;
+        au_out_st->resample =
+            av_audio_resample_init (au_c->channels,
+                                    au_in_st->st->codec->channels,
+                                    au_c->sample_rate,
+                                    au_in_st->st->codec->sample_rate,
+                                    AV_SAMPLE_FMT_S16,
+                                    AV_SAMPLE_FMT_S16, 16, 10, 0, 0.8);
+        if (au_out_st->resample == NULL) {
+            fprintf (stderr, _("Cannot compensate the drift of the audio clock\n"));
+            au_out_st->audio_resample = 0;
+        }
+    } else if (au_c->channels == au_in_st->st->codec->channels &&
         au_c->sample_rate == au_in_st->st->codec->sample_rate) {
         au_out_st->audio_resample = 0;
     } else {
@@ -432,6 +1181,14 @@ add_audio_stream (Job * job)
     au_in_st->decoding_needed = 1;
     au_out_st->encoding_needed = 1;
 
+    if (open_audio_mix_inputs () != 0) {
+        if (au_in_st) {
+            av_free (au_in_st);
+            au_in_st = NULL;
+        }
+        return 1;
+    }
+
     // open encoder
     au_codec = avcodec_find_encoder (au_out_st->st->codec->codec_id);
     if (avcodec_open (au_out_st->st->codec, au_codec) < 0) {
@@ -464,60 +1221,353 @@ add_audio_stream (Job * job)
 }
 
 /**
- * \brief encode and write audio samples
+ * \brief get the duration of an encoded packet
  *
- * @param s output format context (output_file)
- * @param ost pointer to audio output stream
- * @param ist input stream information
- * @param buf the actual data sampled
- * @param size the size of the data sampled
+ * @param st the stream of the packet
+ * @param size the size of the encoded data
+ * @return the duration in secs
  */
-static void
-do_audio_out (AVFormatContext * s, AVOutputStream * ost,
-              const AVInputStream * ist, unsigned char *buf, int size)
+static double
+mux_packet_duration (AVStream * st, int size)
 {
-    uint8_t *buftmp;
-    const int audio_out_size = 4 * MAX_AUDIO_PACKET_SIZE;
-    int size_out, frame_bytes;
-    AVCodecContext *enc;
-
-    // SC: dynamic allocation of buffers
-    if (!audio_buf)
-        audio_buf = av_malloc (2 * MAX_AUDIO_PACKET_SIZE);
-    if (!audio_out)
-        audio_out = av_malloc (audio_out_size);
-    if (!audio_out || !audio_buf)
-        return;                        // Should signal an error !
+    AVCodecContext *c = st->codec;
 
-    enc = ost->st->codec;
+    if (c->codec_type == CODEC_TYPE_AUDIO) {
+        int bps = av_get_bits_per_sample (c->codec_id) / 8;
 
-    // resampling is only used for pipe input here
-    if (ost->audio_resample) {
-        buftmp = audio_buf;
-        size_out =
-            audio_resample (ost->resample, (short *) buftmp, (short *) buf,
-                            size / (ist->st->codec->channels * 2));
-        size_out = size_out * enc->channels * 2;
-    } else {
-        buftmp = buf;
-        size_out = size;
+        if (c->frame_size > 1)
+            return (double) c->frame_size / c->sample_rate;
+        else if (bps > 0)
+            return (double) size / (bps * c->channels) / c->sample_rate;
+        return 0;
     }
+    return av_q2d (c->time_base);
+}
 
-    // now encode as many frames as possible
-    if (enc->frame_size > 1) {
-        // output resampled raw samples
-        av_fifo_generic_write (&ost->fifo, buftmp, size_out, NULL);
-        frame_bytes = enc->frame_size * 2 * enc->channels;
-
-        while (av_fifo_generic_read (&ost->fifo, audio_buf, frame_bytes, NULL) == 0) {
-            AVPacket pkt;
+/**
+ * \brief hand an encoded packet to the muxer thread
+ *
+ * The data is copied, so the encoder can reuse its buffer right away.
+ * Nothing is dropped: should the queue of the stream be full because the
+ * disk does not keep up, this waits for the muxer thread to make room.
+ *
+ * @param st the stream of the packet
+ * @param buf the encoded data
+ * @param size the size of the encoded data
+ * @param pts presentation time stamp in the time base of the stream, or
+ *      AV_NOPTS_VALUE
+ * @param key TRUE if the packet holds a key frame
+ */
+static void
+mux_queue_packet (AVStream * st, uint8_t * buf, int size, int64_t pts,
+                  int key)
+{
+    XVC_MuxQueue *q = &mux_queues[st->index];
+    XVC_MuxPacket *pkt;
+    double duration = mux_packet_duration (st, size);
+    unsigned int fill;
+
+    if (q->tail - q->head >= MUX_QUEUE_SIZE) {
+        pthread_mutex_lock (&mux_mutex);
+        q->full = TRUE;
+        q->full_waits++;
+        __sync_synchronize ();
+        while (q->tail - q->head >= MUX_QUEUE_SIZE)
+            pthread_cond_wait (&mux_space_cond, &mux_mutex);
+        q->full = FALSE;
+        pthread_mutex_unlock (&mux_mutex);
+    }
 
-            // initialize audio output packet
-            av_init_packet (&pkt);
+    pkt = &q->pkt[q->tail % MUX_QUEUE_SIZE];
+    pkt->data = av_malloc (size);
+    if (!pkt->data) {
+        fprintf (stderr, _("Could not allocate a packet for the muxer ... aborting\n"));
+        exit (1);
+    }
+    memcpy (pkt->data, buf, size);
+    pkt->size = size;
+    pkt->pts = pts;
+    pkt->key = key;
+    // packets from encoders with B-frames come in decoding order
+    if (pts != AV_NOPTS_VALUE)
+        pkt->time = pts * av_q2d (st->time_base);
+    else
+        pkt->time = q->end;
+    q->end = FFMAX (q->end, pkt->time + duration);
+
+    // the packet must be complete before the muxer thread can see it
+    __sync_synchronize ();
+    q->tail++;
+    fill = q->tail - q->head;
+    if (fill > q->max_fill)
+        q->max_fill = fill;
+
+    __sync_synchronize ();
+    if (mux_idle) {
+        pthread_mutex_lock (&mux_mutex);
+        pthread_cond_signal (&mux_cond);
+        pthread_mutex_unlock (&mux_mutex);
+    }
+}
 
-            pkt.size =
-                avcodec_encode_audio (enc, audio_out, size_out,
-                                      (short *) audio_buf);
+/**
+ * \brief get the end of the packets queued for a stream
+ *
+ * This is what the stream's pts would be once the muxer thread wrote all
+ * queued packets and is used for a/v sync.
+ *
+ * @param st the stream
+ * @return the end of the last packet queued in secs
+ */
+static double
+mux_stream_time (AVStream * st)
+{
+    if (!mux_queues)
+        return (double) st->pts.val * st->time_base.num / st->time_base.den;
+    return mux_queues[st->index].end;
+}
+
+/**
+ * \brief find the queue with the earliest packet
+ *
+ * @return the queue or NULL if all queues are empty
+ */
+static XVC_MuxQueue *
+next_mux_queue ()
+{
+    XVC_MuxQueue *next = NULL;
+    int i;
+
+    for (i = 0; i < mux_nb_queues; i++) {
+        XVC_MuxQueue *q = &mux_queues[i];
+
+        if (q->tail == q->head)
+            continue;
+        __sync_synchronize ();
+        if (!next || q->pkt[q->head % MUX_QUEUE_SIZE].time <
+            next->pkt[next->head % MUX_QUEUE_SIZE].time)
+            next = q;
+    }
+    return next;
+}
+
+/**
+ * \brief this function implements the muxer thread
+ *
+ * It writes the queued packets earliest first. A stream whose queue is
+ * empty for the moment may still get an earlier packet, which is why the
+ * packets still go through av_interleaved_write_frame () that holds back
+ * packets until every stream has one.
+ * With fragments, everything muxed before a video keyframe is flushed to
+ * the file before the keyframe, so that a partial recording can be
+ * recovered up to the last fragment.
+ */
+static void
+mux_thread ()
+{
+    XVC_MuxQueue *q;
+
+    while (TRUE) {
+        XVC_MuxPacket *p;
+        AVPacket pkt;
+        struct timeval start, end;
+        long usecs;
+
+        if (!(q = next_mux_queue ())) {
+            pthread_mutex_lock (&mux_mutex);
+            mux_idle = TRUE;
+            __sync_synchronize ();
+            while (!(q = next_mux_queue ()) && !mux_stop)
+                pthread_cond_wait (&mux_cond, &mux_mutex);
+            mux_idle = FALSE;
+            pthread_mutex_unlock (&mux_mutex);
+            // stopped with all queues written
+            if (!q)
+                break;
+        }
+
+        p = &q->pkt[q->head % MUX_QUEUE_SIZE];
+        av_init_packet (&pkt);
+        pkt.pts = p->pts;
+        if (p->key)
+            pkt.flags |= PKT_FLAG_KEY;
+        pkt.stream_index = q - mux_queues;
+        pkt.data = p->data;
+        pkt.size = p->size;
+
+        gettimeofday (&start, NULL);
+        if (mux_fragment_interval > 0 && p->key &&
+            p->time >= mux_fragment_end &&
+            output_file->streams[pkt.stream_index]->codec->codec_type ==
+            CODEC_TYPE_VIDEO) {
+            if (xvc_outfile_flush (output_file) < 0)
+                fprintf (stderr, _("Error while flushing a fragment\n"));
+            mux_fragment_end = p->time + mux_fragment_interval;
+            mux_fragments++;
+        }
+        if (av_interleaved_write_frame (output_file, &pkt) != 0) {
+            if (output_file->streams[pkt.stream_index]->codec->codec_type ==
+                CODEC_TYPE_AUDIO)
+                fprintf (stderr, _("Error while writing audio frame\n"));
+            else
+                fprintf (stderr, _("Error while writing video frame\n"));
+        }
+        gettimeofday (&end, NULL);
+        usecs = (end.tv_sec - start.tv_sec) * 1000000 +
+            (end.tv_usec - start.tv_usec);
+        mux_write_usecs += usecs;
+        mux_write_max_usecs = FFMAX (mux_write_max_usecs, usecs);
+        mux_write_hist[usecs > 0 ? FFMIN (av_log2 (usecs) + 1, 31) : 0]++;
+        mux_packets++;
+        mux_bytes += p->size;
+        av_free (p->data);
+        p->data = NULL;
+
+        // the slot must be done with before the encoding thread reuses it
+        __sync_synchronize ();
+        q->head++;
+        __sync_synchronize ();
+        if (q->full) {
+            pthread_mutex_lock (&mux_mutex);
+            pthread_cond_broadcast (&mux_space_cond);
+            pthread_mutex_unlock (&mux_mutex);
+        }
+    }
+
+    pthread_exit (NULL);
+}
+
+/**
+ * \brief set up a packet queue per output stream and start the muxer
+ *      thread
+ *
+ * The file header must have been written already.
+ */
+static void
+start_muxer ()
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+
+    mux_nb_queues = output_file->nb_streams;
+    mux_queues = av_mallocz (mux_nb_queues * sizeof (XVC_MuxQueue));
+    if (!mux_queues) {
+        fprintf (stderr, _("Could not alloc the muxer queues\n"));
+        exit (1);
+    }
+    mux_stop = FALSE;
+    mux_write_usecs = 0;
+    mux_packets = 0;
+    mux_bytes = 0;
+    mux_write_max_usecs = 0;
+    memset (mux_write_hist, 0, sizeof (mux_write_hist));
+    mux_fragment_interval = app->fragment_interval;
+    mux_fragment_end = 0;
+    mux_fragments = 0;
+    if (pthread_create (&mux_tid, NULL, (void *) mux_thread, NULL) != 0) {
+        fprintf (stderr, _("Could not start the muxer thread\n"));
+        exit (1);
+    }
+    mux_running = TRUE;
+}
+
+/**
+ * \brief let the muxer thread write what is left in the queues and end
+ *
+ * No more packets must get queued after this is called.
+ */
+static void
+stop_muxer ()
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+    int i;
+
+    pthread_mutex_lock (&mux_mutex);
+    mux_stop = TRUE;
+    pthread_cond_signal (&mux_cond);
+    pthread_mutex_unlock (&mux_mutex);
+    pthread_join (mux_tid, NULL);
+    mux_running = FALSE;
+
+    if (app->verbose && mux_packets > 0) {
+        long n = 0;
+
+        // the bucket the 99th percentile falls into
+        for (i = 0; i < 31 && (n += mux_write_hist[i]) < mux_packets * 99 / 100;
+             i++);
+        printf ("muxer (%s io): %li packets, %li usecs writing per packet, 99%% below %li usecs, longest %li usecs, %.1f MB/s while writing\n",
+                xvc_output_io_names[xvc_outfile_get_io ()], mux_packets,
+                mux_write_usecs / mux_packets, 1L << i, mux_write_max_usecs,
+                (mux_write_usecs > 0 ?
+                 (double) mux_bytes / mux_write_usecs : 0));
+        for (i = 0; i < mux_nb_queues; i++) {
+            printf ("muxer: stream %i queued up to %u packets, waited for room %i times\n",
+                    i, mux_queues[i].max_fill, mux_queues[i].full_waits);
+        }
+        if (mux_fragment_interval > 0)
+            printf ("muxer: %i fragments\n", mux_fragments);
+    }
+
+    av_free (mux_queues);
+    mux_queues = NULL;
+    mux_nb_queues = 0;
+}
+
+/**
+ * \brief encode and write audio samples
+ *
+ * @param s output format context (output_file)
+ * @param ost pointer to audio output stream
+ * @param ist input stream information
+ * @param buf the actual data sampled
+ * @param size the size of the data sampled
+ */
+static void
+do_audio_out (AVFormatContext * s, AVOutputStream * ost,
+              const AVInputStream * ist, unsigned char *buf, int size)
+{
+    uint8_t *buftmp;
+    const int audio_out_size = 4 * MAX_AUDIO_PACKET_SIZE;
+    int size_out, frame_bytes;
+    AVCodecContext *enc;
+
+    // SC: dynamic allocation of buffers
+    if (!audio_buf)
+        audio_buf = av_malloc (2 * MAX_AUDIO_PACKET_SIZE);
+    if (!audio_out)
+        audio_out = av_malloc (audio_out_size);
+    if (!audio_out || !audio_buf)
+        return;                        // Should signal an error !
+
+    enc = ost->st->codec;
+
+    // resampling converts the rate and channels of the input and, for
+    // audio from a device, takes up the drift against the video
+    if (ost->audio_resample) {
+        buftmp = audio_buf;
+        size_out =
+            audio_resample (ost->resample, (short *) buftmp, (short *) buf,
+                            size / (ist->st->codec->channels * 2));
+        size_out = size_out * enc->channels * 2;
+    } else {
+        buftmp = buf;
+        size_out = size;
+    }
+
+    // now encode as many frames as possible
+    if (enc->frame_size > 1) {
+        // output resampled raw samples
+        av_fifo_generic_write (&ost->fifo, buftmp, size_out, NULL);
+        frame_bytes = enc->frame_size * 2 * enc->channels;
+
+        while (av_fifo_generic_read (&ost->fifo, audio_buf, frame_bytes, NULL) == 0) {
+            AVPacket pkt;
+
+            // initialize audio output packet
+            av_init_packet (&pkt);
+
+            pkt.size =
+                avcodec_encode_audio (enc, audio_out, size_out,
+                                      (short *) audio_buf);
 
             if (enc->coded_frame && enc->coded_frame->pts != AV_NOPTS_VALUE) {
                 pkt.pts =
@@ -528,18 +1578,8 @@ do_audio_out (AVFormatContext * s, AVOutputStream * ost,
             pkt.stream_index = ost->st->index;
 
             pkt.data = audio_out;
-            if (pthread_mutex_trylock (&mp) == 0) {
-                // write the compressed frame in the media file
-                if (av_interleaved_write_frame (s, &pkt) != 0) {
-                    fprintf(stderr, _("Error while writing audio frame\n"));
-                    // exit (1);
-                    return;
-                }
-
-                if (pthread_mutex_unlock (&mp) > 0) {
-                    fprintf(stderr, _("Couldn't unlock mutex lock for writing audio frame\n"));
-                }
-            }
+            // hand the compressed frame to the muxer thread
+            mux_queue_packet (ost->st, pkt.data, pkt.size, pkt.pts, TRUE);
         }
     } else {
         AVPacket pkt;
@@ -580,54 +1620,82 @@ do_audio_out (AVFormatContext * s, AVOutputStream * ost,
                 av_rescale_q (enc->coded_frame->pts, enc->time_base,
                               ost->st->time_base);
         pkt.flags |= PKT_FLAG_KEY;
-        av_interleaved_write_frame (s, &pkt);
+        mux_queue_packet (ost->st, pkt.data, pkt.size, pkt.pts, TRUE);
     }
 }
 
 /**
- * \brief signal handler for stopping the audio capture thread which
- *      runs till sent a SIGUSR1 signal
+ * \brief write an encoded audio frame while draining the audio encoder
+ *
+ * @param enc the audio encoder
+ * @param buf the encoded data
+ * @param size the size of the encoded data
  */
 static void
-cleanup_thread_when_stopped ()
+write_audio_packet (AVCodecContext * enc, uint8_t * buf, int size)
 {
-    int ret;
     AVPacket pkt;
-    int fifo_bytes;
+
+    av_init_packet (&pkt);
+    if (enc->coded_frame && enc->coded_frame->pts != AV_NOPTS_VALUE)
+        pkt.pts =
+            av_rescale_q (enc->coded_frame->pts, enc->time_base,
+                          au_out_st->st->time_base);
+    pkt.flags |= PKT_FLAG_KEY;
+    pkt.stream_index = au_out_st->st->index;
+    pkt.data = buf;
+    pkt.size = size;
+
+    mux_queue_packet (au_out_st->st, pkt.data, pkt.size, pkt.pts, TRUE);
+}
+
+/**
+ * \brief encode the samples left in the audio fifo and write out the
+ *      frames held back by the audio encoder
+ *
+ * A last partial frame is padded with silence unless the encoder takes a
+ * smaller last frame. Draining ends STOP_DRAIN_MSECS after drain_start.
+ */
+static void
+flush_audio_encoder ()
+{
+    int ret = 0;
+    int fifo_bytes, frame_bytes;
     AVCodecContext *enc;
     int bit_buffer_size = 1024 * 256;
     uint8_t *bit_buffer = NULL;
     short *samples = NULL;
 
-
-    av_init_packet (&pkt);
-//    pkt.stream_index= ost->index;
-
     enc = au_out_st->st->codec;
     samples = av_malloc (AVCODEC_MAX_AUDIO_FRAME_SIZE);
     bit_buffer = av_malloc (bit_buffer_size);
     fifo_bytes = av_fifo_size (&au_out_st->fifo);
-    ret = 0;
+    frame_bytes = enc->frame_size * 2 * enc->channels;
 
     /* encode any samples remaining in fifo */
-    if (fifo_bytes > 0 &&
-        enc->codec->capabilities & CODEC_CAP_SMALL_LAST_FRAME &&
-        bit_buffer && samples) {
+    if (fifo_bytes > 0 && enc->frame_size > 1 && bit_buffer && samples &&
+        av_fifo_generic_read (&au_out_st->fifo, (uint8_t *) samples,
+                              fifo_bytes, NULL) == 0) {
         int fs_tmp = enc->frame_size;
 
-        enc->frame_size = fifo_bytes / (2 * enc->channels);
-        if (av_fifo_generic_read (&au_out_st->fifo, (uint8_t *) samples, fifo_bytes, NULL) ==
-            0) {
-            ret =
-                avcodec_encode_audio (enc, bit_buffer, bit_buffer_size,
-                                      samples);
+        if (enc->codec->capabilities & CODEC_CAP_SMALL_LAST_FRAME) {
+            enc->frame_size = fifo_bytes / (2 * enc->channels);
+        } else if (fifo_bytes < frame_bytes) {
+            memset ((uint8_t *) samples + fifo_bytes, 0,
+                    frame_bytes - fifo_bytes);
         }
+        ret = avcodec_encode_audio (enc, bit_buffer, bit_buffer_size,
+                                    samples);
         enc->frame_size = fs_tmp;
+        if (ret > 0)
+            write_audio_packet (enc, bit_buffer, ret);
     }
-    if (ret <= 0) {
-        ret = avcodec_encode_audio (enc, bit_buffer, bit_buffer_size, NULL);
-    }
-    pkt.flags |= PKT_FLAG_KEY;
+
+    /* get the frames held back by encoders with a delay */
+    while (bit_buffer && msecs_since (&drain_start) < STOP_DRAIN_MSECS &&
+           (ret = avcodec_encode_audio (enc, bit_buffer, bit_buffer_size,
+                                        NULL)) > 0)
+        write_audio_packet (enc, bit_buffer, ret);
 
     if (samples) {
         av_free (samples);
@@ -637,6 +1705,16 @@ cleanup_thread_when_stopped ()
         av_free (bit_buffer);
         bit_buffer = NULL;
     }
+}
+
+/**
+ * \brief free the audio buffers and close the audio input
+ */
+static void
+close_audio_input ()
+{
+    int i;
+
     if (audio_out) {
         av_free (audio_out);
         audio_out = NULL;
@@ -649,472 +1727,2447 @@ cleanup_thread_when_stopped ()
         av_free (au_in_st);
         au_in_st = NULL;
     }
-
-    av_close_input_file (ic);
-
-
-    audio_thread_running = FALSE;
-    pthread_exit (&ret);
+    for (i = 0; i < num_audio_inputs; i++)
+        close_audio_device (&audio_inputs[i]);
+    ic = NULL;
 }
 
 /**
- * \brief this function implements the thread doing the audio capture and
- *      interleaving the captured audio frames with the video output
+ * \brief read a captured audio packet
  *
- * @param job the current job
+ * This is the only place the audio reader thread can be cancelled at,
+ * should it not end in time when the recording stops.
+ *
+ * @param in the audio input to read from
+ * @param pkt the packet to read into
+ * @param captured gets the master clock time in usecs the first sample
+ *      was captured at or AV_NOPTS_VALUE if the input does not know
+ * @return 0 on success, < 0 on error
  */
-static void
-capture_audio_thread (Job * job)
+static int
+read_audio_packet (XVC_AudioInput * in, AVPacket * pkt, int64_t * captured)
 {
-    XVC_AppData *app = xvc_appdata_ptr ();
-    unsigned long start, stop, start_s, stop_s;
-    struct timeval thr_curr_time;
-    long sleep;
-    int ret, len, data_size;
-    uint8_t *ptr, *data_buf;
-    static unsigned int samples_size = 0;
-    static short *samples = NULL;
-    AVPacket pkt;
-
-    audio_thread_running = TRUE;
-    signal (SIGUSR1, cleanup_thread_when_stopped);
-
-    while (TRUE) {
-        // get start time
-        gettimeofday (&thr_curr_time, NULL);
-        start_s = thr_curr_time.tv_sec;
-        start = thr_curr_time.tv_usec;
-
-        if ((job->state & VC_PAUSE) && !(job->state & VC_STEP)) {
-            pthread_mutex_lock (&(app->recording_paused_mutex));
-            pthread_cond_wait (&(app->recording_condition_unpaused),
-                               &(app->recording_paused_mutex));
-            pthread_mutex_unlock (&(app->recording_paused_mutex));
-        } else if (job->state == VC_REC) {
-
-            audio_pts = (double)
-                au_out_st->st->pts.val *
-                au_out_st->st->time_base.num / au_out_st->st->time_base.den;
-            video_pts =
-                (double) out_st->pts.val * out_st->time_base.num /
-                out_st->time_base.den;
-
-            // sometimes we need to pause writing audio packets for a/v
-            // sync (when audio_pts >= video_pts)
-            // now, if we're reading from a file/pipe, we stop sampling or
-            // else the audio track in the video would become choppy (packets
-            // missing where they were read but not written)
-            // for real-time sampling we can't do that because otherwise
-            // the input packets queue up and will eventually be sampled
-            // (only later) and lead to out-of-sync audio (video faster)
-            if (audio_pts < video_pts) {
-                // read a packet from it and output it in the fifo
-                if (av_read_frame (ic, &pkt) < 0) {
-                    fprintf(stderr, _("%s %s: error reading audio packet\n"));
-                }
-                len = pkt.size;
-                ptr = pkt.data;
-                while (len > 0) {
-                    // decode the packet if needed
-                    AVPacket avpkt;
-                    av_init_packet(&avpkt);
-                    avpkt.data = ptr;
-                    avpkt.size = len;
-                    data_buf = NULL;   /* fail safe */
-                    data_size = 0;
-
-                    if (au_in_st->decoding_needed) {
-                        samples = av_fast_realloc(samples, &samples_size, FFMAX(pkt.size, AVCODEC_MAX_AUDIO_FRAME_SIZE));
-                        data_size = samples_size;
-                        /* XXX: could avoid copy if PCM 16 bits with same endianness as CPU */
-                        ret = avcodec_decode_audio3(au_in_st->st->codec, samples, &data_size, &avpkt);
-                        if (ret < 0) {
-                            fprintf(stderr, _("Couldn't decode captured audio packet\n"));
-                            break;
-                        }
-                        ptr += ret;
-                        len -= ret;
-                        /* Some bug in mpeg audio decoder gives */
-                        /* data_size < 0, it seems they are overflows */
-                        if (data_size <= 0) {
-                            /* no audio frame */
-                            fprintf(stderr, _("No audio frame\n"));
-                            continue;
-                        }
-                        data_buf = (uint8_t *) samples;
-                        au_in_st->next_pts +=
-                            ((int64_t) AV_TIME_BASE / 2 * data_size) /
-                            (au_in_st->st->codec->sample_rate *
-                             au_in_st->st->codec->channels);
-                    } else {
-                        // FIXME: dunno about the following
-                        au_in_st->next_pts +=
-                            ((int64_t) AV_TIME_BASE *
-                             au_in_st->st->codec->frame_size) /
-                            (au_in_st->st->codec->sample_rate *
-                             au_in_st->st->codec->channels);
-                        data_buf = ptr;
-                        data_size = len;
-                        ret = len;
-                        len = 0;
-                    }
+    int ret;
 
-                    do_audio_out (output_file, au_out_st, au_in_st,
-                                  data_buf, data_size);
-                }
-                // discard packet
-                av_free_packet (&pkt);
-            }                          // end outside if pts ...
-            else {
-                if (strcmp (job->snd_device, "pipe:") < 0)
-                    if (av_read_frame (ic, &pkt) < 0) {
-                        fprintf (stderr, _("error reading audio packet\n"));
-                    }
-                printf (_("Dropping audio frame %f %f\n"), audio_pts, video_pts);
-            }
-        }                              // end if VC_REC
-        // get end time
-        gettimeofday (&thr_curr_time, NULL);
-        stop_s = thr_curr_time.tv_sec;
-        stop = thr_curr_time.tv_usec;
-        stop += ((stop_s - start_s) * 1000000);
-        sleep = (1000000 / target->sndrate) - (stop - start);
-        /**
-         * \todo perhaps this whole stuff is irrelevant. Haven't really
-         *      seen a situation where the encoding was faster than the time
-         *      needed for a decent frame-rate. need to look into more
-         *      details about audio/video sync in libavcodec/-format
-         *      the strange thing, however is: If I leave away the getting of
-         *      start/end time and the usleep stuff, normal audio capture
-         *      works, piped audio doesn't *BLINK*
-         */
-        if (sleep < 0)
-            sleep = 0;
+    pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
+    if (in->alsa) {
+        ret = xvc_alsa_read (in->alsa, pkt, captured);
+    } else {
+        ret = av_read_frame (in->ic, pkt);
+        *captured = AV_NOPTS_VALUE;
+    }
+    pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
 
-        usleep (sleep);
-    }                                  // end while(TRUE) loop
-    ret = 1;
-    audio_thread_running = FALSE;
-    pthread_exit (&ret);
+    return ret;
 }
 
-
 /**
- * \brief write encoded video data
+ * \brief get the CPU time the calling thread used
  *
- * @param s pointer to format context (output_file)
- * @param ost video output stream
- * @param buf buffer with actual data
- * @param size size of encoded data
+ * @return the CPU time in usecs
  */
-static void
-do_video_out (AVFormatContext * s, AVStream * ost, unsigned char *buf, int size)
+static long
+thread_cpu_usecs ()
 {
-    AVCodecContext *enc;
-    AVPacket pkt;
-
-	enc = ost->codec;
-
-    // initialize video output packet
-    av_init_packet (&pkt);
+    struct timespec ts;
 
-    if (enc->coded_frame) {
-        if (enc->coded_frame->pts != AV_NOPTS_VALUE) {
-            pkt.pts =
-                av_rescale_q (enc->coded_frame->pts, enc->time_base,
-                              ost->time_base);
-        }
-        if (enc->coded_frame->key_frame)
-            pkt.flags |= PKT_FLAG_KEY;
-    }
+    if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) < 0)
+        return 0;
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
 
-    pkt.stream_index = ost->index;
-    pkt.data = buf;
-    pkt.size = size;
+/**
+ * \brief read the master clock all captures are timestamped with
+ *
+ * This is the monotonic clock, so it is not thrown off by changes to the
+ * system time during a recording.
+ *
+ * @return the time in usecs
+ */
+static int64_t
+master_clock ()
+{
+    struct timespec ts;
 
-    if (av_interleaved_write_frame (s, &pkt) != 0) {
-        fprintf (stderr, _("Error while writing video frame\n"));
-        // exit (1);
-        return;
-    }
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 /**
- * \brief convert bgra32 to rgba32
- *
- * needed on Solaris/SPARC because the ffmpeg version used doesn't know
- * PIX_FMT_ABGR32, i.e. byte ordering is not taken care of
- * @param image the XImage to convert
+ * \brief wake the audio threads sleeping on the ring
  */
 static void
-myABGR32toARGB32 (XImage * image)
+wake_audio_ring ()
 {
-    char *pdata, *counter;
+    pthread_mutex_lock (&audio_ring_mutex);
+    pthread_cond_broadcast (&audio_ring_cond);
+    pthread_cond_broadcast (&audio_ring_space_cond);
+    pthread_mutex_unlock (&audio_ring_mutex);
+}
 
+/**
+ * \brief pass a captured packet on to the audio encoding thread
+ *
+ * Should the ring be full, because the audio encoder does not keep up,
+ * a pipe is not read any further until the encoding thread made room. A
+ * device goes on capturing in real time, so its packet is dropped and
+ * accounted for instead; the a/v sync fills the gap later.
+ *
+ * @param in the audio input the packet was read from
+ * @param pkt the packet, the ring takes it over
+ * @param captured the master clock time in usecs the first sample was
+ *      captured at or AV_NOPTS_VALUE if the input does not know
+ */
+static void
+audio_ring_push (XVC_AudioInput * in, AVPacket * pkt, int64_t captured)
+{
+    AVStream *st = in->ic->streams[0];
+    XVC_AudioPacket *p;
+    unsigned int fill = in->tail - in->head;
+    int64_t duration = 0;
+
+    if (st->codec->channels > 0 && st->codec->sample_rate > 0)
+        duration = (int64_t) pkt->size * 1000000 /
+            (2 * st->codec->channels * st->codec->sample_rate);
+    // the read returned as soon as the input had the packet, so its first
+    // sample was captured the packet's duration ago
+    if (captured == AV_NOPTS_VALUE)
+        captured = master_clock () - duration;
+
+    if (audio_from_device) {
+        if (fill >= AUDIO_RING_SIZE) {
+            if (!in->overflowing) {
+                in->overflowing = TRUE;
+                in->overflows++;
+                xvc_error_write_msg (57, 1);
+            }
+            in->overflow_usecs += duration;
+            av_free_packet (pkt);
+            return;
+        }
+        if (in->overflowing && fill <= AUDIO_RING_SIZE / 4) {
+            in->overflowing = FALSE;
+            xvc_error_write_msg (58, 0);
+        }
+    } else if (fill >= AUDIO_RING_SIZE) {
+        pthread_mutex_lock (&audio_ring_mutex);
+        in->full = TRUE;
+        __sync_synchronize ();
+        while (in->tail - in->head >= AUDIO_RING_SIZE && !audio_thread_stop)
+            pthread_cond_wait (&audio_ring_space_cond, &audio_ring_mutex);
+        in->full = FALSE;
+        pthread_mutex_unlock (&audio_ring_mutex);
+        if (audio_thread_stop) {
+            av_free_packet (pkt);
+            return;
+        }
+    }
+
+    p = &in->ring[in->tail % AUDIO_RING_SIZE];
+    p->pkt = *pkt;
+    p->captured = captured;
+
+    // the packet must be complete before the encoding thread can see it
+    __sync_synchronize ();
+    in->tail++;
+    fill = in->tail - in->head;
+    if (fill > in->max_fill)
+        in->max_fill = fill;
+    in->packets++;
+
+    // the encoding thread is driven by the packets of the first input
+    __sync_synchronize ();
+    if (in == audio_inputs && audio_ring_idle) {
+        pthread_mutex_lock (&audio_ring_mutex);
+        pthread_cond_signal (&audio_ring_cond);
+        pthread_mutex_unlock (&audio_ring_mutex);
+    }
+}
+
+/**
+ * \brief take the oldest captured packet off the ring of an audio input
+ *
+ * @param in the audio input
+ * @param pkt the packet taken over from the ring, to be freed by the caller
+ * @param captured if not NULL, gets the master clock time in usecs the
+ *      packet was captured at
+ * @return FALSE if the ring is empty
+ */
+static int
+audio_ring_pop (XVC_AudioInput * in, AVPacket * pkt, int64_t * captured)
+{
+    if (in->tail == in->head)
+        return FALSE;
+
+    __sync_synchronize ();
+    *pkt = in->ring[in->head % AUDIO_RING_SIZE].pkt;
+    if (captured)
+        *captured = in->ring[in->head % AUDIO_RING_SIZE].captured;
+    // the slot must be done with before the reader reuses it
+    __sync_synchronize ();
+    in->head++;
+    __sync_synchronize ();
+    if (in->full) {
+        pthread_mutex_lock (&audio_ring_mutex);
+        pthread_cond_broadcast (&audio_ring_space_cond);
+        pthread_mutex_unlock (&audio_ring_mutex);
+    }
+    return TRUE;
+}
+
+/**
+ * \brief let the audio encoding thread sleep until the reader of the first
+ *      audio input queued a packet or the audio threads are asked to stop
+ */
+static void
+audio_ring_wait ()
+{
+    pthread_mutex_lock (&audio_ring_mutex);
+    audio_ring_idle = TRUE;
+    __sync_synchronize ();
+    while (audio_inputs[0].tail == audio_inputs[0].head && !audio_thread_stop)
+        pthread_cond_wait (&audio_ring_cond, &audio_ring_mutex);
+    audio_ring_idle = FALSE;
+    pthread_mutex_unlock (&audio_ring_mutex);
+}
+
+/**
+ * \brief this function implements the threads reading from the audio inputs
+ *
+ * Each blocks in reading until its input has a packet of samples, and
+ * passes each packet on to the audio encoding thread through the input's
+ * ring together with its capture time. It does nothing else, so that
+ * capturing from a device stays real time however slow the audio encoder
+ * is.
+ *
+ * @param in the audio input to read from
+ */
+static void
+audio_reader_thread (XVC_AudioInput * in)
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+    Job *job = xvc_job_ptr ();
+    AVPacket pkt;
+    int64_t captured;
+
+    pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+
+    while (!audio_thread_stop) {
+        if ((job->state & VC_PAUSE) && !(job->state & VC_STEP)) {
+            pthread_mutex_lock (&(app->recording_paused_mutex));
+            if (!audio_thread_stop)
+                pthread_cond_wait (&(app->recording_condition_unpaused),
+                                   &(app->recording_paused_mutex));
+            pthread_mutex_unlock (&(app->recording_paused_mutex));
+            continue;
+        }
+        if (read_audio_packet (in, &pkt, &captured) < 0) {
+            // the end of a pipe or a device gone
+            if (!audio_thread_stop)
+                fprintf (stderr, _("Error reading audio packet from %s, its capture ends\n"),
+                         in->device);
+            break;
+        }
+        // packets may point into the demuxer's buffers
+        if (av_dup_packet (&pkt) < 0) {
+            av_free_packet (&pkt);
+            continue;
+        }
+        audio_ring_push (in, &pkt, captured);
+    }
+
+    in->cpu_usecs = thread_cpu_usecs ();
+    pthread_exit (NULL);
+}
+
+/**
+ * \brief mix samples into others
+ *
+ * The samples are scaled by the gain and added, both with saturation. With
+ * SSE2 eight samples are done at a time, the rest one by one to the same
+ * result.
+ *
+ * @param dst the samples to mix into
+ * @param src the samples to mix in
+ * @param n the number of samples
+ * @param gain the gain in 1/4096, up to 16384
+ */
+static void
+mix_samples (int16_t * dst, const int16_t * src, int n, int gain)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    __m128i g = _mm_set1_epi16 (gain);
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i s = _mm_loadu_si128 ((const __m128i *) (src + i));
+        __m128i d = _mm_loadu_si128 ((const __m128i *) (dst + i));
+        __m128i lo = _mm_mullo_epi16 (s, g);
+        __m128i hi = _mm_mulhi_epi16 (s, g);
+        __m128i p0 = _mm_srai_epi32 (_mm_unpacklo_epi16 (lo, hi), 12);
+        __m128i p1 = _mm_srai_epi32 (_mm_unpackhi_epi16 (lo, hi), 12);
+
+        d = _mm_adds_epi16 (d, _mm_packs_epi32 (p0, p1));
+        _mm_storeu_si128 ((__m128i *) (dst + i), d);
+    }
+#endif     // __SSE2__
+    for (; i < n; i++) {
+        int v = (src[i] * gain) >> 12;
+
+        v = FFMIN (FFMAX (v, -32768), 32767) + dst[i];
+        dst[i] = FFMIN (FFMAX (v, -32768), 32767);
+    }
+}
+
+/**
+ * \brief move what the reader of an audio input mixed in queued to the
+ *      input's fifo
+ *
+ * The oss and ALSA inputs deliver s16 samples in the byte order of the CPU,
+ * so they are mixed as they are.
+ *
+ * @param in the audio input
+ * @param keep FALSE to drop what was queued
+ */
+static void
+fill_audio_mix_fifo (XVC_AudioInput * in, int keep)
+{
+    AVPacket pkt;
+    int64_t captured;
+    int frame_bytes = 2 * in->ic->streams[0]->codec->channels;
+    int rate = in->ic->streams[0]->codec->sample_rate;
+
+    while (audio_ring_pop (in, &pkt, &captured)) {
+        if (keep) {
+            // samples following a gap start the fifo over at their time
+            if (av_fifo_size (in->fifo) == 0) {
+                in->fifo_start = captured;
+                in->fifo_taken = 0;
+            }
+            if (av_fifo_space (in->fifo) < pkt.size)
+                av_fifo_realloc2 (in->fifo, av_fifo_size (in->fifo) +
+                                  pkt.size);
+            av_fifo_generic_write (in->fifo, pkt.data, pkt.size, NULL);
+        }
+        av_free_packet (&pkt);
+    }
+    // not mixed for a second, the oldest is not wanted any more
+    while (av_fifo_size (in->fifo) > rate * frame_bytes) {
+        av_fifo_drain (in->fifo, frame_bytes * (rate / 10));
+        in->fifo_taken += rate / 10;
+    }
+}
+
+/**
+ * \brief apply the gains and mix the other audio inputs into decoded
+ *      samples of the first one
+ *
+ * The inputs are aligned by capture time. An input's samples are taken
+ * one after the other for as long as their time stays within
+ * AUDIO_MIX_TOLERANCE_USECS of the first input's, so the jitter of the
+ * capture times does not cut them up. Beyond that, samples captured too
+ * early are dropped and an input captured too late starts into the block.
+ * Inputs without samples are silent.
+ *
+ * @param buf the decoded samples of the first input, mixed in place
+ * @param n the number of samples in buf
+ * @param start the master clock time in usecs the first sample was
+ *      captured at
+ */
+static void
+mix_audio_inputs (int16_t * buf, int n, int64_t start)
+{
+    AVCodecContext *c = ic->streams[0]->codec;
+    int channels = c->channels, rate = c->sample_rate;
+    int frames = n / channels;
+    long cpu = thread_cpu_usecs ();
+    int i;
+
+    if (audio_inputs[0].gain != 4096) {
+        // there is nothing to add to, but the scaling is the same
+        mix_buf = av_fast_realloc (mix_buf, &mix_buf_size, n * 2);
+        memcpy (mix_buf, buf, n * 2);
+        memset (buf, 0, n * 2);
+        mix_samples (buf, mix_buf, n, audio_inputs[0].gain);
+    }
+
+    for (i = 1; i < num_audio_inputs; i++) {
+        XVC_AudioInput *in = &audio_inputs[i];
+        int avail, offset = 0, take;
+
+        fill_audio_mix_fifo (in, TRUE);
+        avail = av_fifo_size (in->fifo) / (2 * channels);
+        if (avail > 0) {
+            int64_t lag = start - (in->fifo_start +
+                                   in->fifo_taken * 1000000 / rate);
+
+            if (lag > AUDIO_MIX_TOLERANCE_USECS) {
+                int drop = FFMIN (lag * rate / 1000000, avail);
+
+                av_fifo_drain (in->fifo, drop * 2 * channels);
+                in->fifo_taken += drop;
+                avail -= drop;
+            } else if (lag < -AUDIO_MIX_TOLERANCE_USECS) {
+                offset = FFMIN (-lag * rate / 1000000, frames);
+            }
+        }
+        take = FFMIN (frames - offset, avail);
+        if (take <= 0)
+            continue;
+
+        mix_buf = av_fast_realloc (mix_buf, &mix_buf_size,
+                                   take * 2 * channels);
+        av_fifo_generic_read (in->fifo, mix_buf, take * 2 * channels, NULL);
+        in->fifo_taken += take;
+        mix_samples (buf + offset * channels, mix_buf, take * channels,
+                     in->gain);
+    }
+
+    audio_mix_cpu_usecs += thread_cpu_usecs () - cpu;
+    audio_mixed_usecs += (int64_t) frames * 1000000 / rate;
+}
+
+/**
+ * \brief put a captured frame on the master clock
+ *
+ * The frame's capture time and its time in the video stream are what the
+ * audio is synced to. If the container allows gaps in the timestamps, a
+ * frame captured too late for its slot is moved to the slot of its
+ * capture time, so the video keeps pace with the master clock.
+ *
+ * @param job the current job
+ */
+static void
+sync_video_clock (Job * job)
+{
+    int64_t now = master_clock ();
+    int64_t frame_usecs = (int64_t) 1000000 * target->fps.den /
+        target->fps.num;
+    int64_t due;
+
+    // frames after a pause go on from where the video stopped
+    if ((job->state & (VC_START | VC_PAUSE)) || video_clock_paused) {
+        video_clock_start = now - frame_pts * frame_usecs;
+        video_clock_paused = ((job->state & VC_PAUSE) != 0);
+    } else if (pts_gaps) {
+        due = (now - video_clock_start + frame_usecs / 2) / frame_usecs;
+        if (due > frame_pts) {
+            late_frames += due - frame_pts;
+            skipped_pending += due - frame_pts;
+            frame_pts = due;
+        }
+    }
+
+    pthread_mutex_lock (&av_sync_mutex);
+    av_sync_clock = now;
+    av_sync_video = frame_pts * frame_usecs;
+    pthread_mutex_unlock (&av_sync_mutex);
+}
+
+/**
+ * \brief encode silence to fill a gap in the captured audio
+ *
+ * @param usecs the length of the gap
+ */
+static void
+insert_silence (int64_t usecs)
+{
+    AVCodecContext *dec = au_in_st->st->codec;
+    int frame_bytes = 2 * dec->channels;
+    int64_t bytes = usecs * dec->sample_rate / 1000000 * frame_bytes;
+    // in chunks of about the size of a captured packet
+    int chunk = 4096 / frame_bytes * frame_bytes;
+    uint8_t *zeros = av_mallocz (chunk);
+
+    if (!zeros)
+        return;
+    av_sync_silence += usecs;
+    while (bytes > 0) {
+        int size = FFMIN (bytes, chunk);
+
+        do_audio_out (output_file, au_out_st, au_in_st, zeros, size);
+        bytes -= size;
+    }
+    av_free (zeros);
+}
+
+/**
+ * \brief measure the a/v offset of a captured audio packet and correct it
+ *
+ * The offset is where the packet goes in the audio stream less where the
+ * video stream is at the time the packet was captured, both found through
+ * the master clock. Offsets as the drift of the sound card's clock builds
+ * them up are absorbed by resampling the audio a little faster or slower.
+ * Large ones are corrected at once.
+ *
+ * @param captured master clock time in usecs the packet was captured at
+ * @return FALSE if the packet is to be dropped
+ */
+static int
+sync_audio (int64_t captured)
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+    AVCodecContext *enc = au_out_st->st->codec;
+    int64_t frame_usecs = (int64_t) 1000000 * target->fps.den /
+        target->fps.num;
+    int64_t clock, video, audio, offset;
+    int delta = 0, max_delta;
+
+    pthread_mutex_lock (&av_sync_mutex);
+    clock = av_sync_clock;
+    video = av_sync_video;
+    pthread_mutex_unlock (&av_sync_mutex);
+    // audio is not written ahead of the video, so a packet captured after
+    // the latest frame means there is no frame since a pause yet
+    if (clock == 0 || captured > clock + frame_usecs)
+        return TRUE;
+
+    // the samples waiting for a full frame in the fifo come before this
+    audio = (int64_t) (mux_stream_time (au_out_st->st) * 1000000) +
+        (int64_t) av_fifo_size (au_out_st->fifo) * 1000000 /
+        (2 * enc->channels * enc->sample_rate);
+    offset = audio - (video + captured - clock);
+
+    av_sync_measures++;
+    av_sync_offset_sum += offset;
+    if (llabs (offset) > av_sync_max_offset)
+        av_sync_max_offset = llabs (offset);
+
+    if (offset > AV_SYNC_MAX_OFFSET_USECS) {
+        av_sync_dropped++;
+        return FALSE;
+    }
+    if (offset < -AV_SYNC_MAX_OFFSET_USECS) {
+        insert_silence (-offset);
+        av_sync_offset = 0;
+        return TRUE;
+    }
+    av_sync_offset += (offset - av_sync_offset) / 8;
+
+    if (au_out_st->audio_resample && au_out_st->resample) {
+        // the offset is spread over a second of audio, but the audio is
+        // never sped up or slowed down by more than a few 1/1000
+        max_delta = enc->sample_rate * AV_SYNC_MAX_SKEW_PERMILLE / 1000;
+        if (llabs (av_sync_offset) >= AV_SYNC_THRESHOLD_USECS)
+            delta = -av_sync_offset * enc->sample_rate / 1000000;
+        delta = FFMAX (-max_delta, FFMIN (max_delta, delta));
+        // as in ffmpeg.c: the first member of a ReSampleContext is the
+        // AVResampleContext doing the work
+        av_resample_compensate (*(struct AVResampleContext **)
+                                au_out_st->resample, delta,
+                                enc->sample_rate);
+    }
+
+    if (app->verbose && captured - av_sync_last_report >=
+        AV_SYNC_REPORT_USECS) {
+        printf ("a/v offset %+.1f msecs, audio resampled by %+.2f%%\n",
+                av_sync_offset / 1000.0, delta * 100.0 / enc->sample_rate);
+        av_sync_last_report = captured;
+    }
+    return TRUE;
+}
+
+/**
+ * \brief this function implements the thread encoding the captured audio
+ *      and interleaving the audio frames with the video output
+ *
+ * It sleeps until the audio reader thread has a packet for it.
+ *
+ * @param job the current job
+ */
+static void
+capture_audio_thread (Job * job)
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+    int ret, len, data_size;
+    uint8_t *ptr, *data_buf;
+    static unsigned int samples_size = 0;
+    static short *samples = NULL;
+    int i;
+    AVPacket pkt;
+    int64_t captured, decoded;
+    long frame_usecs = 1000000L * target->fps.den / target->fps.num;
+    int mixing = (num_audio_inputs > 1 || audio_inputs[0].gain != 4096);
+
+    pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+
+    while (!audio_thread_stop) {
+        if ((job->state & VC_PAUSE) && !(job->state & VC_STEP)) {
+            pthread_mutex_lock (&(app->recording_paused_mutex));
+            if (!audio_thread_stop)
+                pthread_cond_wait (&(app->recording_condition_unpaused),
+                                   &(app->recording_paused_mutex));
+            pthread_mutex_unlock (&(app->recording_paused_mutex));
+        } else if (job->state != VC_REC) {
+            // not recording yet or any more, what is captured meanwhile
+            // is not wanted
+            for (i = 1; i < num_audio_inputs; i++)
+                fill_audio_mix_fifo (&audio_inputs[i], FALSE);
+            if (audio_ring_pop (audio_inputs, &pkt, NULL))
+                av_free_packet (&pkt);
+            else
+                audio_ring_wait ();
+        } else if (audio_inputs[0].tail == audio_inputs[0].head) {
+            audio_ring_wait ();
+        } else {
+
+            // the video is compared by what was captured, not by what was
+            // encoded: the gop encoders queue their frames for the muxer
+            // gops late, longer than the ring could hold the audio
+            audio_pts = mux_stream_time (au_out_st->st);
+            pthread_mutex_lock (&av_sync_mutex);
+            video_pts = (double) (av_sync_video + frame_usecs) / 1000000;
+            pthread_mutex_unlock (&av_sync_mutex);
+
+            // audio is not written ahead of the video, the packets wait in
+            // the ring meanwhile and a pipe is not read any further
+            // audio from a device is synced to the video through the
+            // master clock
+            if (audio_pts < video_pts) {
+                audio_ring_pop (audio_inputs, &pkt, &captured);
+                if (audio_from_device && !sync_audio (captured)) {
+                    av_free_packet (&pkt);
+                    continue;
+                }
+                decoded = 0;
+                len = pkt.size;
+                ptr = pkt.data;
+                while (len > 0) {
+                    // decode the packet if needed
+                    AVPacket avpkt;
+                    av_init_packet(&avpkt);
+                    avpkt.data = ptr;
+                    avpkt.size = len;
+                    data_buf = NULL;   /* fail safe */
+                    data_size = 0;
+
+                    if (au_in_st->decoding_needed) {
+                        samples = av_fast_realloc(samples, &samples_size, FFMAX(pkt.size, AVCODEC_MAX_AUDIO_FRAME_SIZE));
+                        data_size = samples_size;
+                        /* XXX: could avoid copy if PCM 16 bits with same endianness as CPU */
+                        ret = avcodec_decode_audio3(au_in_st->st->codec, samples, &data_size, &avpkt);
+                        if (ret < 0) {
+                            fprintf(stderr, _("Couldn't decode captured audio packet\n"));
+                            break;
+                        }
+                        ptr += ret;
+                        len -= ret;
+                        /* Some bug in mpeg audio decoder gives */
+                        /* data_size < 0, it seems they are overflows */
+                        if (data_size <= 0) {
+                            /* no audio frame */
+                            fprintf(stderr, _("No audio frame\n"));
+                            continue;
+                        }
+                        data_buf = (uint8_t *) samples;
+                        if (mixing) {
+                            AVCodecContext *dec = au_in_st->st->codec;
+
+                            mix_audio_inputs (samples, data_size / 2,
+                                              captured + decoded * 1000000 /
+                                              dec->sample_rate);
+                            decoded += data_size / (2 * dec->channels);
+                        }
+                        au_in_st->next_pts +=
+                            ((int64_t) AV_TIME_BASE / 2 * data_size) /
+                            (au_in_st->st->codec->sample_rate *
+                             au_in_st->st->codec->channels);
+                    } else {
+                        // FIXME: dunno about the following
+                        au_in_st->next_pts +=
+                            ((int64_t) AV_TIME_BASE *
+                             au_in_st->st->codec->frame_size) /
+                            (au_in_st->st->codec->sample_rate *
+                             au_in_st->st->codec->channels);
+                        data_buf = ptr;
+                        data_size = len;
+                        ret = len;
+                        len = 0;
+                    }
+
+                    do_audio_out (output_file, au_out_st, au_in_st,
+                                  data_buf, data_size);
+                }
+                // discard packet
+                av_free_packet (&pkt);
+            }                          // end outside if pts ...
+            else {
+                // the video catches up a frame at a time
+                usleep (frame_usecs);
+            }
+        }                              // end if VC_REC
+    }                                  // end while(!audio_thread_stop) loop
+
+    flush_audio_encoder ();
+    audio_encoder_cpu_usecs = thread_cpu_usecs ();
+
+    pthread_exit (NULL);
+}
+
+
+/**
+ * \brief write a video packet
+ *
+ * @param s pointer to format context (output_file)
+ * @param ost video output stream
+ * @param buf buffer with actual data
+ * @param size size of encoded data
+ * @param pts presentation time stamp in the time base of the encoder, or
+ *      AV_NOPTS_VALUE
+ * @param key TRUE if the packet holds a key frame
+ */
+static void
+write_video_packet (AVFormatContext * s, AVStream * ost, unsigned char *buf,
+                    int size, int64_t pts, int key)
+{
+    AVPacket pkt;
+
+    // initialize video output packet
+    av_init_packet (&pkt);
+
+    if (pts != AV_NOPTS_VALUE)
+        pkt.pts = av_rescale_q (pts, ost->codec->time_base, ost->time_base);
+    if (key)
+        pkt.flags |= PKT_FLAG_KEY;
+
+    pkt.stream_index = ost->index;
+    pkt.data = buf;
+    pkt.size = size;
+
+    // single frames are written right away, movies by the muxer thread
+    if (mux_running) {
+        mux_queue_packet (ost, pkt.data, pkt.size, pkt.pts, key);
+        return;
+    }
+    if (av_interleaved_write_frame (s, &pkt) != 0) {
+        fprintf (stderr, _("Error while writing video frame\n"));
+        // exit (1);
+        return;
+    }
+}
+
+/**
+ * \brief write encoded video data
+ *
+ * @param s pointer to format context (output_file)
+ * @param ost video output stream
+ * @param buf buffer with actual data
+ * @param size size of encoded data
+ */
+static void
+do_video_out (AVFormatContext * s, AVStream * ost, unsigned char *buf, int size)
+{
+    AVCodecContext *enc = ost->codec;
+
+    if (enc->coded_frame)
+        write_video_packet (s, ost, buf, size, enc->coded_frame->pts,
+                            enc->coded_frame->key_frame);
+    else
+        write_video_packet (s, ost, buf, size, AV_NOPTS_VALUE, FALSE);
+}
+
+/**
+ * \brief convert a single rgb triplet to yuv
+ *
+ * Coefficients are ITU-R BT.601, either with the video range 16-235 or with
+ * the full jpeg range.
+ * @param r red component (0-255)
+ * @param g green component (0-255)
+ * @param b blue component (0-255)
+ * @param full_range TRUE if the output is one of the yuvj* formats
+ * @param y pointer to where the luma is written
+ * @param u pointer to where the blue difference chroma is written
+ * @param v pointer to where the red difference chroma is written
+ */
+static inline void
+rgb_to_yuv (int r, int g, int b, int full_range, int *y, int *u, int *v)
+{
+    if (full_range) {
+        *y = (77 * r + 150 * g + 29 * b + 128) >> 8;
+        *u = ((-43 * r - 85 * g + 128 * b + 128) >> 8) + 128;
+        *v = ((128 * r - 107 * g - 21 * b + 128) >> 8) + 128;
+    } else {
+        *y = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+        *u = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+        *v = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+    }
+}
+
+/**
+ * \brief precompute the palette to yuv lookup tables used for 8bit
+ *      pseudo-color input
+ *
+ * The color table is the one returned by xvc_ffmpeg_get_color_table(), i.e.
+ * one 0x00RRGGBB entry per palette element.
+ * @param color_table the color table as prepared for the current job
+ * @param ncolors the number of valid entries in color_table
+ * @param full_range TRUE if the output is one of the yuvj* formats
+ */
+static void
+prepare_pal8_yuv_tables (const u_int32_t * color_table, int ncolors,
+                         int full_range)
+{
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        int r = 0, g = 0, b = 0;
+
+        if (color_table && i < ncolors) {
+            r = (color_table[i] & 0x00FF0000) >> 16;
+            g = (color_table[i] & 0x0000FF00) >> 8;
+            b = (color_table[i] & 0x000000FF);
+        }
+
+        rgb_to_yuv (r, g, b, full_range, &pal8_to_y[i], &pal8_to_u[i],
+                    &pal8_to_v[i]);
+    }
+}
+
+/**
+ * \brief convert pal8 to yuv420p in a single pass
+ *
+ * Every 2x2 block of palette indices is looked up in the tables prepared by
+ * prepare_pal8_yuv_tables() and written straight into the output frame, so
+ * there is no intermediate rgb picture. 8bit pseudo-color images may have
+ * lines padded by excess bytes, which is why we step through the input by
+ * bytes_per_line. Odd widths or heights replicate the last column or row for
+ * the chroma samples.
+ * @param image the XImage to convert
+ * @param p_outpic pointer to the frame the converted output is written to
+ */
+static void
+myPAL8toYUV420P (const XImage * image, AVFrame * p_outpic)
+{
+    int x, y;
+
+    for (y = 0; y < image->height; y += 2) {
+        const uint8_t *in0 =
+            (const uint8_t *) image->data + (y * image->bytes_per_line);
+        const uint8_t *in1 = (y + 1 < image->height) ?
+            in0 + image->bytes_per_line : in0;
+        uint8_t *y0 = p_outpic->data[0] + (y * p_outpic->linesize[0]);
+        uint8_t *y1 = y0 + p_outpic->linesize[0];
+        uint8_t *u = p_outpic->data[1] + ((y >> 1) * p_outpic->linesize[1]);
+        uint8_t *v = p_outpic->data[2] + ((y >> 1) * p_outpic->linesize[2]);
+
+        for (x = 0; x < image->width; x += 2) {
+            int x1 = (x + 1 < image->width) ? x + 1 : x;
+            uint8_t p00 = in0[x], p01 = in0[x1];
+            uint8_t p10 = in1[x], p11 = in1[x1];
+
+            y0[x] = pal8_to_y[p00];
+            if (x1 != x)
+                y0[x1] = pal8_to_y[p01];
+            if (y + 1 < image->height) {
+                y1[x] = pal8_to_y[p10];
+                if (x1 != x)
+                    y1[x1] = pal8_to_y[p11];
+            }
+
+            *u++ = (pal8_to_u[p00] + pal8_to_u[p01] + pal8_to_u[p10] +
+                    pal8_to_u[p11] + 2) >> 2;
+            *v++ = (pal8_to_v[p00] + pal8_to_v[p01] + pal8_to_v[p10] +
+                    pal8_to_v[p11] + 2) >> 2;
+        }
+    }
+}
+
+/**
+ * \brief get the position of the color components within a packed rgb pixel
+ *
+ * @param pix_fmt libavcodec's picture format of the input
+ * @param bpp pointer to where the number of bytes per pixel is written
+ * @param r pointer to where the byte offset of the red component is written
+ * @param g pointer to where the byte offset of the green component is written
+ * @param b pointer to where the byte offset of the blue component is written
+ * @return TRUE if pix_fmt is a packed rgb format with 8 bits per component,
+ *      FALSE otherwise
+ */
+static int
+get_rgb_byte_offsets (int pix_fmt, int *bpp, int *r, int *g, int *b)
+{
+    switch (pix_fmt) {
+    case PIX_FMT_ARGB:
+        *bpp = 4;
+        *r = 1;
+        *g = 2;
+        *b = 3;
+        break;
+    case PIX_FMT_RGBA:
+        *bpp = 4;
+        *r = 0;
+        *g = 1;
+        *b = 2;
+        break;
+    case PIX_FMT_ABGR:
+        *bpp = 4;
+        *r = 3;
+        *g = 2;
+        *b = 1;
+        break;
+    case PIX_FMT_BGRA:
+        *bpp = 4;
+        *r = 2;
+        *g = 1;
+        *b = 0;
+        break;
+    case PIX_FMT_RGB24:
+        *bpp = 3;
+        *r = 0;
+        *g = 1;
+        *b = 2;
+        break;
+    case PIX_FMT_BGR24:
+        *bpp = 3;
+        *r = 2;
+        *g = 1;
+        *b = 0;
+        break;
+    default:
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * \brief find out if the frame can be scaled down by an integer ratio
+ *      through box filtering rather than libswscale
+ *
+ * This is the case for packed rgb input and yuv420p output if the output
+ * dimensions are exactly 1/2, 1/4, or 1/8 of the input (rounded down to
+ * even numbers as everywhere else) and the input is not cropped
+ * @param image the captured XImage
+ * @param c the codec context of the video output stream
+ * @param width the width of the picture within the padded output frame
+ * @param height the height of the picture within the padded output frame
+ * @return the ratio (2, 4, or 8) or 0 if box filtering cannot be used
+ */
+static int
+get_box_ratio (const XImage * image, const AVCodecContext * c, int width,
+               int height)
+{
+    int n, bpp, r, g, b;
+
+    if ((c->pix_fmt != PIX_FMT_YUV420P && c->pix_fmt != PIX_FMT_YUVJ420P) ||
+        !get_rgb_byte_offsets (input_pixfmt, &bpp, &r, &g, &b) ||
+        vid_out_st->video_crop)
+        return 0;
+
+    for (n = 2; n <= 8; n *= 2) {
+        if (width == ((image->width / n) & ~1) &&
+            height == ((image->height / n) & ~1))
+            return n;
+    }
+    return 0;
+}
+
+/**
+ * \brief scale down packed rgb by an integer ratio and convert to yuv420p in
+ *      a single pass
+ *
+ * Every output pixel is the average of an n x n block of input pixels, the
+ * chroma is averaged over 2 x 2 output pixels as usual. Input pixels beyond
+ * width * n or height * n (if the input dimensions are not multiples of 2 * n)
+ * are dropped.
+ * @param image the XImage to convert
+ * @param p_outpic pointer to the frame the converted output is written to
+ * @param width output width, must be even
+ * @param height output height, must be even
+ * @param n the ratio as returned by get_box_ratio()
+ * @param full_range TRUE if the output is yuvj420p
+ */
+static void
+myRGBtoYUV420P_box (const XImage * image, AVFrame * p_outpic, int width,
+                    int height, int n, int full_range)
+{
+    int bpp = 4, ro = 0, go = 1, bo = 2, shift = 0, half;
+    int x, y, dx, dy, i, j;
+
+    get_rgb_byte_offsets (input_pixfmt, &bpp, &ro, &go, &bo);
+    // n is a power of two, sums are over n * n pixels
+    while ((1 << shift) < n)
+        shift++;
+    shift *= 2;
+    half = (1 << shift) >> 1;
+
+    for (y = 0; y < height; y += 2) {
+        uint8_t *u = p_outpic->data[1] + ((y >> 1) * p_outpic->linesize[1]);
+        uint8_t *v = p_outpic->data[2] + ((y >> 1) * p_outpic->linesize[2]);
+
+        for (x = 0; x < width; x += 2) {
+            int su = 0, sv = 0;
+
+            for (dy = 0; dy < 2; dy++) {
+                const uint8_t *row = (const uint8_t *) image->data +
+                    ((y + dy) * n * image->bytes_per_line);
+                uint8_t *out_y = p_outpic->data[0] +
+                    ((y + dy) * p_outpic->linesize[0]) + x;
+
+                for (dx = 0; dx < 2; dx++) {
+                    const uint8_t *block = row + ((x + dx) * n * bpp);
+                    int sr = 0, sg = 0, sb = 0, yy, uu, vv;
+
+                    for (j = 0; j < n; j++) {
+                        const uint8_t *p = block + (j * image->bytes_per_line);
+
+                        for (i = 0; i < n; i++, p += bpp) {
+                            sr += p[ro];
+                            sg += p[go];
+                            sb += p[bo];
+                        }
+                    }
+                    rgb_to_yuv ((sr + half) >> shift, (sg + half) >> shift,
+                                (sb + half) >> shift, full_range, &yy, &uu,
+                                &vv);
+                    out_y[dx] = yy;
+                    su += uu;
+                    sv += vv;
+                }
+            }
+            *u++ = (su + 2) >> 2;
+            *v++ = (sv + 2) >> 2;
+        }
+    }
+}
+
+/**
+ * \brief convert only the rows of the input picture that changed
+ *
+ * The band from the first to the last row touched by the damaged region is
+ * converted as a picture of its own, because libswscale only takes slices
+ * of a frame in order from its top. The band is widened by a margin for
+ * the vertical chroma filter to see the same rows as when converting the
+ * whole frame, and rounded up to DAMAGE_BAND_ROWS to reuse a converter for
+ * bands of about the same height. It is converted to damage_pic, and only
+ * the damaged rows, aligned to the vertical chroma subsampling, are copied
+ * to p_outpic, the rest of p_outpic keeps the picture of the previous frame.
+ *
+ * @param region the damaged region in capture area coordinates
+ * @param width the width of the (cropped) input picture
+ * @param height the height of the (cropped) input picture
+ * @return the number of rows converted or -1 on error
+ */
+static int
+convert_damaged_rows (Region region, int width, int height)
+{
+    AVCodecContext *c = out_st->codec;
+    AVPicture src, dst;
+    int i, h_shift, v_shift, align, y1, y2, band_y, band_h, band;
+
+    if (region->numRects == 0)
+        return 0;
+
+    avcodec_get_chroma_sub_sample (c->pix_fmt, &h_shift, &v_shift);
+    align = 1 << v_shift;
+
+    y1 = XVC_MIN (region->extents.y1, region->extents.y2) -
+        vid_out_st->topBand;
+    y2 = XVC_MAX (region->extents.y1, region->extents.y2) -
+        vid_out_st->topBand;
+    y1 = XVC_MAX (y1, 0) & ~(align - 1);
+    y2 = XVC_MIN ((y2 + align - 1) & ~(align - 1), height);
+    if (y2 <= y1)
+        return 0;
+
+    band = (y2 - y1 + 2 * DAMAGE_MARGIN_ROWS + DAMAGE_BAND_ROWS - 1) /
+        DAMAGE_BAND_ROWS;
+    band_h = band * DAMAGE_BAND_ROWS;
+    // the band would be most of the frame anyway
+    if (band_h >= height) {
+        if (sws_scale (img_resample_ctx, p_inpic->data, p_inpic->linesize,
+                       0, height, p_outpic->data, p_outpic->linesize) < 0)
+            return -1;
+        return height;
+    }
+    band_y = XVC_MAX (y1 - DAMAGE_MARGIN_ROWS, 0) & ~(align - 1);
+    band_y = XVC_MIN (band_y, (height - band_h) & ~(align - 1));
+
+    if (!damage_pic.data[0]) {
+        damage_nb_ctx = height / DAMAGE_BAND_ROWS + 1;
+        damage_ctx = av_mallocz (damage_nb_ctx * sizeof (*damage_ctx));
+        if (!damage_ctx ||
+            avpicture_alloc (&damage_pic, c->pix_fmt, width, height) < 0)
+            return -1;
+    }
+    damage_ctx[band] = sws_getCachedContext (damage_ctx[band], width,
+                                             band_h, input_pixfmt, width,
+                                             band_h, c->pix_fmt, 1, NULL,
+                                             NULL, NULL);
+    if (!damage_ctx[band])
+        return -1;
+
+    // only the first input plane holds pixels, pal8's second one the
+    // palette
+    for (i = 0; i < 4; i++) {
+        src.data[i] = p_inpic->data[i];
+        src.linesize[i] = p_inpic->linesize[i];
+    }
+    src.data[0] += band_y * p_inpic->linesize[0];
+    for (i = 0; i < 4; i++) {
+        dst.data[i] = damage_pic.data[i];
+        dst.linesize[i] = damage_pic.linesize[i];
+        if (dst.data[i])
+            dst.data[i] += ((i == 1 || i == 2) ? band_y >> v_shift : band_y) *
+                dst.linesize[i];
+    }
+    if (sws_scale (damage_ctx[band], src.data, src.linesize, 0, band_h,
+                   dst.data, dst.linesize) < 0)
+        return -1;
+
+    // the rows converted beyond the damage are only what the chroma filter
+    // saw, the previous frame's rows are still right there
+    for (i = 0; i < 4; i++) {
+        int rows = (i == 1 || i == 2) ? y1 >> v_shift : y1;
+
+        src.data[i] = damage_pic.data[i];
+        src.linesize[i] = damage_pic.linesize[i];
+        dst.data[i] = p_outpic->data[i];
+        dst.linesize[i] = p_outpic->linesize[i];
+        if (src.data[i]) {
+            src.data[i] += rows * src.linesize[i];
+            dst.data[i] += rows * dst.linesize[i];
+        }
+    }
+    av_picture_copy (&dst, &src, c->pix_fmt, width, y2 - y1);
+
+    return band_h;
+}
+
+/**
+ * \brief prepare the color table for pseudo color input to libavcodec's
+ *      imgconvert
+ *
+ * I'm downsampling the 16 bit color entries to 8 bit as it expects
+ * 32 bit (=4 * 8) from looking at imgconvert_template.c I'd say libavcodec
+ * expects argb logically, not byte-wise
+ * @param colors a pointer to the colors as contained in the captured XImage
+ * @param ncolors the number of colors present
+ * @return a pointer to the converted color table
+ */
+u_int32_t *
+xvc_ffmpeg_get_color_table (XColor * colors, int ncolors)
+{
+    u_int32_t *color_table, *pixel;
+    int i; // , n;
+
+
+    color_table = malloc (256 * 4);
+    if (!color_table)
+        return (NULL);
+
+    pixel = color_table;
+    for (i = 0; i < ncolors; i++) {
+        u_int32_t color_table_entry, swap;
+
+        color_table_entry = 0;
+        // alpha alway zero
+
+        swap = colors[i].red;
+        swap &= 0x0000FF00;            // color is 16 bits, delete ls 8 bits
+        swap <<= 8;                    // then shift ms 8 bits into position
+        color_table_entry = (color_table_entry | swap);
+
+        swap = colors[i].green;
+        swap &= 0x0000FF00;            /* color is 16 bits, ms 8 bits already
+                                        * in position, delete ls 8 bits */
+        color_table_entry = (color_table_entry | swap);
+
+        swap = colors[i].blue;
+        swap >>= 8;
+        color_table_entry = (color_table_entry | swap);
+
+        *pixel = color_table_entry;
+        pixel++;
+    }
+
+    return color_table;
+}
+
+/**
+ * \brief prepare the output file or pipe
+ *
+ * need to determine which first and do things like making the filename
+ * absolute etc.
+ * @param jFileName the filename as contained in the current job
+ * @param oc output format context (output_file)
+ * @param number the movie number
+ */
+static void
+prepareOutputFile (char *jFileName, AVFormatContext * oc, int number)
+{
+    // prepare output file for format context
+    if ((strcasecmp (jFileName, "-") == 0)
+        || (strcasecmp (jFileName, "pipe:") == 0)) {
+        jFileName = "pipe:";
+        snprintf (oc->filename, sizeof (oc->filename), "pipe:");
+        // register_protocol (&pipe_protocol);
+    } else {
+        char first;
+        char tmp_buf[PATH_MAX + 1];
+
+        first = jFileName[0];
+        sprintf (tmp_buf, jFileName, number);
+
+        // if the filename's first char is a / we have an absolute path
+        // and we want one for the file URL. If we don't have one, we
+        // construct one
+        if (first != '/') {
+            sprintf (oc->filename, "file://%s/%s", getenv ("PWD"), tmp_buf);
+        } else {
+            sprintf (oc->filename, "file://%s", tmp_buf);
+        }
+        // register_protocol (&file_protocol);
+    }
+}
+
+/**
+ * \brief get the number of pixels the frame dimensions should be a multiple
+ *      of for the video encoder
+ *
+ * Macroblock based codecs encode incomplete macroblocks at the right and
+ * bottom edges anyway, they just cost bits and are hidden again on decoding.
+ * Other codecs only need the chroma subsampling of the picture format to fit.
+ * @param c the codec context of the video output stream with the pix_fmt set
+ * @param multi_frame TRUE if capturing to a movie rather than individual
+ *      frames, individual frames should keep their size
+ * @return the alignment in pixels
+ */
+static int
+get_codec_alignment (const AVCodecContext * c, int multi_frame)
+{
+    int h_shift = 0, v_shift = 0;
+
+    if (multi_frame) {
+        switch (c->codec_id) {
+        case CODEC_ID_MPEG1VIDEO:
+        case CODEC_ID_MPEG2VIDEO:
+        case CODEC_ID_MPEG4:
+        case CODEC_ID_MSMPEG4V2:
+        case CODEC_ID_MSMPEG4V3:
+        case CODEC_ID_FLV1:
+        case CODEC_ID_H264:
+        case CODEC_ID_MJPEG:
+        case CODEC_ID_THEORA:
+        case CODEC_ID_SVQ1:
+            return 16;
+        default:
+            break;
+        }
+    }
+
+    avcodec_get_chroma_sub_sample (c->pix_fmt, &h_shift, &v_shift);
+    return 1 << XVC_MAX (h_shift, v_shift);
+}
+
+/**
+ * \brief fit the picture to the frame dimensions the video encoder wants
+ *
+ * If the picture is off by no more than half the alignment it is cropped
+ * symmetrically, otherwise the right and bottom edges are padded up to the
+ * next multiple. Cropping is done by moving the input plane pointers and
+ * padding by leaving the edge of the output frame alone, so neither needs a
+ * copy of the frame. The geometry is stored in ost, the frame dimensions
+ * are set in the codec context.
+ * @param ost the output stream to store the cropping and padding in
+ * @param c the codec context of the video output stream with the pix_fmt set
+ * @param width width of the picture to encode
+ * @param height height of the picture to encode
+ * @param may_crop FALSE if the picture is going to be rescaled, because crop
+ *      bands are applied to the captured image
+ * @param align the alignment as returned by get_codec_alignment()
+ */
+static void
+set_video_geometry (AVOutputStream * ost, AVCodecContext * c, int width,
+                    int height, int may_crop, int align)
+{
+    int w_rem = width % align, h_rem = height % align;
+
+    ost->leftBand = ost->rightBand = 0;
+    ost->topBand = ost->bottomBand = 0;
+    ost->padleft = ost->padright = 0;
+    ost->padtop = ost->padbottom = 0;
+
+    if (w_rem > 0) {
+        if (may_crop && w_rem <= align / 2 && width > w_rem) {
+            ost->leftBand = w_rem / 2;
+            ost->rightBand = w_rem - ost->leftBand;
+        } else {
+            ost->padright = align - w_rem;
+        }
+    }
+    if (h_rem > 0) {
+        if (may_crop && h_rem <= align / 2 && height > h_rem) {
+            ost->topBand = h_rem / 2;
+            ost->bottomBand = h_rem - ost->topBand;
+        } else {
+            ost->padbottom = align - h_rem;
+        }
+    }
+    ost->video_crop = (ost->leftBand || ost->rightBand ||
+                       ost->topBand || ost->bottomBand);
+    ost->video_pad = (ost->padright || ost->padbottom);
+
+    c->width = width - ost->leftBand - ost->rightBand +
+        ost->padright;
+    c->height = height - ost->topBand - ost->bottomBand +
+        ost->padbottom;
+}
+
+/**
+ * \brief fill a picture with black
+ *
+ * This is done once for the output frame, so the padding added by
+ * set_video_geometry() is black. Afterwards only the picture inside the
+ * padding is written.
+ * @param pic the picture to clear
+ * @param pix_fmt the picture format of pic
+ * @param height the height of pic
+ */
+static void
+clear_picture (AVFrame * pic, int pix_fmt, int height)
+{
+    int h_shift = 0, v_shift = 0, i;
+
+    switch (pix_fmt) {
+    case PIX_FMT_YUV420P:
+    case PIX_FMT_YUV422P:
+    case PIX_FMT_YUV444P:
+    case PIX_FMT_YUV411P:
+    case PIX_FMT_YUV410P:
+    case PIX_FMT_YUVJ420P:
+    case PIX_FMT_YUVJ422P:
+    case PIX_FMT_YUVJ444P:
+        avcodec_get_chroma_sub_sample (pix_fmt, &h_shift, &v_shift);
+        // the jpeg formats use the full range
+        memset (pic->data[0], (pix_fmt == PIX_FMT_YUVJ420P ||
+                               pix_fmt == PIX_FMT_YUVJ422P ||
+                               pix_fmt == PIX_FMT_YUVJ444P) ? 0 : 16,
+                pic->linesize[0] * height);
+        for (i = 1; i < 3; i++)
+            memset (pic->data[i], 128,
+                    pic->linesize[i] * (-((-height) >> v_shift)));
+        break;
+    default:
+        // packed rgb and the like
+        memset (pic->data[0], 0, pic->linesize[0] * height);
+    }
+}
+
+/**
+ * \brief determine the number of threads to encode with
+ *
+ * Only codecs with a threaded encoding path in libavcodec get more than one
+ * thread, i. e. the slice threaded mpegvideo encoders, DV, which encodes its
+ * segments through avctx->execute, and libx264, which runs its own frame
+ * threads. Everything else refuses a thread count above one or ignores it.
+ *
+ * @param c codec context with codec_id and height already set
+ * @param requested number of threads requested, 0 meaning one per online
+ *      processor
+ * @return the number of threads to pass to avcodec_thread_init
+ */
+static int
+get_codec_threads (AVCodecContext * c, int requested)
+{
+    int threads = requested;
+
+    if (threads <= 0) {
+        long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+        threads = (cpus > 0) ? (int) cpus : 1;
+    }
+    threads = XVC_MIN (threads, XVC_MAX_THREADS);
+
+    switch (c->codec_id) {
+    case CODEC_ID_MPEG4:
+    case CODEC_ID_MPEG1VIDEO:
+    case CODEC_ID_MPEG2VIDEO:
+        // ffmpeg's mpegvideo.c wants at most MAX_THREADS (16) threads and
+        // at least one macroblock row per thread
+        threads = XVC_MIN (threads, XVC_MIN (16, (c->height + 15) / 16));
+        break;
+    case CODEC_ID_DVVIDEO:
+    case CODEC_ID_H264:
+        break;
+    default:
+        threads = 1;
+        break;
+    }
+
+    return XVC_MAX (threads, 1);
+}
+
+/**
+ * \brief adapt the encoder speed to the time available per frame
+ *
+ * About once per second the average time the last frames took to capture
+ * and save is compared to the time per frame. If we are behind, the
+ * encoder moves one step down the speed_ladder. If the frames take less than
+ * 60% of the time available, it moves one step back up. Every change is
+ * logged.
+ *
+ * @param c the codec context of the video stream
+ * @param job pointer to the current job
+ */
+static void
+adapt_encoder_speed (AVCodecContext * c, Job * job)
+{
+    int window, level = speed_level, mb_decision, me_subpel_quality;
+    long avg;
+
+    if (!speed_adapt || job->frame_time <= 0 || job->time_per_frame <= 0)
+        return;
+
+    speed_time += job->frame_time;
+    speed_frames++;
+    window = XVC_MAX (1000 / job->time_per_frame, 5);
+    if (speed_frames < window)
+        return;
+
+    avg = speed_time / speed_frames;
+    speed_time = 0;
+    speed_frames = 0;
+
+    if (avg > job->time_per_frame && level < NUM_SPEED_STEPS - 1)
+        level++;
+    else if (avg * 10 < job->time_per_frame * 6 && level > 0)
+        level--;
+    if (level == speed_level)
+        return;
+
+    speed_level = level;
+    mb_decision = XVC_MIN (speed_base->mb_decision,
+                           speed_ladder[level].mb_decision);
+    me_subpel_quality = XVC_MIN (speed_base->me_subpel_quality,
+                                 speed_ladder[level].me_subpel_quality);
+    // the profile may be cheaper than this step already
+    if (mb_decision == c->mb_decision &&
+        me_subpel_quality == c->me_subpel_quality)
+        return;
+
+    c->mb_decision = mb_decision;
+    c->me_subpel_quality = me_subpel_quality;
+    fprintf (stderr,
+             _("frames take %li msecs (%i available), switching encoder to %s\n"),
+             avg, job->time_per_frame, speed_ladder[level].name);
+}
+
+/**
+ * \brief get the number of packets waiting for the muxer thread
+ *
+ * @return the number of packets in the fullest queue
+ */
+static int
+mux_backlog ()
+{
+    int i, fill, backlog = 0;
+
+    if (!mux_running)
+        return 0;
+    for (i = 0; i < mux_nb_queues; i++) {
+        fill = mux_queues[i].tail - mux_queues[i].head;
+        backlog = XVC_MAX (backlog, fill);
+    }
+
+    return backlog;
+}
+
+/**
+ * \brief lower the quality of the video encoders to a backlog level
+ *
+ * With a fixed quality the encoders take the qscale from qmin and qmax,
+ * which they look at for every frame. The gop encoders copy the settings
+ * of out_st when they start a gop.
+ */
+static void
+set_backlog_quality ()
+{
+    int i, qmin;
+
+    qmin = XVC_MIN (backlog_qmin + backlog_level * BACKLOG_QSCALE_STEP, 31);
+    for (i = 0; i < output_file->nb_streams; i++) {
+        AVCodecContext *c = output_file->streams[i]->codec;
+
+        if (c->codec_type != CODEC_TYPE_VIDEO)
+            continue;
+        c->qmin = qmin;
+        c->qmax = XVC_MAX (backlog_qmax, qmin);
+    }
+}
+
+/**
+ * \brief keep the packets waiting for the disk from piling up
+ *
+ * About once per second the number of packets waiting for the muxer thread
+ * is looked at. While it grows beyond BACKLOG_HIGH the quality of the video
+ * is lowered by a step, which makes the packets smaller, and once it is
+ * down to BACKLOG_LOW the quality goes back up by a step. Should the
+ * backlog reach BACKLOG_DROP, every other frame is dropped until it is
+ * below BACKLOG_HIGH again, provided the video stream can have gaps.
+ * Starting to lower the quality, dropping frames and recovering are
+ * reported as errors.
+ *
+ * @param job pointer to the current job
+ * @return TRUE if the current frame is to be dropped
+ */
+static int
+adapt_to_backlog (Job * job)
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+    int backlog = mux_backlog (), level = backlog_level, window;
+
+    if (!backlog_dropping && pts_gaps && backlog >= BACKLOG_DROP) {
+        backlog_dropping = TRUE;
+        xvc_error_write_msg (54, 1);
+    } else if (backlog_dropping && backlog < BACKLOG_HIGH) {
+        backlog_dropping = FALSE;
+    }
+
+    window = (job->time_per_frame > 0 ?
+              XVC_MAX (1000 / job->time_per_frame, 5) : 25);
+    if (++backlog_frames >= window) {
+        backlog_frames = 0;
+        if (backlog >= BACKLOG_HIGH && level < MAX_BACKLOG_LEVEL)
+            level++;
+        else if (backlog <= BACKLOG_LOW && level > 0)
+            level--;
+    }
+    if (level != backlog_level) {
+        if (backlog_level == 0)
+            xvc_error_write_msg (53, 1);
+        else if (level == 0)
+            xvc_error_write_msg (55, 0);
+        backlog_level = level;
+        backlog_max_level = XVC_MAX (backlog_max_level, level);
+        set_backlog_quality ();
+        if (app->verbose)
+            printf ("storage backlog of %i packets, quality lowered by %i steps\n",
+                    backlog, level);
+    }
+
+    if (!backlog_dropping)
+        return FALSE;
+    backlog_drop_next = !backlog_drop_next;
+    return backlog_drop_next;
+}
+
+/**
+ * \brief open an encoder for one gop with the settings of the video stream
+ *
+ * @return the opened codec context
+ */
+static AVCodecContext *
+open_gop_codec ()
+{
+    AVCodecContext *c = avcodec_alloc_context ();
+    const AVCodecContext *t = out_st->codec;
+
+    if (!c) {
+        fprintf (stderr, _("Could not alloc gop encoder\n"));
+        exit (1);
+    }
+    c->codec_id = t->codec_id;
+    c->codec_type = t->codec_type;
+    c->codec_tag = t->codec_tag;
+    c->width = t->width;
+    c->height = t->height;
+    c->pix_fmt = t->pix_fmt;
+    c->sample_aspect_ratio = t->sample_aspect_ratio;
+    c->time_base = t->time_base;
+    // every gop starts with an intra frame of its own encoder anyway
+    c->gop_size = gop_length;
+    c->max_b_frames = t->max_b_frames;
+    c->me_method = t->me_method;
+    c->mb_decision = t->mb_decision;
+    c->me_subpel_quality = t->me_subpel_quality;
+    c->trellis = t->trellis;
+    c->flags = t->flags | CODEC_FLAG_CLOSED_GOP;
+    c->flags2 = t->flags2;
+    c->global_quality = t->global_quality;
+    c->qmin = t->qmin;
+    c->qmax = t->qmax;
+
+    pthread_mutex_lock (&gop_codec_mutex);
+    if (avcodec_open (c, codec) < 0) {
+        fprintf (stderr, _("Could not open video codec\n"));
+        exit (1);
+    }
+    pthread_mutex_unlock (&gop_codec_mutex);
+
+    return c;
+}
+
+/**
+ * \brief close and free an encoder opened by open_gop_codec()
+ *
+ * @param c the codec context
+ */
+static void
+close_gop_codec (AVCodecContext * c)
+{
+    pthread_mutex_lock (&gop_codec_mutex);
+    avcodec_close (c);
+    pthread_mutex_unlock (&gop_codec_mutex);
+    av_free (c);
+}
+
+/**
+ * \brief keep an encoded packet until its gop is written
+ *
+ * @param enc the encoder instance
+ * @param c its codec context
+ * @param size size of the data encoded into enc->outbuf
+ */
+static void
+add_gop_packet (XVC_GopEncoder * enc, AVCodecContext * c, int size)
+{
+    XVC_GopPacket *pkt = av_mallocz (sizeof (XVC_GopPacket));
+
+    if (pkt)
+        pkt->data = av_malloc (size);
+    if (!pkt || !pkt->data) {
+        fprintf (stderr, _("Could not allocate buffer for encoded frame (outbuf)! ... aborting\n"));
+        exit (1);
+    }
+    memcpy (pkt->data, enc->outbuf, size);
+    pkt->size = size;
+    pkt->pts = (c->coded_frame ? c->coded_frame->pts : AV_NOPTS_VALUE);
+    pkt->key = (c->coded_frame && c->coded_frame->key_frame);
+
+    *(enc->tail) = pkt;
+    enc->tail = &(pkt->next);
+}
+
+/**
+ * \brief the thread of an encoder instance for parallel gop encoding
+ *
+ * It encodes the pictures of a gop as they are queued, opening a new
+ * encoder for every gop, and flushes the encoder at the end of the gop.
+ *
+ * @param enc the encoder instance
+ */
+static void
+gop_encoder_thread (XVC_GopEncoder * enc)
+{
+    AVCodecContext *c = NULL;
+
+    pthread_mutex_lock (&enc->mutex);
+    while (!enc->stop) {
+        struct timeval start, end;
+        int size;
+
+        if (enc->encoded < enc->queued) {
+            AVFrame *pic = enc->frames[enc->encoded];
+
+            pthread_mutex_unlock (&enc->mutex);
+            gettimeofday (&start, NULL);
+            if (!c)
+                c = open_gop_codec ();
+            size = avcodec_encode_video (c, enc->outbuf, outbuf_size, pic);
+            if (size < 0) {
+                fprintf (stderr,
+                         _
+                         ("error encoding frame: c %p, outbuf %p, size %i, frame %p\n"),
+                         c, enc->outbuf, outbuf_size, pic);
+                exit (1);
+            }
+            if (size > 0)
+                add_gop_packet (enc, c, size);
+            gettimeofday (&end, NULL);
+            pthread_mutex_lock (&enc->mutex);
+            enc->busy_usecs += (end.tv_sec - start.tv_sec) * 1000000 +
+                (end.tv_usec - start.tv_usec);
+            enc->encoded++;
+        } else if (enc->gop_end && !enc->done) {
+            pthread_mutex_unlock (&enc->mutex);
+            gettimeofday (&start, NULL);
+            // the frames held back for B-frames
+            if (c) {
+                while ((size = avcodec_encode_video (c, enc->outbuf,
+                                                     outbuf_size, NULL)) > 0)
+                    add_gop_packet (enc, c, size);
+                close_gop_codec (c);
+                c = NULL;
+            }
+            gettimeofday (&end, NULL);
+            pthread_mutex_lock (&enc->mutex);
+            enc->busy_usecs += (end.tv_sec - start.tv_sec) * 1000000 +
+                (end.tv_usec - start.tv_usec);
+            enc->done = TRUE;
+            pthread_cond_broadcast (&enc->cond);
+        } else {
+            pthread_cond_wait (&enc->cond, &enc->mutex);
+        }
+    }
+    pthread_mutex_unlock (&enc->mutex);
+
+    if (c)
+        close_gop_codec (c);
+    pthread_exit (NULL);
+}
+
+/**
+ * \brief start the encoder instances for parallel gop encoding
+ */
+static void
+start_gop_encoders ()
+{
+    int i;
+
+    gop_enc = av_mallocz (gop_encoders * sizeof (XVC_GopEncoder));
+    if (!gop_enc) {
+        fprintf (stderr, _("Could not alloc gop encoder\n"));
+        exit (1);
+    }
+    gop_no = 0;
+    gop_frame = 0;
+    gop_written = 0;
 
-    pdata = image->data;
+    for (i = 0; i < gop_encoders; i++) {
+        XVC_GopEncoder *enc = &gop_enc[i];
 
-    for (counter = pdata;
-         counter < (pdata + (image->width * image->height * 4)); counter += 4) {
-        char swap;
+        enc->frames = av_mallocz (gop_length * sizeof (AVFrame *));
+        enc->outbuf = malloc (outbuf_size);
+        if (!enc->frames || !enc->outbuf) {
+            fprintf (stderr, _("Could not alloc gop encoder\n"));
+            exit (1);
+        }
+        enc->tail = &(enc->packets);
+        // nothing to write for the gop before the first one
+        enc->done = TRUE;
+        pthread_mutex_init (&enc->mutex, NULL);
+        pthread_cond_init (&enc->cond, NULL);
+        if (pthread_create (&enc->thread, NULL, (void *) gop_encoder_thread,
+                            enc) != 0) {
+            fprintf (stderr, _("Could not start gop encoder thread\n"));
+            exit (1);
+        }
+    }
+}
+
+/**
+ * \brief write the next gop in order once it is encoded
+ *
+ * @param wait TRUE to wait for the gop to be encoded
+ * @param deadline time to give up waiting at, NULL to wait as long as it
+ *      takes
+ * @return TRUE if a gop was written
+ */
+static int
+write_next_gop (int wait, const struct timespec *deadline)
+{
+    XVC_GopEncoder *enc = &gop_enc[gop_written % gop_encoders];
+    XVC_GopPacket *pkt;
+    int ret = 0, done;
+
+    // the current gop is still being queued
+    if (gop_written >= gop_no)
+        return FALSE;
+
+    pthread_mutex_lock (&enc->mutex);
+    while (!enc->done && wait && ret != ETIMEDOUT) {
+        if (deadline)
+            ret = pthread_cond_timedwait (&enc->cond, &enc->mutex, deadline);
+        else
+            pthread_cond_wait (&enc->cond, &enc->mutex);
+    }
+    done = enc->done;
+    pthread_mutex_unlock (&enc->mutex);
+    if (!done)
+        return FALSE;
+
+    while ((pkt = enc->packets) != NULL) {
+        write_video_packet (output_file, out_st, pkt->data, pkt->size,
+                            pkt->pts, pkt->key);
+        enc->packets = pkt->next;
+        av_free (pkt->data);
+        av_free (pkt);
+    }
+    enc->tail = &(enc->packets);
+    gop_written++;
+
+    return TRUE;
+}
+
+/**
+ * \brief check if the next picture has a gop encoder instance to go to
+ *
+ * Before the first picture of a gop goes to an instance, the gop it had
+ * before must have been written. Gops finished by now are written out, but
+ * this never waits for an instance still encoding.
+ *
+ * @return TRUE if the next picture can be queued without waiting
+ */
+static int
+gop_encoder_free ()
+{
+    while (gop_written + gop_encoders <= gop_no &&
+           write_next_gop (FALSE, NULL));
+    return (gop_frame > 0 || gop_written + gop_encoders > gop_no);
+}
+
+/**
+ * \brief queue a picture for parallel gop encoding
+ *
+ * The picture is copied to the encoder instance of its gop. Before the
+ * first picture of a gop goes to an instance, the gop it had before must
+ * have been written. The capture checks with gop_encoder_free () first and
+ * drops the frame instead, only the last picture repeated when stopping
+ * waits here. Gops finished in the meantime are written out.
+ *
+ * @param pic the picture to encode with pts and pict_type set
+ */
+static void
+queue_gop_frame (const AVFrame * pic)
+{
+    XVC_GopEncoder *enc = &gop_enc[gop_no % gop_encoders];
+    AVCodecContext *c = out_st->codec;
+    AVFrame *f;
+
+    if (gop_frame == 0) {
+        while (gop_written + gop_encoders <= gop_no)
+            write_next_gop (TRUE, NULL);
+        if (gop_no == 0)
+            gettimeofday (&gop_start, NULL);
+
+        pthread_mutex_lock (&enc->mutex);
+        enc->queued = 0;
+        enc->encoded = 0;
+        enc->gop_end = FALSE;
+        enc->done = FALSE;
+        pthread_mutex_unlock (&enc->mutex);
+    }
 
-        if (image->byte_order) {       // MSBFirst has order argb -> abgr
-            // = rgba32
-            swap = *(counter + 1);
-            *(counter + 1) = *(counter + 3);
-            *(counter + 3) = swap;
-        } else {                       // LSBFirst has order bgra -> rgba
-            swap = *counter;
-            *counter = *(counter + 2);
-            *(counter + 2) = swap;
+    f = enc->frames[gop_frame];
+    if (!f) {
+        f = avcodec_alloc_frame ();
+        if (!f || avpicture_alloc ((AVPicture *) f, c->pix_fmt, c->width,
+                                   c->height) < 0) {
+            fprintf (stderr, _("Could not allocate buffer for output frame! ... aborting\n"));
+            exit (1);
         }
+        enc->frames[gop_frame] = f;
+    }
+    av_picture_copy ((AVPicture *) f, (const AVPicture *) pic, c->pix_fmt,
+                     c->width, c->height);
+    f->pts = pic->pts;
+    f->pict_type = pic->pict_type;
+
+    pthread_mutex_lock (&enc->mutex);
+    enc->queued++;
+    if (++gop_frame == gop_length) {
+        enc->gop_end = TRUE;
+        gop_frame = 0;
+        gop_no++;
     }
+    pthread_cond_broadcast (&enc->cond);
+    pthread_mutex_unlock (&enc->mutex);
 
+    while (write_next_gop (FALSE, NULL));
 }
 
 /**
- * \brief convert pal8 to rgba32
+ * \brief end the last gop, write what the encoder instances finish by the
+ *      deadline and stop them
  *
- * libswscale does not support pal8 input atm
- * @param image the XImage to convert
- * @param p_inpic pointer to a frame to where the converted output is written
- * @param job the current job
- * \todo very current ffmpeg versions seem to make this unneccessary
+ * @param deadline time to stop waiting for the encoder instances at
  */
 static void
-myPAL8toRGB24 (XImage * image, AVFrame * p_inpic, Job * job)
+stop_gop_encoders (const struct timespec *deadline)
 {
-    u_int32_t *color_table = job->color_table;
-    int y = 0, x = 0;
-    uint8_t *out_cursor = NULL;
-    uint8_t *out = (uint8_t *) p_inpic->data[0];
+    XVC_AppData *app = xvc_appdata_ptr ();
+    long busy_usecs = 0;
+    int i, j, frames = gop_no * gop_length + gop_frame;
+
+    if (gop_frame > 0) {
+        XVC_GopEncoder *enc = &gop_enc[gop_no % gop_encoders];
+
+        pthread_mutex_lock (&enc->mutex);
+        enc->gop_end = TRUE;
+        pthread_cond_broadcast (&enc->cond);
+        pthread_mutex_unlock (&enc->mutex);
+        gop_frame = 0;
+        gop_no++;
+    }
+    while (write_next_gop (TRUE, deadline));
+    if (gop_written < gop_no) {
+        fprintf (stderr,
+                 _("Stopping took too long, %i gops still being encoded are lost\n"),
+                 gop_no - gop_written);
+    }
 
-    /**
-     * 8bit pseudo-color images may have lines padded by excess bytes
-     * these need to be removed before conversion
-     * \todo other formats might also have this problem
-     */
-    for (y = 0; y < image->height; y++) {
-        out_cursor = (uint8_t *) image->data + (y * image->bytes_per_line);
-        for (x = 0; x < image->width; x++) {
-            *out++ = ((color_table[*out_cursor] & 0x00FF0000) >> 16);
-            *out++ = ((color_table[*out_cursor] & 0x0000FF00) >> 8);
-            *out++ = (color_table[*out_cursor] & 0x000000FF);
-            out_cursor++;
+    for (i = 0; i < gop_encoders; i++) {
+        XVC_GopEncoder *enc = &gop_enc[i];
+        XVC_GopPacket *pkt;
+
+        pthread_mutex_lock (&enc->mutex);
+        enc->stop = TRUE;
+        pthread_cond_broadcast (&enc->cond);
+        pthread_mutex_unlock (&enc->mutex);
+        pthread_join (enc->thread, NULL);
+        pthread_mutex_destroy (&enc->mutex);
+        pthread_cond_destroy (&enc->cond);
+
+        busy_usecs += enc->busy_usecs;
+        while ((pkt = enc->packets) != NULL) {
+            enc->packets = pkt->next;
+            av_free (pkt->data);
+            av_free (pkt);
         }
+        for (j = 0; j < gop_length; j++) {
+            if (enc->frames[j]) {
+                avpicture_free ((AVPicture *) enc->frames[j]);
+                av_free (enc->frames[j]);
+            }
+        }
+        av_free (enc->frames);
+        free (enc->outbuf);
+    }
+
+    if (app->verbose && frames > 0) {
+        long wall_usecs = msecs_since (&gop_start) * 1000;
+
+        printf ("parallel gop encoding: %i encoders, %i gops of %i frames, %li usecs encoding per frame, %.1f encoders busy on average\n",
+                gop_encoders, gop_no, gop_length, busy_usecs / frames,
+                (wall_usecs > 0 ? (double) busy_usecs / wall_usecs : 0.0));
     }
+
+    av_free (gop_enc);
+    gop_enc = NULL;
+    gop_no = 0;
+    gop_frame = 0;
+    gop_written = 0;
 }
 
 /**
- * \brief prepare the color table for pseudo color input to libavcodec's
- *      imgconvert
+ * \brief add a video output stream to the output format
  *
- * I'm downsampling the 16 bit color entries to 8 bit as it expects
- * 32 bit (=4 * 8) from looking at imgconvert_template.c I'd say libavcodec
- * expects argb logically, not byte-wise
- * @param colors a pointer to the colors as contained in the captured XImage
- * @param ncolors the number of colors present
- * @return a pointer to the converted color table
+ * @param oc output format context (output_file)
+ * @param in_width width of the captured picture (or tile) to encode
+ * @param in_height height of the captured picture (or tile) to encode
+ * @param input_pixfmt picture format of the input picture
+ * @param codec_id libavcodec's codec id of the codec to use for encoding
+ * @param job pointer to the current job
+ * @param ost where the cropping and padding of the picture (or tile) go
+ * @return pointer to the AVStream that has been added to the output format
  */
-u_int32_t *
-xvc_ffmpeg_get_color_table (XColor * colors, int ncolors)
+static AVStream *
+add_video_stream (AVFormatContext * oc, int in_width, int in_height,
+                  int input_pixfmt, int codec_id, Job * job,
+                  AVOutputStream * ost)
 {
-    u_int32_t *color_table, *pixel;
-    int i; // , n;
+    AVStream *st;
+    int pix_fmt_mask = 0, i = 0;
+    int quality = target->quality, qscale = 0;
+    int width, height, rescaled = FALSE;
+    XVC_AppData *app = xvc_appdata_ptr ();
+    const XVC_CodecProfile *prof =
+        xvc_get_codec_profile (job->targetCodec, app->profile);
 
 
-    color_table = malloc (256 * 4);
-    if (!color_table)
-        return (NULL);
+    st = av_new_stream (oc, 0);
+    if (! st) {
+        fprintf (stderr, _("Could not alloc output stream\n"));
+        exit (1);
+    }
 
-    pixel = color_table;
-    for (i = 0; i < ncolors; i++) {
-        u_int32_t color_table_entry, swap;
+    st->codec->codec_id = codec_id;
+    st->codec->codec_type = CODEC_TYPE_VIDEO;
 
-        color_table_entry = 0;
-        // alpha alway zero
+    // find the video encoder
+    codec = avcodec_find_encoder (st->codec->codec_id);
+    if (!codec) {
+        fprintf (stderr, _("Video codec not found\n"));
+        exit (1);
+    }
+    // put sample parameters
+    // the picture to encode has the capture size unless rescaled, the
+    // frame dimensions are fitted to the codec below
+    // with the xrender source the X server has scaled the image already
+    if (app->rescale != 100 && !(job->flags & FLG_USE_XRENDER)) {
+        double r = xvc_appdata_get_rescale_factor (app);
+
+        // snapped to the closest of 1, 1/2, 1/4, or 1/8 which can be scaled
+        // down by a fast box filter
+        if (app->verbose && (app->flags & FLG_RESCALE_SNAP))
+            printf ("rescale of %i%% snapped to 1/%i\n", app->rescale,
+                    (int) (1.0 / r + 0.5));
+
+        // rescaled dimensions are kept even for the box filter
+        width = ((int) (in_width * r)) & ~1;
+        height = ((int) (in_height * r)) & ~1;
+        rescaled = TRUE;
+    } else {
+        width = in_width;
+        height = in_height;
+    }
 
-        swap = colors[i].red;
-        swap &= 0x0000FF00;            // color is 16 bits, delete ls 8 bits
-        swap <<= 8;                    // then shift ms 8 bits into position
-        color_table_entry = (color_table_entry | swap);
+    // time base: this is the fundamental unit of time (in seconds) in
+    // terms of which frame timestamps are represented. for fixed-fps
+    // content, timebase should be 1/framerate and timestamp increments
+    // should be identically 1.
+    st->codec->time_base.den = target->fps.num;
+    st->codec->time_base.num = target->fps.den;
+    // the performance profile decides the speed vs. quality trade-off
+    st->codec->gop_size = prof->gop_size;
+    // if we know which part of the screen changed, we force intra frames on
+    // major changes and may then leave the gop as long as seeking allows
+    damage_keyframes = (job->target >= CAP_AVI && app->keyframe_interval > 0
+                        && app->dmg_event_base != 0 &&
+                        !(job->flags & FLG_USE_XRENDER) && num_tiles == 1);
+    if (damage_keyframes) {
+        st->codec->gop_size = XVC_MAX (prof->gop_size,
+                                       app->keyframe_interval *
+                                       target->fps.num / target->fps.den);
+    }
+    last_damage = -1;
+    pts_gaps = (num_tiles == 1 &&
+                (job->target == CAP_AVI || job->target == CAP_DIVX ||
+                 job->target == CAP_ASF || job->target == CAP_FLV ||
+                 job->target == CAP_MOV || job->target == CAP_MKV) &&
+                (codec_id == CODEC_ID_MPEG4 ||
+                 codec_id == CODEC_ID_MPEG1VIDEO ||
+                 codec_id == CODEC_ID_MPEG2VIDEO ||
+                 codec_id == CODEC_ID_MSMPEG4V2 ||
+                 codec_id == CODEC_ID_MSMPEG4V3 ||
+                 codec_id == CODEC_ID_FLV1 ||
+                 codec_id == CODEC_ID_MJPEG || codec_id == CODEC_ID_H264));
+    // unchanged frames can only be detected with damage tracking
+    skip_unchanged = (pts_gaps && app->dmg_event_base != 0 &&
+                      !(job->flags & FLG_USE_XRENDER));
+    frame_pts = 0;
+    skipped_pending = 0;
+    st->codec->max_b_frames = prof->max_b_frames;
+    st->codec->me_method = prof->me_method;
+    st->codec->mb_decision = prof->mb_decision;
+    st->codec->me_subpel_quality = prof->me_subpel_quality;
+    // the encoder speed controller starts from the profile's settings, but
+    // is not used when archiving, which prefers quality over frame rate
+    speed_base = prof;
+    speed_level = 0;
+    speed_adapt = (job->target >= CAP_AVI && app->profile != PROFILE_ARCHIVE &&
+                   num_tiles == 1 &&
+                   (codec_id == CODEC_ID_MPEG4 ||
+                    codec_id == CODEC_ID_MPEG1VIDEO ||
+                    codec_id == CODEC_ID_MPEG2VIDEO ||
+                    codec_id == CODEC_ID_MSMPEG4V2 ||
+                    codec_id == CODEC_ID_MSMPEG4V3 ||
+                    codec_id == CODEC_ID_FLV1));
+    // several encoders working on consecutive closed gops, this is only
+    // done for the mpegvideo based encoders which keep no state across
+    // gops the muxer would need to know about
+    gop_encoders = 1;
+    if (job->target >= CAP_AVI && app->gop_encoders > 1 && num_tiles == 1) {
+        if (codec_id == CODEC_ID_MPEG4 || codec_id == CODEC_ID_MPEG1VIDEO ||
+            codec_id == CODEC_ID_MPEG2VIDEO ||
+            codec_id == CODEC_ID_MSMPEG4V2 ||
+            codec_id == CODEC_ID_MSMPEG4V3 || codec_id == CODEC_ID_FLV1 ||
+            codec_id == CODEC_ID_MJPEG) {
+            gop_encoders = app->gop_encoders;
+            gop_length = (app->gop_length > 0 ? app->gop_length :
+                          XVC_MAX (1, target->fps.num / target->fps.den));
+            st->codec->gop_size = gop_length;
+            // the instances are opened with the settings of this context
+            speed_adapt = FALSE;
+        } else {
+            fprintf (stderr,
+                     _("Parallel gop encoding is not supported for the %s codec, using a single encoder\n"),
+                     xvc_video_codecs[job->targetCodec].name);
+        }
+    }
 
-        swap = colors[i].green;
-        swap &= 0x0000FF00;            /* color is 16 bits, ms 8 bits already
-                                        * in position, delete ls 8 bits */
-        color_table_entry = (color_table_entry | swap);
+    // find suitable pix_fmt for codec
+    st->codec->pix_fmt = -1;
+    if (codec->pix_fmts != NULL) {
+        for (i = 0; codec->pix_fmts[i] != -1; i++) {
+            if (0 <= codec->pix_fmts[i] &&
+                codec->pix_fmts[i] < (sizeof (int) * 8))
+                pix_fmt_mask |= (1 << codec->pix_fmts[i]);
+        }
+        st->codec->pix_fmt =
+            avcodec_find_best_pix_fmt (pix_fmt_mask, input_pixfmt, FALSE, NULL);
+    }
 
-        swap = colors[i].blue;
-        swap >>= 8;
-        color_table_entry = (color_table_entry | swap);
+    if (!swscale_isSupportedIn (input_pixfmt)) {
+        fprintf (stderr, _("The picture format you are grabbing (%i) is not supported by libswscale ... aborting\n"), input_pixfmt);
+        exit (1);
+    }
+    if (!swscale_isSupportedOut (st->codec->pix_fmt)) {
+        st->codec->pix_fmt = -1;
+    }
+    // fallback pix fmts
+    if (st->codec->pix_fmt < 0) {
+        if (job->target >= CAP_AVI) {
+            st->codec->pix_fmt = PIX_FMT_YUV420P;
+        } else {
+            st->codec->pix_fmt = PIX_FMT_RGB24;
+        }
+    }
 
-        *pixel = color_table_entry;
-        pixel++;
+    // fit the picture to the codec by cropping or padding, tiles are only
+    // padded so they stay where they were in the capture area
+    ost->st = st;
+    set_video_geometry (ost, st->codec, width, height,
+                        (!rescaled && num_tiles == 1),
+                        get_codec_alignment (st->codec,
+                                             (job->target >= CAP_AVI)));
+    if (app->verbose && (ost->video_crop || ost->video_pad)) {
+        printf ("fitting %ix%i to %ix%i: crop l %i r %i t %i b %i, pad r %i b %i\n",
+                width, height, st->codec->width, st->codec->height,
+                ost->leftBand, ost->rightBand, ost->topBand, ost->bottomBand,
+                ost->padright, ost->padbottom);
     }
 
-    return color_table;
+    // mt init
+    enc_threads = get_codec_threads (st->codec, app->threads);
+    if (prof->max_threads > 0)
+        enc_threads = XVC_MIN (enc_threads, prof->max_threads);
+    // with parallel gops this encoder only provides the stream headers,
+    // tiles share the threads
+    if (gop_encoders > 1)
+        enc_threads = 1;
+    else if (num_tiles > 1)
+        enc_threads = XVC_MAX (1, enc_threads / num_tiles);
+    if (enc_threads > 1)
+        avcodec_thread_init (st->codec, enc_threads);
+    // flags
+    st->codec->flags |= CODEC_FLAG2_FAST;
+    // there is no trellis quantiser in libav* for mjpeg
+    if (st->codec->codec_id != CODEC_ID_MJPEG)
+	st->codec->trellis = prof->trellis;
+    st->codec->flags &= ~CODEC_FLAG_OBMC;
+    // some formats want stream headers to be seperate
+    if (oc->oformat->flags & AVFMT_GLOBALHEADER)
+        st->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
+
+    // quality through VBR
+    st->codec->flags |= CODEC_FLAG_QSCALE;
+    qscale = (100.0 - quality + 1.0) / 3.3;
+    st->codec->global_quality = st->quality = FF_QP2LAMBDA * qscale;
+    // 0.0 = default qscale
+    if (qscale > 0)
+        st->codec->qmin = st->codec->qmax = qscale;
+
+    return st;
 }
 
 /**
- * \brief prepare the output file or pipe
+ * \brief decide how many tiles the capture area is split into
+ *
+ * Tiles need a container that takes several video streams and the stream
+ * metadata the tile geometry is kept in, and are not rescaled.
+ *
+ * @param image the first captured image
+ * @param job the current job
+ * @return the number of tiles, 1 if the area is not split
+ */
+static int
+get_tile_grid (const XImage * image, const Job * job)
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+
+    tile_cols = tile_rows = 1;
+    if (app->tile_cols * app->tile_rows <= 1)
+        return 1;
+
+    if (job->target != CAP_AVI && job->target != CAP_DIVX &&
+        job->target != CAP_ASF && job->target != CAP_MOV) {
+        fprintf (stderr,
+                 _("The %s file format cannot hold tiles, encoding a single picture\n"),
+                 xvc_formats[job->target].name);
+        return 1;
+    }
+    if (app->rescale != 100 && !(job->flags & FLG_USE_XRENDER)) {
+        fprintf (stderr,
+                 _("Tiles cannot be rescaled, encoding a single picture\n"));
+        return 1;
+    }
+
+    // tiles are at least one macroblock
+    tile_cols = XVC_MAX (1, XVC_MIN (app->tile_cols, image->width / 16));
+    tile_rows = XVC_MAX (1, XVC_MIN (app->tile_rows, image->height / 16));
+    return tile_cols * tile_rows;
+}
+
+/**
+ * \brief add a video stream per tile to the output format
+ *
+ * The tile edges are aligned to macroblocks, only the last column and row
+ * may need padding. Where each tile goes is kept in the "title" of its
+ * stream and in the "comment" of the file as "WxH+X+Y" for
+ * xvidcap-stitch.
  *
- * need to determine which first and do things like making the filename
- * absolute etc.
- * @param jFileName the filename as contained in the current job
  * @param oc output format context (output_file)
- * @param number the movie number
+ * @param image the first captured image
+ * @param input_pixfmt picture format of the input picture
+ * @param codec_id libavcodec's codec id of the codec to use for encoding
+ * @param job pointer to the current job
+ * @return the stream of the first tile
+ */
+static AVStream *
+add_tile_streams (AVFormatContext * oc, const XImage * image,
+                  int input_pixfmt, int codec_id, Job * job)
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+    int i, comment_size = 64 + num_tiles * 32;
+    char *comment = av_malloc (comment_size);
+
+    tiles = av_mallocz (num_tiles * sizeof (XVC_Tile));
+    if (!tiles || !comment) {
+        fprintf (stderr, _("Could not alloc output stream\n"));
+        exit (1);
+    }
+    snprintf (comment, comment_size, "xvidcap tiles %ix%i:", image->width,
+              image->height);
+
+    for (i = 0; i < num_tiles; i++) {
+        XVC_Tile *t = &tiles[i];
+        int col = i % tile_cols, row = i / tile_cols;
+        char title[32];
+
+        t->x = (col * image->width / tile_cols) & ~15;
+        t->y = (row * image->height / tile_rows) & ~15;
+        t->width = (col == tile_cols - 1 ? image->width :
+                    ((col + 1) * image->width / tile_cols) & ~15) - t->x;
+        t->height = (row == tile_rows - 1 ? image->height :
+                     ((row + 1) * image->height / tile_rows) & ~15) - t->y;
+        t->ost = av_mallocz (sizeof (*t->ost));
+        if (!t->ost) {
+            fprintf (stderr, _("Could not alloc output stream\n"));
+            exit (1);
+        }
+        t->st = add_video_stream (oc, t->width, t->height, input_pixfmt,
+                                  codec_id, job, t->ost);
+
+        snprintf (title, sizeof (title), "%ix%i+%i+%i", t->width, t->height,
+                  t->x, t->y);
+        av_metadata_set2 (&t->st->metadata, "title", title, 0);
+        av_strlcatf (comment, comment_size, " %s", title);
+    }
+    av_metadata_set2 (&oc->metadata, "comment", comment, 0);
+    av_free (comment);
+
+    if (app->verbose)
+        printf ("%s\n", av_metadata_get (oc->metadata, "comment", NULL,
+                                         0)->value);
+
+    return tiles[0].st;
+}
+
+/**
+ * \brief convert and encode the tile of the current frame
+ *
+ * @param t the tile
+ * @param job the current job
  */
 static void
-prepareOutputFile (char *jFileName, AVFormatContext * oc, int number)
+encode_tile (XVC_Tile * t, const Job * job)
 {
-    // prepare output file for format context
-    if ((strcasecmp (jFileName, "-") == 0)
-        || (strcasecmp (jFileName, "pipe:") == 0)) {
-        jFileName = "pipe:";
-        snprintf (oc->filename, sizeof (oc->filename), "pipe:");
-        // register_protocol (&pipe_protocol);
-    } else {
-        char first;
-        char tmp_buf[PATH_MAX + 1];
+    AVCodecContext *c = t->st->codec;
+    uint8_t *src[4] = { NULL, NULL, NULL, NULL };
+    int src_stride[4] = { 0, 0, 0, 0 };
+
+    // all input formats are packed, pal8's second plane is the palette
+    src[0] = (uint8_t *) tile_image->data +
+        t->y * tile_image->bytes_per_line +
+        t->x * (tile_image->bits_per_pixel >> 3);
+    src_stride[0] = tile_image->bytes_per_line;
+    if (input_pixfmt == PIX_FMT_PAL8)
+        src[1] = (uint8_t *) job->color_table;
+
+    if (sws_scale (t->sws, src, src_stride, 0, t->height, t->pic->data,
+                   t->pic->linesize) < 0) {
+        fprintf (stderr, _("Error converting or resampling frame: context %p, iwidth %i, iheight %i, owidth %i, oheight %i, inpfmt %i opfmt %i\n"),
+                 t->sws, t->width, t->height, c->width, c->height,
+                 input_pixfmt, c->pix_fmt);
+        exit (1);
+    }
 
-        first = jFileName[0];
-        sprintf (tmp_buf, jFileName, number);
+    t->pic->pts = tile_pts;
+    t->out_size = avcodec_encode_video (c, t->outbuf, t->outbuf_size, t->pic);
+    if (t->out_size < 0) {
+        fprintf (stderr,
+                 _
+                 ("error encoding frame: c %p, outbuf %p, size %i, frame %p\n"),
+                 c, t->outbuf, t->outbuf_size, t->pic);
+        exit (1);
+    }
+}
 
-        // if the filename's first char is a / we have an absolute path
-        // and we want one for the file URL. If we don't have one, we
-        // construct one
-        if (first != '/') {
-            sprintf (oc->filename, "file://%s/%s", getenv ("PWD"), tmp_buf);
-        } else {
-            sprintf (oc->filename, "file://%s", tmp_buf);
+/**
+ * \brief the thread converting and encoding a tile
+ *
+ * @param t the tile
+ */
+static void
+tile_thread (XVC_Tile * t)
+{
+    Job *job = xvc_job_ptr ();
+
+    pthread_mutex_lock (&tile_mutex);
+    while (TRUE) {
+        struct timeval start, end;
+
+        while (!tiles_stop && t->frame_no == tile_frame_no)
+            pthread_cond_wait (&tile_cond, &tile_mutex);
+        if (tiles_stop)
+            break;
+        pthread_mutex_unlock (&tile_mutex);
+
+        gettimeofday (&start, NULL);
+        encode_tile (t, job);
+        gettimeofday (&end, NULL);
+
+        pthread_mutex_lock (&tile_mutex);
+        t->busy_usecs += (end.tv_sec - start.tv_sec) * 1000000 +
+            (end.tv_usec - start.tv_usec);
+        t->frame_no = tile_frame_no;
+        if (--tiles_pending == 0)
+            pthread_cond_broadcast (&tile_cond);
+    }
+    pthread_mutex_unlock (&tile_mutex);
+
+    pthread_exit (NULL);
+}
+
+/**
+ * \brief prepare the pictures and conversions of the tiles and start their
+ *      threads
+ *
+ * @param job the current job
+ */
+static void
+start_tiles (Job * job)
+{
+    int i;
+
+    tile_frame_no = 0;
+    tiles_pending = 0;
+    tiles_stop = FALSE;
+
+    for (i = 0; i < num_tiles; i++) {
+        XVC_Tile *t = &tiles[i];
+        AVCodecContext *c = t->st->codec;
+        int size = avpicture_get_size (c->pix_fmt, c->width, c->height);
+
+        t->pic = avcodec_alloc_frame ();
+        t->pic_buf = av_malloc (size);
+        t->outbuf_size = XVC_MAX (size + 20000, FF_MIN_BUFFER_SIZE);
+        t->outbuf = malloc (t->outbuf_size);
+        if (!t->pic || !t->pic_buf || !t->outbuf) {
+            fprintf (stderr, _("Could not allocate buffer for output frame! ... aborting\n"));
+            exit (1);
+        }
+        avpicture_fill ((AVPicture *) t->pic, t->pic_buf, c->pix_fmt,
+                        c->width, c->height);
+        // the padding is never written to again
+        if (c->width != t->width || c->height != t->height)
+            clear_picture (t->pic, c->pix_fmt, c->height);
+
+        t->sws = sws_getContext (t->width, t->height, input_pixfmt,
+                                 t->width, t->height, c->pix_fmt, 1,
+                                 NULL, NULL, NULL);
+        if (!t->sws) {
+            fprintf (stderr, _("Could not initialize the conversion of tile %i\n"), i);
+            exit (1);
+        }
+        if (pthread_create (&t->thread, NULL, (void *) tile_thread, t) != 0) {
+            fprintf (stderr, _("Could not start tile encoder thread\n"));
+            exit (1);
         }
-        // register_protocol (&file_protocol);
     }
 }
 
 /**
- * \brief add a video output stream to the output format
+ * \brief convert and encode a frame tile by tile and write the tiles
  *
- * @param oc output format context (output_file)
- * @param image captured XImage
- * @param input_pixfmt picture format of the input picture
- * @param codec_id libavcodec's codec id of the codec to use for encoding
- * @param job pointer to the current job
- * @return pointer to the AVStream that has been added to the output format
+ * @param image the captured image
+ * @param job the current job
  */
-static AVStream *
-add_video_stream (AVFormatContext * oc, const XImage * image,
-                  int input_pixfmt, int codec_id, Job * job)
+static void
+encode_tiles (XImage * image, Job * job)
 {
-    AVStream *st;
-    int pix_fmt_mask = 0, i = 0;
-    int quality = target->quality, qscale = 0;
     XVC_AppData *app = xvc_appdata_ptr ();
-
-
-    st = av_new_stream (oc, 0);
-    if (! st) {
-        fprintf (stderr, _("Could not alloc output stream\n"));
-        exit (1);
+    struct timeval start, end;
+    int i;
+
+    gettimeofday (&start, NULL);
+    pthread_mutex_lock (&tile_mutex);
+    tile_image = image;
+    tile_pts = frame_pts++;
+    tiles_pending = num_tiles;
+    tile_frame_no++;
+    pthread_cond_broadcast (&tile_cond);
+    while (tiles_pending > 0)
+        pthread_cond_wait (&tile_cond, &tile_mutex);
+    pthread_mutex_unlock (&tile_mutex);
+    gettimeofday (&end, NULL);
+    tile_wait_usecs += (end.tv_sec - start.tv_sec) * 1000000 +
+        (end.tv_usec - start.tv_usec);
+    tile_frames++;
+
+    for (i = 0; i < num_tiles; i++) {
+        if (tiles[i].out_size > 0)
+            do_video_out (output_file, tiles[i].st, tiles[i].outbuf,
+                          tiles[i].out_size);
     }
 
-    st->codec->codec_id = codec_id;
-    st->codec->codec_type = CODEC_TYPE_VIDEO;
+    if (app->verbose > 1)
+        printf ("frame %i: %i tiles encoded in %li usecs\n", job->pic_no,
+                num_tiles, (end.tv_sec - start.tv_sec) * 1000000 +
+                (end.tv_usec - start.tv_usec));
+}
 
-    // find the video encoder
-    codec = avcodec_find_encoder (st->codec->codec_id);
-    if (!codec) {
-        fprintf (stderr, _("Video codec not found\n"));
-        exit (1);
-    }
-    // put sample parameters
-    // resolution must be a multiple of two ... this is taken care of
-    // elsewhere but needs to be ensured for rescaled dimensions, too
-    if (app->rescale != 100) {
-        int n;
-        double r;
-
-        r = sqrt ((double) app->rescale / 100.0);
-
-        n = image->width * r;
-        if (n % 2 > 0)
-            n--;
-        st->codec->width = n;
-
-        n = image->height * r;
-        if (n % 2 > 0)
-            n--;
-        st->codec->height = n;
-    } else {
-        st->codec->width = image->width;
-        st->codec->height = image->height;
-    }
+/**
+ * \brief flush the encoders of the tiles and stop their threads
+ */
+static void
+stop_tiles ()
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+    long busy_usecs = 0;
+    int i, size;
 
-    // mt init
-    if (codec_id == CODEC_ID_MPEG4 || codec_id == CODEC_ID_MPEG1VIDEO ||
-        codec_id == CODEC_ID_MPEG2VIDEO) {
-        // the max threads is taken from ffmpeg's mpegvideo.c
-        avcodec_thread_init (st->codec, XVC_MIN (4,
-                                                 (st->codec->height +
-                                                  15) / 16));
-    }
-    // time base: this is the fundamental unit of time (in seconds) in
-    // terms of which frame timestamps are represented. for fixed-fps
-    // content, timebase should be 1/framerate and timestamp increments
-    // should be identically 1.
-    st->codec->time_base.den = target->fps.num;
-    st->codec->time_base.num = target->fps.den;
-    // emit one intra frame every fifty frames at most
-    st->codec->gop_size = 50;
-    st->codec->mb_decision = 2;
-    st->codec->me_method = 1;
+    // the frames held back for B-frames
+    for (i = 0; i < num_tiles; i++) {
+        XVC_Tile *t = &tiles[i];
 
-    // find suitable pix_fmt for codec
-    st->codec->pix_fmt = -1;
-    if (codec->pix_fmts != NULL) {
-        for (i = 0; codec->pix_fmts[i] != -1; i++) {
-            if (0 <= codec->pix_fmts[i] &&
-                codec->pix_fmts[i] < (sizeof (int) * 8))
-                pix_fmt_mask |= (1 << codec->pix_fmts[i]);
-        }
-        st->codec->pix_fmt =
-            avcodec_find_best_pix_fmt (pix_fmt_mask, input_pixfmt, FALSE, NULL);
+        while (msecs_since (&drain_start) < STOP_DRAIN_MSECS &&
+               (size = avcodec_encode_video (t->st->codec, t->outbuf,
+                                             t->outbuf_size, NULL)) > 0)
+            do_video_out (output_file, t->st, t->outbuf, size);
     }
 
-    if (!swscale_isSupportedIn (input_pixfmt)) {
-        fprintf (stderr, _("The picture format you are grabbing (%i) is not supported by libswscale ... aborting\n"), input_pixfmt);
-        exit (1);
-    }
-    if (!swscale_isSupportedOut (st->codec->pix_fmt)) {
-        st->codec->pix_fmt = -1;
-    }
-    // fallback pix fmts
-    if (st->codec->pix_fmt < 0) {
-        if (job->target >= CAP_AVI) {
-            st->codec->pix_fmt = PIX_FMT_YUV420P;
-        } else {
-            st->codec->pix_fmt = PIX_FMT_RGB24;
-        }
+    pthread_mutex_lock (&tile_mutex);
+    tiles_stop = TRUE;
+    pthread_cond_broadcast (&tile_cond);
+    pthread_mutex_unlock (&tile_mutex);
+
+    for (i = 0; i < num_tiles; i++) {
+        XVC_Tile *t = &tiles[i];
+
+        pthread_join (t->thread, NULL);
+        busy_usecs += t->busy_usecs;
+        sws_freeContext (t->sws);
+        av_free (t->pic_buf);
+        av_free (t->pic);
+        free (t->outbuf);
+        av_free (t->ost);
     }
-    // flags
-    st->codec->flags |= CODEC_FLAG2_FAST;
-    // there is no trellis quantiser in libav* for mjpeg
-    if (st->codec->codec_id != CODEC_ID_MJPEG)
-	st->codec->trellis = 1;
-    st->codec->flags &= ~CODEC_FLAG_OBMC;
-    // some formats want stream headers to be seperate
-    if (oc->oformat->flags & AVFMT_GLOBALHEADER)
-        st->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
 
-    // quality through VBR
-    st->codec->flags |= CODEC_FLAG_QSCALE;
-    qscale = (100.0 - quality + 1.0) / 3.3;
-    st->codec->global_quality = st->quality = FF_QP2LAMBDA * qscale;
-    // 0.0 = default qscale
-    if (qscale > 0)
-        st->codec->qmin = st->codec->qmax = qscale;
+    if (app->verbose && tile_frames > 0) {
+        printf ("tiled encoding: %ix%i tiles, %i frames, %li usecs per tile and frame, %li usecs per frame\n",
+                tile_cols, tile_rows, tile_frames,
+                busy_usecs / (tile_frames * num_tiles),
+                tile_wait_usecs / tile_frames);
+    }
 
-    return st;
+    av_free (tiles);
+    tiles = NULL;
+    tiles_stop = FALSE;
+    tile_frames = 0;
+    tile_wait_usecs = 0;
 }
 
 /**
@@ -1165,13 +4218,17 @@ guess_input_pix_fmt (const XImage * image, const ColorInfo * c_info)
         if ((c_info->alpha_mask == 0xFF000000 || c_info->alpha_mask == 0) && 
                 (image->red_mask == 0xFF0000 || image->red_mask == 0xFF) &&
                 image->green_mask == 0xFF00) {
-            // byte order is relevant here, not endianness endianness is
-            // handled by avcodec, but atm no such thing as having ABGR,
-            // instead of ARGB in a word. Since we need this for
-            // Solaris/SPARC, but need to do the conversion
-            // for every frame we do it outside of this loop, cf.
-            // below this matches both ARGB32 and ABGR32
-            input_pixfmt = PIX_FMT_ARGB32;
+            // the byte order of the image is what matters here, not the
+            // endianness of the host, so pick the pixel format matching
+            // the layout of the bytes in memory. This covers ARGB32 as
+            // well as the swapped ABGR32 we get e.g. on Solaris/SPARC
+            if (image->red_mask == 0xFF) {
+                input_pixfmt = (image->byte_order == MSBFirst ?
+                                PIX_FMT_ABGR : PIX_FMT_RGBA);
+            } else {
+                input_pixfmt = (image->byte_order == MSBFirst ?
+                                PIX_FMT_ARGB : PIX_FMT_BGRA);
+            }
         } else {
             fprintf(stderr, _("image depth %i not supported ... aborting\n"), image->bits_per_pixel);
             exit (1);
@@ -1185,6 +4242,107 @@ guess_input_pix_fmt (const XImage * image, const ColorInfo * c_info)
     return input_pixfmt;
 }
 
+/**
+ * \brief prepare the input and output pictures, the buffer for encoded
+ *      frames and the conversion of the captured image
+ *
+ * @param image the first captured image
+ * @param job the current job
+ */
+static void
+prepare_pictures (XImage * image, Job * job)
+{
+    XVC_AppData *app = xvc_appdata_ptr ();
+
+    // input picture
+    p_inpic = avcodec_alloc_frame ();
+
+    if (input_pixfmt == PIX_FMT_PAL8) {
+        // libswscale reads the palette from the second data pointer,
+        // lines may be padded
+        p_inpic->data[0] = (uint8_t *) image->data;
+        p_inpic->linesize[0] = image->bytes_per_line;
+        p_inpic->data[1] = (uint8_t *) job->color_table;
+        p_inpic->linesize[1] = 0;
+    } else {
+        avpicture_fill ((AVPicture *) p_inpic, (uint8_t *) image->data,
+                        input_pixfmt, image->width, image->height);
+        p_inpic->linesize[0] = image->bytes_per_line;
+    }
+    // cropping just skips the bands, all input formats are packed
+    if (vid_out_st->video_crop) {
+        p_inpic->data[0] += vid_out_st->topBand * p_inpic->linesize[0] +
+            vid_out_st->leftBand * (image->bits_per_pixel >> 3);
+    }
+
+    // output picture
+    p_outpic = avcodec_alloc_frame ();
+
+    image_size =
+        avpicture_get_size (out_st->codec->pix_fmt,
+                            out_st->codec->width, out_st->codec->height);
+    outpic_buf = av_malloc (image_size);
+    if (!outpic_buf) {
+        fprintf (stderr, _("Could not allocate buffer for output frame! ... aborting\n"));
+        exit (1);
+    }
+    avpicture_fill ((AVPicture *) p_outpic, outpic_buf,
+                    out_st->codec->pix_fmt, out_st->codec->width,
+                    out_st->codec->height);
+    // the padding is never written to again
+    if (vid_out_st->video_pad) {
+        clear_picture (p_outpic, out_st->codec->pix_fmt,
+                       out_st->codec->height);
+    }
+
+    /*
+     * prepare output buffer for encoded frames
+     */
+    if ((image_size + 20000) < FF_MIN_BUFFER_SIZE)
+        outbuf_size = FF_MIN_BUFFER_SIZE;
+    else
+        outbuf_size = image_size + 20000;
+    outbuf = malloc (outbuf_size);
+    if (!outbuf) {
+        fprintf (stderr, _("Could not allocate buffer for encoded frame (outbuf)! ... aborting\n"));
+        exit (1);
+    }
+    if (gop_encoders > 1)
+        start_gop_encoders ();
+    // pal8 to yuv420p without rescaling does not need libswscale
+    pal8_direct = (input_pixfmt == PIX_FMT_PAL8 &&
+                   (out_st->codec->pix_fmt == PIX_FMT_YUV420P ||
+                    out_st->codec->pix_fmt == PIX_FMT_YUVJ420P) &&
+                   !vid_out_st->video_crop &&
+                   VIDEO_OUT_WIDTH == image->width &&
+                   VIDEO_OUT_HEIGHT == image->height);
+    if (pal8_direct) {
+        prepare_pal8_yuv_tables (job->color_table, job->ncolors,
+                                 (out_st->codec->pix_fmt ==
+                                  PIX_FMT_YUVJ420P));
+    }
+    // neither does scaling packed rgb down by 1/2, 1/4, or 1/8
+    box_ratio = get_box_ratio (image, out_st->codec, VIDEO_OUT_WIDTH,
+                               VIDEO_OUT_HEIGHT);
+    if (app->verbose && box_ratio > 0)
+        printf ("scaling down by 1/%i through box filter\n", box_ratio);
+    // img resampling
+    if (!img_resample_ctx && !pal8_direct && box_ratio == 0) {
+        img_resample_ctx = sws_getContext (VIDEO_IN_WIDTH (image),
+                                           VIDEO_IN_HEIGHT (image),
+                                           input_pixfmt,
+                                           VIDEO_OUT_WIDTH,
+                                           VIDEO_OUT_HEIGHT,
+                                           out_st->codec->pix_fmt, 1,
+                                           NULL, NULL, NULL);
+        // sws_rgb2rgb_init(SWS_CPU_CAPS_MMX*0);
+    }
+    // without scaling, every output row depends on one input row only
+    damage_convert = (img_resample_ctx &&
+                      VIDEO_IN_WIDTH (image) == VIDEO_OUT_WIDTH &&
+                      VIDEO_IN_HEIGHT (image) == VIDEO_OUT_HEIGHT);
+}
+
 /**
  * \brief main function to write ximage as video to 'fp'
  *
@@ -1201,6 +4359,15 @@ xvc_ffmpeg_save_frame (FILE * fp, XImage * image)
 
     /* size of the encoded frame to write to file */
     int out_size = -1;
+    /* TRUE if neither screen nor pointer changed since the previous frame */
+    int unchanged;
+    /* TRUE if libswscale failed to convert the frame */
+    int conv_failed = FALSE;
+    /* for measuring the time spent on image conversion */
+    struct timeval conv_start, enc_start;
+    /* 0 once the audio stream is set up */
+    int au_ret = 1;
+    int i;
 
     // encoder needs to be prepared only once ..
     if (job->state & VC_START) {       // it's the first call
@@ -1256,9 +4423,24 @@ xvc_ffmpeg_save_frame (FILE * fp, XImage * image)
         //
         // prepare stream
         fprintf(stderr, "The current pixfmt is %d, but the choosen one is %d\n", input_pixfmt, (input_pixfmt == PIX_FMT_PAL8 ? PIX_FMT_RGB24 : input_pixfmt));
-        out_st = add_video_stream (output_file, image,
-                     (input_pixfmt == PIX_FMT_PAL8 ? PIX_FMT_RGB24 : input_pixfmt),
-                      xvc_video_codecs[job->targetCodec].ffmpeg_id, job);
+        // very large capture areas may be split into tiles with a stream
+        // each, the geometry of a tile is kept with the tile
+        num_tiles = (job->target >= CAP_AVI ? get_tile_grid (image, job) : 1);
+        if (num_tiles > 1) {
+            out_st = add_tile_streams (output_file, image,
+                         (input_pixfmt == PIX_FMT_PAL8 ? PIX_FMT_RGB24 : input_pixfmt),
+                          xvc_video_codecs[job->targetCodec].ffmpeg_id, job);
+        } else {
+            vid_out_st = av_mallocz (sizeof (AVOutputStream));
+            if (!vid_out_st) {
+                fprintf (stderr, _("Could not alloc output stream\n"));
+                exit (1);
+            }
+            out_st = add_video_stream (output_file, image->width, image->height,
+                         (input_pixfmt == PIX_FMT_PAL8 ? PIX_FMT_RGB24 : input_pixfmt),
+                          xvc_video_codecs[job->targetCodec].ffmpeg_id, job,
+                          vid_out_st);
+        }
 
         // FIXME: set params
         // memset (p_fParams, 0, sizeof(*p_fParams));
@@ -1272,96 +4454,32 @@ xvc_ffmpeg_save_frame (FILE * fp, XImage * image)
             fprintf (stderr, _("Invalid encoding parameters ... aborting\n"));
             exit (1);
         }
-        // open the codec
-        if (avcodec_open (out_st->codec, codec) < 0) {
-            fprintf (stderr, _("Could not open video codec\n"));
-            exit (1);
-        }
-
-		if ((job->flags & FLG_REC_SOUND) && (job->au_targetCodec > 0)) {
-            int au_ret = add_audio_stream (job);
-
-            // initialize a mutex lock to its default value
-            pthread_mutex_init (&mp, NULL);
-
-            if (au_ret == 0) {
-                int tret;
-
-                // create and start capture thread
-                // initialized with default attributes
-                tret = pthread_attr_init (&tattr);
-
-                // create the thread
-                tret =
-                    pthread_create (&tid, &tattr,
-                                    (void *) capture_audio_thread, job);
-            }
-        }
+        // open the codecs, there is one video stream per tile. The audio
+        // stream is only added below and opens its codec itself
+        for (i = 0; i < num_tiles; i++) {
+            AVStream *vst = (num_tiles > 1 ? tiles[i].st : out_st);
 
-        /*
-         * prepare pictures
-         */
-        // input picture
-        p_inpic = avcodec_alloc_frame ();
-
-        if (input_pixfmt == PIX_FMT_PAL8) {
-            scratchbuf8bit =
-                malloc (avpicture_get_size
-                        (PIX_FMT_RGB24, image->width, image->height));
-            if (!scratchbuf8bit) {
-                fprintf(stderr, "Could not allocate buffer for 8bit palette conversion\n");
+            if (avcodec_open (vst->codec, codec) < 0) {
+                fprintf (stderr, _("Could not open video codec\n"));
                 exit (1);
             }
-
-            avpicture_fill ((AVPicture *) p_inpic, scratchbuf8bit,
-                            input_pixfmt, image->width, image->height);
-            p_inpic->data[0] = scratchbuf8bit;
-            p_inpic->linesize[0] = image->width * 3;
-        } else {
-            avpicture_fill ((AVPicture *) p_inpic, (uint8_t *) image->data,
-                            input_pixfmt, image->width, image->height);
         }
+        // the quality asked for, to go back to after a backlog
+        backlog_qmin = out_st->codec->qmin;
+        backlog_qmax = out_st->codec->qmax;
 
-        // output picture
-        p_outpic = avcodec_alloc_frame ();
-
-        image_size =
-            avpicture_get_size (out_st->codec->pix_fmt,
-                                out_st->codec->width, out_st->codec->height);
-        outpic_buf = av_malloc (image_size);
-        if (!outpic_buf) {
-            fprintf (stderr, _("Could not allocate buffer for output frame! ... aborting\n"));
-            exit (1);
+		if ((job->flags & FLG_REC_SOUND) && (job->au_targetCodec > 0)) {
+            au_ret = add_audio_stream (job);
         }
-        avpicture_fill ((AVPicture *) p_outpic, outpic_buf,
-                        out_st->codec->pix_fmt, out_st->codec->width,
-                        out_st->codec->height);
 
         /*
-         * prepare output buffer for encoded frames
+         * prepare pictures
          */
-        if ((image_size + 20000) < FF_MIN_BUFFER_SIZE)
-            outbuf_size = FF_MIN_BUFFER_SIZE;
+        if (num_tiles > 1)
+            start_tiles (job);
         else
-            outbuf_size = image_size + 20000;
-        outbuf = malloc (outbuf_size);
-        if (!outbuf) {
-            fprintf (stderr, _("Could not allocate buffer for encoded frame (outbuf)! ... aborting\n"));
-            exit (1);
-        }
-        // img resampling
-        if (!img_resample_ctx) {
-            img_resample_ctx = sws_getContext (image->width,
-                                               image->height,
-                                               (input_pixfmt ==
-                                                PIX_FMT_PAL8 ? PIX_FMT_RGB24
-                                                : input_pixfmt),
-                                               out_st->codec->width,
-                                               out_st->codec->height,
-                                               out_st->codec->pix_fmt, 1,
-                                               NULL, NULL, NULL);
-            // sws_rgb2rgb_init(SWS_CPU_CAPS_MMX*0);
-        }
+            prepare_pictures (image, job);
+
         // file preparation needs to be done once for multi-frame capture
         // and multiple times for single-frame capture
         if (job->target >= CAP_AVI) {
@@ -1371,8 +4489,8 @@ xvc_ffmpeg_save_frame (FILE * fp, XImage * image)
             prepareOutputFile (job->file, output_file, job->movie_no);
 
             // open the file
-            if (url_fopen
-                (&output_file->pb, output_file->filename, URL_WRONLY) < 0) {
+            if (xvc_outfile_open (output_file, app->output_io,
+                                  app->preallocate, app->fsync_interval) < 0) {
                 fprintf (stderr, _("Could not open '%s' ... aborting\n"), output_file->filename);
                 exit (1);
             }
@@ -1383,6 +4501,32 @@ xvc_ffmpeg_save_frame (FILE * fp, XImage * image)
                 exit (1);
             }
 
+            // from now on packets are written by the muxer thread only
+            start_muxer ();
+
+            if (au_ret == 0) {
+                int tret;
+
+                // create and start capture thread
+                // initialized with default attributes
+                tret = pthread_attr_init (&tattr);
+
+                // create the threads, they run till xvc_ffmpeg_clean ()
+                // asks them to stop
+                audio_thread_stop = FALSE;
+                gettimeofday (&audio_start, NULL);
+                tret =
+                    pthread_create (&tid, &tattr,
+                                    (void *) capture_audio_thread, job);
+                for (i = 0; i < num_audio_inputs && tret == 0; i++)
+                    tret = pthread_create (&audio_inputs[i].tid, &tattr,
+                                           (void *) audio_reader_thread,
+                                           &audio_inputs[i]);
+                if (tret != 0) {
+                    fprintf (stderr, _("Could not start the audio threads\n"));
+                    exit (1);
+                }
+            }
         }
     }
 
@@ -1391,9 +4535,9 @@ xvc_ffmpeg_save_frame (FILE * fp, XImage * image)
         // after this output_file->filename should have the right filename
         prepareOutputFile (job->file, output_file, job->pic_no);
 
-        // open the file
-        if (url_fopen (&output_file->pb, output_file->filename, URL_WRONLY)
-            < 0) {
+        // open the file, the blocks are kept from frame to frame
+        if (xvc_outfile_open (output_file, app->output_io, 0,
+                              app->fsync_interval) < 0) {
             fprintf (stderr, _("Could not open '%s' ... aborting\n"), output_file->filename);
             exit (1);
         }
@@ -1405,23 +4549,86 @@ xvc_ffmpeg_save_frame (FILE * fp, XImage * image)
         }
     }
 
+    // the frame's capture time on the master clock for a/v sync
+    sync_video_clock (job);
+
+    // the disk does not keep up, lower the quality or drop the frame
+    if (!(job->state & VC_START) && adapt_to_backlog (job)) {
+        frame_pts++;
+        skipped_pending++;
+        dropped_frames++;
+        return;
+    }
+
+    // tiles are converted and encoded by threads of their own
+    if (num_tiles > 1) {
+        encode_tiles (image, job);
+        return;
+    }
+
+    /*
+     * unchanged frames are skipped, or at least not converted again
+     */
+    unchanged = (!(job->state & VC_START) && job->frame_unchanged);
+    if (unchanged) {
+        unchanged_frames++;
+        if (skip_unchanged) {
+            frame_pts++;
+            skipped_pending++;
+            last_damage = job->damage_permille;
+            return;
+        }
+    }
+
+    // the capture does not wait for the gop encoders, if all of them are
+    // still busy with earlier gops the frame is dropped like above
+    if (gop_encoders > 1 && !gop_encoder_free ()) {
+        frame_pts++;
+        skipped_pending++;
+        dropped_frames++;
+        return;
+    }
+
     /*
      * convert input pic to pixel format the encoder expects
      */
 
-    /** \todo test if the special image conversion for Solaris is still
-     *      necessary */
-    if (input_pixfmt == PIX_FMT_ARGB32 && 
-        (job->c_info->alpha_mask == 0xFF000000 || job->c_info->alpha_mask == 0)
-        && image->red_mask == 0xFF && image->green_mask == 0xFF00
-        && image->blue_mask == 0xFF0000) {
-        myABGR32toARGB32 (image);
-    } else if (input_pixfmt == PIX_FMT_PAL8) {
-        myPAL8toRGB24 (image, p_inpic, job);
-    }
-    // img resampling and conversion
-    if (sws_scale (img_resample_ctx, p_inpic->data, p_inpic->linesize,
-                   0, image->height, p_outpic->data, p_outpic->linesize) < 0) {
+    if (app->verbose && !unchanged)
+        gettimeofday (&conv_start, NULL);
+
+    // img resampling and conversion, p_outpic still holds the picture of
+    // an unchanged frame
+    if (unchanged) {
+        // nothing to do
+    } else if (pal8_direct) {
+        myPAL8toYUV420P (image, p_outpic);
+    } else if (box_ratio > 0) {
+        myRGBtoYUV420P_box (image, p_outpic, VIDEO_OUT_WIDTH,
+                            VIDEO_OUT_HEIGHT, box_ratio,
+                            (out_st->codec->pix_fmt == PIX_FMT_YUVJ420P));
+    } else if (damage_convert && job->frame_region &&
+               !(job->state & VC_START)) {
+        // only the rows that changed
+        int rows = convert_damaged_rows (job->frame_region,
+                                         VIDEO_IN_WIDTH (image),
+                                         VIDEO_IN_HEIGHT (image));
+
+        conv_failed = (rows < 0);
+        if (rows >= 0) {
+            damage_rows += rows;
+            damage_total_rows += VIDEO_IN_HEIGHT (image);
+            if (app->verbose > 1)
+                printf ("frame %i: %i permille of the area changed, %i of %i rows converted\n",
+                        job->pic_no, job->damage_permille, rows,
+                        VIDEO_IN_HEIGHT (image));
+        }
+    } else {
+        conv_failed = (sws_scale (img_resample_ctx, p_inpic->data,
+                                  p_inpic->linesize, 0,
+                                  VIDEO_IN_HEIGHT (image), p_outpic->data,
+                                  p_outpic->linesize) < 0);
+    }
+    if (conv_failed) {
         fprintf (stderr, _("Error converting or resampling frame: context %p, iwidth %i, iheight %i, owidth %i, oheight %i, inpfmt %i opfmt %i\n"),
                  img_resample_ctx, image->width,
                  image->height, out_st->codec->width, out_st->codec->height,
@@ -1429,49 +4636,79 @@ xvc_ffmpeg_save_frame (FILE * fp, XImage * image)
         exit (1);
     }
 
+    if (app->verbose && !unchanged) {
+        struct timeval conv_end;
+
+        gettimeofday (&conv_end, NULL);
+        conv_usecs += (conv_end.tv_sec - conv_start.tv_sec) * 1000000 +
+            (conv_end.tv_usec - conv_start.tv_usec);
+        conv_frames++;
+    }
+
     /*
      * encode the image
      */
 
-    out_size =
-        avcodec_encode_video (out_st->codec, outbuf, outbuf_size, p_outpic);
-    if (out_size < 0) {
-        fprintf (stderr,
-                 _
-                 ("error encoding frame: c %p, outbuf %p, size %i, frame %p\n"),
-                 out_st->codec, outbuf,
-                 outbuf_size, p_outpic);
-        exit (1);
+    // the time the previous frame took is unknown for the first one
+    if (!(job->state & VC_START))
+        adapt_encoder_speed (out_st->codec, job);
+
+    // force an intra frame if most of the screen changed, but only once
+    // and not on every frame of a full screen animation
+    p_outpic->pict_type = 0;
+    if (damage_keyframes && job->damage_permille >= KEYFRAME_DAMAGE_PERMILLE &&
+        last_damage >= 0 && last_damage < KEYFRAME_DAMAGE_PERMILLE) {
+        p_outpic->pict_type = FF_I_TYPE;
+        forced_keyframes++;
+    }
+    last_damage = job->damage_permille;
+
+    // the gop encoders start counting from 0 for every gop
+    if (pts_gaps || gop_encoders > 1) {
+        p_outpic->pts = frame_pts;
+        skipped_pending = 0;
     }
-    if (job->flags & FLG_REC_SOUND) {
-        if (pthread_mutex_lock (&mp) > 0) {
+    // the frame's slot in the video stream is also needed for a/v sync
+    frame_pts++;
+
+    // with parallel gops the picture is encoded by one of the gop encoders
+    if (gop_encoders == 1) {
+        if (app->verbose)
+            gettimeofday (&enc_start, NULL);
+
+        out_size =
+            avcodec_encode_video (out_st->codec, outbuf, outbuf_size,
+                                  p_outpic);
+
+        if (app->verbose) {
+            struct timeval enc_end;
+
+            gettimeofday (&enc_end, NULL);
+            enc_usecs += (enc_end.tv_sec - enc_start.tv_sec) * 1000000 +
+                (enc_end.tv_usec - enc_start.tv_usec);
+            enc_frames++;
+        }
+        if (out_size < 0) {
             fprintf (stderr,
                      _
-                     ("mutex lock for writing video frame failed ... aborting\n"));
+                     ("error encoding frame: c %p, outbuf %p, size %i, frame %p\n"),
+                     out_st->codec, outbuf,
+                     outbuf_size, p_outpic);
             exit (1);
         }
     }
 
     /*
-     * write frame to file
+     * write frame to file, or whatever gops are done
      */
-    if (out_size > 0) {
+    if (gop_encoders > 1) {
+        queue_gop_frame (p_outpic);
+    } else if (out_size > 0) {
         do_video_out (output_file, out_st, outbuf, out_size);
     }
 
     if (job->target < CAP_AVI)
-        url_fclose (output_file->pb);
-
-    /*
-     * release the mutex
-     */
-    if (job->flags & FLG_REC_SOUND) {
-        if (pthread_mutex_unlock (&mp) > 0) {
-            fprintf (stderr,
-                     _
-                     ("couldn't release the mutex for writing video frame ... aborting\n"));
-        }
-    }
+        xvc_outfile_close (output_file);
 }
 
 /**
@@ -1481,26 +4718,146 @@ void
 xvc_ffmpeg_clean ()
 {
     Job *job = xvc_job_ptr ();
+    XVC_AppData *app = xvc_appdata_ptr ();
+
+    struct timespec timeout;
 
+    gettimeofday (&drain_start, NULL);
+    timeout.tv_sec = drain_start.tv_sec + STOP_DRAIN_MSECS / 1000;
+    timeout.tv_nsec = drain_start.tv_usec * 1000 +
+        (long) (STOP_DRAIN_MSECS % 1000) * 1000000;
+    if (timeout.tv_nsec >= 1000000000) {
+        timeout.tv_sec++;
+        timeout.tv_nsec -= 1000000000;
+    }
 
     if (job->flags & FLG_REC_SOUND && tid != 0) {
-        {
-            int tret;
-
-            // wait till audio thread is actually running, or else
-            // the signal might kill xvidcap. we also cannot just
-            // drop sending the signal, because the audio thread
-            // might just be starting
-            while (!audio_thread_running) {
-                usleep (10);
+        AVPacket pkt;
+        struct timeval now;
+        int i;
+
+        // ask the audio threads to end, this also wakes them up if they
+        // wait for the recording to be unpaused or on the ring
+        pthread_mutex_lock (&(app->recording_paused_mutex));
+        audio_thread_stop = TRUE;
+        pthread_cond_broadcast (&(app->recording_condition_unpaused));
+        pthread_mutex_unlock (&(app->recording_paused_mutex));
+        wake_audio_ring ();
+
+        // the encoding thread never blocks on the input, it drains its
+        // encoder and ends
+        pthread_join (tid, NULL);
+        tid = 0;
+        // the readers are most likely blocked reading from the audio
+        // devices
+        for (i = 0; i < num_audio_inputs; i++) {
+            pthread_cancel (audio_inputs[i].tid);
+            pthread_join (audio_inputs[i].tid, NULL);
+            audio_inputs[i].tid = 0;
+            while (audio_ring_pop (&audio_inputs[i], &pkt, NULL))
+                av_free_packet (&pkt);
+        }
+
+        gettimeofday (&now, NULL);
+        for (i = 0; app->verbose && i < num_audio_inputs; i++) {
+            XVC_AudioInput *in = &audio_inputs[i];
+
+            printf ("audio: %s: %li packets read, up to %u waiting for the encoder, %li msecs CPU reading in %li secs\n",
+                    in->device, in->packets, in->max_fill,
+                    in->cpu_usecs / 1000,
+                    (long) (now.tv_sec - audio_start.tv_sec));
+            if (in->overflows > 0)
+                printf ("audio: %s: encoder fell behind %i times, %.1f msecs of captured audio dropped\n",
+                        in->device, in->overflows,
+                        in->overflow_usecs / 1000.0);
+            if (in->alsa && xvc_alsa_xruns (in->alsa) > 0)
+                printf ("audio: %s: %i overruns of the ALSA buffer\n",
+                        in->device, xvc_alsa_xruns (in->alsa));
+        }
+        if (app->verbose) {
+            printf ("audio: %li msecs CPU encoding\n",
+                    audio_encoder_cpu_usecs / 1000);
+        }
+        if (app->verbose && num_audio_inputs > 1 && audio_mixed_usecs > 0) {
+            printf ("audio: mixing %i inputs took %li msecs CPU for %.1f secs of audio (%.3f%%)\n",
+                    num_audio_inputs, audio_mix_cpu_usecs / 1000,
+                    audio_mixed_usecs / 1000000.0,
+                    audio_mix_cpu_usecs * 100.0 / audio_mixed_usecs);
+        }
+        close_audio_input ();
+        if (app->verbose && av_sync_measures > 0) {
+            printf ("a/v sync: offset %+.1f msecs on average, %.1f msecs at most, %i audio packets dropped, %.1f msecs of silence inserted\n",
+                    av_sync_offset_sum / av_sync_measures / 1000.0,
+                    av_sync_max_offset / 1000.0, av_sync_dropped,
+                    av_sync_silence / 1000.0);
+        }
+        audio_encoder_cpu_usecs = 0;
+        audio_mix_cpu_usecs = 0;
+        audio_mixed_usecs = 0;
+        av_free (mix_buf);
+        mix_buf = NULL;
+        mix_buf_size = 0;
+        num_audio_inputs = 0;
+        audio_thread_stop = FALSE;
+        audio_from_device = FALSE;
+        av_sync_offset = 0;
+        av_sync_max_offset = 0;
+        av_sync_offset_sum = 0;
+        av_sync_measures = 0;
+        av_sync_last_report = 0;
+        av_sync_dropped = 0;
+        av_sync_silence = 0;
+    }
+
+    if (output_file && out_st && job->target >= CAP_AVI) {
+        int out_size;
+
+        /*
+         * encode the last picture again if the frames at the end were
+         * skipped, so the file lasts until the end of the capture
+         */
+        if (skipped_pending > 0) {
+            p_outpic->pict_type = 0;
+            p_outpic->pts = frame_pts - 1;
+            if (gop_enc) {
+                queue_gop_frame (p_outpic);
+            } else {
+                out_size = avcodec_encode_video (out_st->codec, outbuf,
+                                                 outbuf_size, p_outpic);
+                if (out_size > 0)
+                    do_video_out (output_file, out_st, outbuf, out_size);
             }
-            tret = pthread_kill (tid, SIGUSR1);
+            skipped_pending = 0;
+        }
 
-            pthread_join (tid, NULL);
-            tid = 0;
+        /*
+         * flush the frames held back by encoders with B-frames or a
+         * lookahead
+         */
+        if (tiles) {
+            stop_tiles ();
+        } else if (gop_enc) {
+            stop_gop_encoders (&timeout);
+        } else {
+            while (TRUE) {
+                if (msecs_since (&drain_start) >= STOP_DRAIN_MSECS) {
+                    fprintf (stderr,
+                             _("Stopping took too long, frames still held back by the video encoder are lost\n"));
+                    break;
+                }
+                out_size = avcodec_encode_video (out_st->codec, outbuf,
+                                                 outbuf_size, NULL);
+                if (out_size <= 0)
+                    break;
+                do_video_out (output_file, out_st, outbuf, out_size);
+            }
         }
     }
 
+    // the encoders are drained, let the muxer thread write what is queued
+    if (mux_running)
+        stop_muxer ();
+
     if (output_file) {
         /*
          * write trailer
@@ -1515,7 +4872,13 @@ xvc_ffmpeg_clean ()
          * close file if multi-frame capture ... otherwise closed already
          */
         if (job->target >= CAP_AVI)
-            url_fclose (output_file->pb);
+            xvc_outfile_close (output_file);
+
+        if (app->verbose) {
+            printf ("stop: output closed %li msecs after the stop request, %li msecs of that draining the encoders\n",
+                    msecs_since (job->stop_time.tv_sec ? &(job->stop_time) :
+                                 &drain_start), msecs_since (&drain_start));
+        }
         /*
          * free streams
          */
@@ -1540,10 +4903,27 @@ xvc_ffmpeg_clean ()
         output_file = NULL;
     }
 
+    xvc_outfile_release ();
+
     if (img_resample_ctx) {
         sws_freeContext (img_resample_ctx);
         img_resample_ctx = NULL;
     }
+    if (damage_ctx) {
+        int i;
+
+        for (i = 0; i < damage_nb_ctx; i++) {
+            if (damage_ctx[i])
+                sws_freeContext (damage_ctx[i]);
+        }
+        av_free (damage_ctx);
+        damage_ctx = NULL;
+        damage_nb_ctx = 0;
+    }
+    if (damage_pic.data[0]) {
+        avpicture_free (&damage_pic);
+        memset (&damage_pic, 0, sizeof (damage_pic));
+    }
 
     if (outpic_buf) {
         av_free (outpic_buf);
@@ -1558,10 +4938,82 @@ xvc_ffmpeg_clean ()
     av_free (p_outpic);
     p_outpic = NULL;
 
-    if (input_pixfmt == PIX_FMT_PAL8 && scratchbuf8bit) {
-        free (scratchbuf8bit);
-        scratchbuf8bit = NULL;
+    if (app->verbose && conv_frames > 0) {
+        printf ("image conversion (%s): %i frames, %li usecs per frame\n",
+                (pal8_direct ? "pal8 lookup" : (box_ratio > 0 ?
+                                                "box filter" : "libswscale")),
+                conv_frames, conv_usecs / conv_frames);
+    }
+    if (app->verbose && enc_frames > 0) {
+        printf ("video encoding (%s profile, %i threads): %i frames, %li usecs per frame\n",
+                xvc_profile_names[app->profile], enc_threads, enc_frames,
+                enc_usecs / enc_frames);
+    }
+    conv_frames = 0;
+    conv_usecs = 0;
+    enc_threads = 1;
+    enc_frames = 0;
+    enc_usecs = 0;
+    if (app->verbose && speed_adapt) {
+        printf ("encoder speed: ended with %s\n", speed_ladder[speed_level].name);
+    }
+    if (app->verbose && damage_keyframes) {
+        printf ("keyframes forced by screen changes: %i\n", forced_keyframes);
+    }
+    if (app->verbose && unchanged_frames > 0) {
+        printf ("unchanged frames %s: %i\n",
+                (skip_unchanged ? "skipped" : "encoded without conversion"),
+                unchanged_frames);
+    }
+    if (app->verbose && late_frames > 0) {
+        printf ("frames captured late and moved to their time slot: %i\n",
+                late_frames);
+    }
+    if (app->verbose && (backlog_max_level > 0 || dropped_frames > 0)) {
+        printf ("storage backlog: quality lowered by up to %i steps, %i frames dropped\n",
+                backlog_max_level, dropped_frames);
+    }
+    if (app->verbose && damage_total_rows > 0) {
+        printf ("damage limited conversion: %li of %li rows converted\n",
+                damage_rows, damage_total_rows);
     }
+    job->stop_time.tv_sec = 0;
+    job->stop_time.tv_usec = 0;
+    gop_encoders = 1;
+    gop_length = 0;
+    num_tiles = 1;
+    damage_convert = FALSE;
+    damage_rows = 0;
+    damage_total_rows = 0;
+    pts_gaps = FALSE;
+    skip_unchanged = FALSE;
+    unchanged_frames = 0;
+    backlog_level = 0;
+    backlog_max_level = 0;
+    backlog_frames = 0;
+    backlog_dropping = FALSE;
+    backlog_drop_next = FALSE;
+    dropped_frames = 0;
+    late_frames = 0;
+    video_clock_paused = FALSE;
+    pthread_mutex_lock (&av_sync_mutex);
+    av_sync_clock = 0;
+    av_sync_video = 0;
+    pthread_mutex_unlock (&av_sync_mutex);
+    frame_pts = 0;
+    skipped_pending = 0;
+    damage_keyframes = FALSE;
+    forced_keyframes = 0;
+    last_damage = -1;
+    speed_adapt = FALSE;
+    speed_base = NULL;
+    speed_level = 0;
+    speed_frames = 0;
+    speed_time = 0;
+    pal8_direct = FALSE;
+    box_ratio = 0;
+    av_free (vid_out_st);
+    vid_out_st = NULL;
 
     codec = NULL;
     au_codec = NULL;
@@ -46,7 +46,8 @@ enum ACTION_TYPES
 {
     ACTION_START,
     ACTION_STOP,
-    ACTION_PAUSE
+    ACTION_PAUSE,
+    ACTION_PROFILE
 };
 
 /**
@@ -61,6 +62,10 @@ usage (char *prog)
     printf
         (_
          ("[--action #]      action to perform (\"start\"|\"stop\"|\"pause\")\n"));
+    printf
+        (_
+         ("[--profile #]     encoder performance profile to use from the next recording on\n"
+          "                  (\"realtime\"|\"balanced\"|\"archive\")\n"));
 
     exit (1);
 }
@@ -74,11 +79,13 @@ usage (char *prog)
 int
 main (int argc, char *argv[])
 {
-    // there's one one argument supported
     struct option options[] = {
-        {"action", required_argument, NULL, 0}
+        {"action", required_argument, NULL, 0},
+        {"profile", required_argument, NULL, 0},
+        {NULL, 0, NULL, 0}
     };
     int action = -1;
+    char *profile = NULL;
     int opt_index = 0, c;
 
     DBusGProxy *proxy;
@@ -98,6 +105,10 @@ main (int argc, char *argv[])
                     action = ACTION_PAUSE;
                 }
                 break;
+            case 1:                   // profile
+                action = ACTION_PROFILE;
+                profile = optarg;
+                break;
             }
         }
     }
@@ -144,6 +155,14 @@ main (int argc, char *argv[])
             g_error_free (error);
         }
         break;
+    case ACTION_PROFILE:
+
+        if (!net_jarre_de_the_Xvidcap_set_profile (proxy, profile, &error)) {
+            g_warning (_("Could not set the profile of xvidcap: %s"),
+                       error->message);
+            g_error_free (error);
+        }
+        break;
     }
 
     // Cleanup
@@ -0,0 +1,289 @@
+/**
+ * \file xvidcap-recover.c
+ *
+ * This file contains a command line application that salvages what was
+ * written of a recording interrupted by a crash or power loss. The packets
+ * of the partial file are copied into a new file of the same format that
+ * gets the index and headers the interrupted recording never wrote.
+ *
+ */
+
+/*
+ * Copyright (C) 2004-07 Karl, Frankfurt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif     // HAVE_CONFIG_H
+#endif     // DOXYGEN_SHOULD_SKIP_THIS
+
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#include "xvidcap-intl.h"
+
+/** \brief most streams copied from the partial recording */
+#define MAX_STREAMS 64
+
+/** \brief the partial recording and the recovered file */
+static AVFormatContext *ic = NULL, *oc = NULL;
+
+/** \brief packets copied and end of the last packet in secs per stream */
+static long packets[MAX_STREAMS];
+static double ends[MAX_STREAMS];
+
+/**
+ * \brief displays command line usage
+ *
+ * @param prog a string containing the name of the program
+ */
+void
+usage (char *prog)
+{
+    printf (_("Usage: %s, ver %s, khb (c) 2003-07\n"), prog, VERSION);
+    printf (_("%s [--output <file>] <partial recording>\n"), prog);
+    printf (_
+            ("[--output <file>] write the recovered recording to file instead of <partial recording>-recovered\n"));
+    printf (_("e.g. %s test-0000.mkv\n"), prog);
+
+    exit (1);
+}
+
+/**
+ * \brief make up the name of the recovered file if none was given
+ *
+ * @param input the name of the partial recording
+ * @return test-0000-recovered.mkv for test-0000.mkv
+ */
+static char *
+recovered_name (const char *input)
+{
+    const char *ext = rindex (input, '.');
+    char *output;
+    int len;
+
+    if (!ext || index (ext, '/'))
+        ext = input + strlen (input);
+    len = ext - input;
+    output = malloc (strlen (input) + 11);
+    if (!output) {
+        fprintf (stderr, _("Could not allocate a file name ... aborting\n"));
+        exit (1);
+    }
+    sprintf (output, "%.*s-recovered%s", len, input, ext);
+
+    return output;
+}
+
+/**
+ * \brief add a stream to the recovered file that takes the packets of a
+ *      stream of the partial recording as they are
+ *
+ * @param ist the stream of the partial recording
+ */
+static void
+copy_stream (AVStream * ist)
+{
+    AVStream *ost = av_new_stream (oc, ist->index);
+    AVCodecContext *dec = ist->codec, *enc;
+
+    if (!ost) {
+        fprintf (stderr, _("Could not allocate stream ... aborting\n"));
+        exit (1);
+    }
+    enc = ost->codec;
+    enc->codec_type = dec->codec_type;
+    enc->codec_id = dec->codec_id;
+    // the tag of the partial file may mean nothing to another muxer
+    if (!oc->oformat->codec_tag ||
+        av_codec_get_id (oc->oformat->codec_tag, dec->codec_tag) ==
+        enc->codec_id)
+        enc->codec_tag = dec->codec_tag;
+    enc->bit_rate = dec->bit_rate;
+    enc->extradata = dec->extradata;
+    enc->extradata_size = dec->extradata_size;
+    enc->time_base = dec->time_base;
+    if (dec->codec_type == CODEC_TYPE_VIDEO) {
+        enc->width = dec->width;
+        enc->height = dec->height;
+        enc->pix_fmt = dec->pix_fmt;
+        enc->has_b_frames = dec->has_b_frames;
+        enc->sample_aspect_ratio = dec->sample_aspect_ratio;
+        ost->sample_aspect_ratio = ist->sample_aspect_ratio;
+        ost->r_frame_rate = ist->r_frame_rate;
+    } else {
+        enc->channels = dec->channels;
+        enc->sample_rate = dec->sample_rate;
+        enc->frame_size = dec->frame_size;
+        enc->block_align = dec->block_align;
+    }
+    if (oc->oformat->flags & AVFMT_GLOBALHEADER)
+        enc->flags |= CODEC_FLAG_GLOBAL_HEADER;
+}
+
+/**
+ * \brief copy one packet of the partial recording to the recovered file
+ *
+ * @param pkt the packet as read from the partial recording
+ * @return 0 on success, < 0 if the packet could not be written
+ */
+static int
+copy_packet (AVPacket * pkt)
+{
+    AVStream *ist = ic->streams[pkt->stream_index];
+    AVStream *ost = oc->streams[pkt->stream_index];
+
+    if (pkt->pts != AV_NOPTS_VALUE) {
+        ends[pkt->stream_index] =
+            FFMAX (ends[pkt->stream_index],
+                   (pkt->pts + pkt->duration) * av_q2d (ist->time_base));
+        pkt->pts = av_rescale_q (pkt->pts, ist->time_base, ost->time_base);
+    }
+    if (pkt->dts != AV_NOPTS_VALUE)
+        pkt->dts = av_rescale_q (pkt->dts, ist->time_base, ost->time_base);
+    pkt->duration = av_rescale_q (pkt->duration, ist->time_base,
+                                  ost->time_base);
+    packets[pkt->stream_index]++;
+
+    return av_interleaved_write_frame (oc, pkt);
+}
+
+/**
+ * \brief main function for the recovery tool
+ *
+ * @param argc number of arguments
+ * @param argv arguments
+ * @return completion status
+ */
+int
+main (int argc, char *argv[])
+{
+    struct option options[] = {
+        {"output", required_argument, NULL, 0},
+        {NULL, 0, NULL, 0}
+    };
+    int opt_index = 0, c, i, errors = 0;
+    char *output = NULL;
+    AVPacket pkt;
+
+    while ((c = getopt_long (argc, argv, "", options, &opt_index)) != -1) {
+        switch (c) {
+        case 0:                       // it's a long option
+            switch (opt_index) {
+            case 0:                   // output
+                output = optarg;
+                break;
+            default:
+                usage (argv[0]);
+                break;
+            }
+            break;
+        default:
+            usage (argv[0]);
+            break;
+        }
+    }
+    if (optind != argc - 1)
+        usage (argv[0]);
+    if (!output)
+        output = recovered_name (argv[optind]);
+
+    av_register_all ();
+    if (av_open_input_file (&ic, argv[optind], NULL, 0, NULL) != 0) {
+        fprintf (stderr, _("Could not open '%s' ... aborting\n"), argv[optind]);
+        exit (1);
+    }
+    // a partial file may end before the probing is done, what was found
+    // up to there is good enough
+    if (av_find_stream_info (ic) < 0 && ic->nb_streams == 0) {
+        fprintf (stderr, _("No streams found in '%s' ... aborting\n"),
+                 argv[optind]);
+        exit (1);
+    }
+    if (ic->nb_streams > MAX_STREAMS) {
+        fprintf (stderr, _("Too many streams in '%s' ... aborting\n"),
+                 argv[optind]);
+        exit (1);
+    }
+
+    oc = avformat_alloc_context ();
+    if (!oc) {
+        fprintf (stderr, _("Could not allocate output context ... aborting\n"));
+        exit (1);
+    }
+    oc->oformat = av_guess_format (NULL, output, NULL);
+    if (!oc->oformat)
+        oc->oformat = av_guess_format (ic->iformat->name, NULL, NULL);
+    if (!oc->oformat) {
+        fprintf (stderr, _("Cannot write a file of the format of '%s' ... aborting\n"),
+                 argv[optind]);
+        exit (1);
+    }
+    snprintf (oc->filename, sizeof (oc->filename), "%s", output);
+    for (i = 0; i < ic->nb_streams; i++)
+        copy_stream (ic->streams[i]);
+
+    if (av_set_parameters (oc, NULL) < 0) {
+        fprintf (stderr, _("Invalid output format parameters ... aborting\n"));
+        exit (1);
+    }
+    if (url_fopen (&oc->pb, output, URL_WRONLY) < 0) {
+        fprintf (stderr, _("Could not open '%s' ... aborting\n"), output);
+        exit (1);
+    }
+    if (av_write_header (oc) < 0) {
+        fprintf (stderr, _("Could not write header for '%s' ... aborting\n"),
+                 output);
+        exit (1);
+    }
+
+    // the end of what was written shows as a failed read, every packet
+    // read before is copied, the last one too
+    while (av_read_frame (ic, &pkt) >= 0) {
+        if (copy_packet (&pkt) < 0)
+            errors++;
+        av_free_packet (&pkt);
+    }
+
+    if (av_write_trailer (oc) < 0)
+        errors++;
+    url_fclose (oc->pb);
+
+    for (i = 0; i < ic->nb_streams; i++) {
+        fprintf (stderr, _("stream %i: %li packets, %.2f seconds recovered\n"),
+                 i, packets[i], ends[i]);
+        // the extradata belongs to the input stream
+        oc->streams[i]->codec->extradata = NULL;
+        av_free (oc->streams[i]->codec);
+        av_free (oc->streams[i]);
+    }
+    if (errors > 0)
+        fprintf (stderr, _("%i packets could not be written to '%s'\n"),
+                 errors, output);
+    else
+        fprintf (stderr, _("Recovered recording written to '%s'\n"), output);
+    av_free (oc);
+    av_close_input_file (ic);
+
+    return (errors > 0 ? 1 : 0);
+}
@@ -0,0 +1,402 @@
+/**
+ * \file xvidcap-stitch.c
+ *
+ * This file contains a command line application that stitches the tiles of
+ * a recording made with xvidcap's --tiles option back together and writes
+ * the full pictures as a YUV4MPEG2 stream for playback or re-encoding.
+ *
+ */
+
+/*
+ * Copyright (C) 2004-07 Karl, Frankfurt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif     // HAVE_CONFIG_H
+#endif     // DOXYGEN_SHOULD_SKIP_THIS
+
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+
+#include "xvidcap-intl.h"
+
+/** \brief most tiles xvidcap splits a capture area into (8x8) */
+#define MAX_TILES 64
+
+/** \brief most decoded pictures held back per tile while waiting for the
+ *      other tiles of the same frame */
+#define TILE_QUEUE 32
+
+/**
+ * \brief one tile of the recording with the pictures decoded for it
+ */
+typedef struct
+{
+    /** \brief index of the video stream holding the tile */
+    int stream_index;
+    /** \brief position of the tile in the full picture */
+    int x, y;
+    /** \brief size of the tile */
+    int width, height;
+    /** \brief the decoder of the tile's stream */
+    AVCodecContext *dec;
+    /** \brief converts decoded pictures to yuv420p */
+    struct SwsContext *sws;
+    /** \brief decoded pictures not yet stitched, as a ring buffer */
+    AVPicture queue[TILE_QUEUE];
+    /** \brief TRUE for the entries of queue allocated */
+    int allocated[TILE_QUEUE];
+    /** \brief first picture in queue and number of pictures in queue */
+    int first;
+    int queued;
+} XVC_StitchTile;
+
+static XVC_StitchTile tiles[MAX_TILES];
+static int num_tiles = 0;
+
+/** \brief size of the full picture */
+static int width = 0, height = 0;
+
+/** \brief the full picture the tiles are stitched into */
+static AVPicture canvas;
+
+/** \brief number of frames written */
+static int frames = 0;
+
+/**
+ * \brief displays command line usage
+ *
+ * @param prog a string containing the name of the program
+ */
+void
+usage (char *prog)
+{
+    printf (_("Usage: %s, ver %s, khb (c) 2003-07\n"), prog, VERSION);
+    printf (_("%s [--output <file>] <tiled recording>\n"), prog);
+    printf (_
+            ("[--output <file>] write the YUV4MPEG2 stream to file instead of stdout\n"));
+    printf (_
+            ("e.g. %s capture.avi | ffplay -\n"), prog);
+
+    exit (1);
+}
+
+/**
+ * \brief read the tile geometry from the comment xvidcap writes into a
+ *      tiled recording, or from the titles of the video streams
+ *
+ * @param ic the opened recording
+ * @return the number of tiles found, 0 if it is not a tiled recording
+ */
+static int
+find_tiles (AVFormatContext * ic)
+{
+    AVMetadataTag *tag = av_metadata_get (ic->metadata, "comment", NULL, 0);
+    int i, n = 0, used = 0;
+
+    if (tag && sscanf (tag->value, "xvidcap tiles %ix%i:%n", &width, &height,
+                       &used) == 2 && used > 0) {
+        const char *p = tag->value + used;
+
+        while (n < MAX_TILES &&
+               sscanf (p, " %ix%i+%i+%i%n", &tiles[n].width, &tiles[n].height,
+                       &tiles[n].x, &tiles[n].y, &used) == 4) {
+            p += used;
+            n++;
+        }
+    }
+
+    // the video streams hold the tiles in the order of the comment
+    for (i = 0; i < ic->nb_streams && num_tiles < MAX_TILES; i++) {
+        XVC_StitchTile *t = &tiles[num_tiles];
+
+        if (ic->streams[i]->codec->codec_type != CODEC_TYPE_VIDEO)
+            continue;
+        if (n == 0) {
+            tag = av_metadata_get (ic->streams[i]->metadata, "title", NULL, 0);
+            if (!tag || sscanf (tag->value, "%ix%i+%i+%i", &t->width,
+                                &t->height, &t->x, &t->y) != 4)
+                return 0;
+            width = (t->x + t->width > width ? t->x + t->width : width);
+            height = (t->y + t->height > height ? t->y + t->height : height);
+        }
+        t->stream_index = i;
+        num_tiles++;
+    }
+
+    if (n > 0 && n != num_tiles)
+        return 0;
+    return num_tiles;
+}
+
+/**
+ * \brief open the decoder and conversion of a tile
+ *
+ * @param ic the opened recording
+ * @param t the tile
+ */
+static void
+open_tile (AVFormatContext * ic, XVC_StitchTile * t)
+{
+    AVCodec *codec;
+
+    t->dec = ic->streams[t->stream_index]->codec;
+    codec = avcodec_find_decoder (t->dec->codec_id);
+    if (!codec || avcodec_open (t->dec, codec) < 0) {
+        fprintf (stderr, _("Could not open the decoder of stream %i\n"),
+                 t->stream_index);
+        exit (1);
+    }
+    t->sws = sws_getContext (t->width, t->height, t->dec->pix_fmt,
+                             t->width, t->height, PIX_FMT_YUV420P, 1,
+                             NULL, NULL, NULL);
+    if (!t->sws) {
+        fprintf (stderr, _("Could not initialize the conversion of stream %i\n"),
+                 t->stream_index);
+        exit (1);
+    }
+}
+
+/**
+ * \brief stitch the first queued picture of every tile that has one into
+ *      the full picture and write it
+ *
+ * Tiles without a queued picture keep what they showed in the previous
+ * frame.
+ *
+ * @param out the file to write to
+ */
+static void
+write_frame (FILE * out)
+{
+    int i, p, row;
+
+    for (i = 0; i < num_tiles; i++) {
+        XVC_StitchTile *t = &tiles[i];
+        AVPicture *pic = &t->queue[t->first];
+
+        if (t->queued == 0)
+            continue;
+        for (p = 0; p < 3; p++) {
+            int s = (p == 0 ? 0 : 1);
+            int w = (t->width + s) >> s, h = (t->height + s) >> s;
+
+            for (row = 0; row < h; row++)
+                memcpy (canvas.data[p] + ((t->y >> s) + row) *
+                        canvas.linesize[p] + (t->x >> s),
+                        pic->data[p] + row * pic->linesize[p], w);
+        }
+        t->first = (t->first + 1) % TILE_QUEUE;
+        t->queued--;
+    }
+
+    fprintf (out, "FRAME\n");
+    for (p = 0; p < 3; p++) {
+        int s = (p == 0 ? 0 : 1);
+
+        for (row = 0; row < ((height + s) >> s); row++)
+            fwrite (canvas.data[p] + row * canvas.linesize[p], 1,
+                    (width + s) >> s, out);
+    }
+    frames++;
+}
+
+/**
+ * \brief write all frames every tile has been decoded for
+ *
+ * @param out the file to write to
+ */
+static void
+write_complete_frames (FILE * out)
+{
+    while (1) {
+        int i;
+
+        for (i = 0; i < num_tiles; i++) {
+            if (tiles[i].queued == 0)
+                return;
+        }
+        write_frame (out);
+    }
+}
+
+/**
+ * \brief decode a packet of a tile and queue the picture
+ *
+ * @param t the tile
+ * @param pkt the packet, an empty one to get the pictures held back by the
+ *      decoder
+ * @param out the file to write to if a queue overflows
+ * @return TRUE if a picture was decoded
+ */
+static int
+decode_tile (XVC_StitchTile * t, AVPacket * pkt, FILE * out)
+{
+    AVFrame *frame = avcodec_alloc_frame ();
+    int got_picture = 0, slot;
+
+    if (avcodec_decode_video2 (t->dec, frame, &got_picture, pkt) < 0 ||
+        !got_picture) {
+        av_free (frame);
+        return 0;
+    }
+
+    // another tile's stream is missing pictures, don't wait for them
+    if (t->queued == TILE_QUEUE)
+        write_frame (out);
+
+    slot = (t->first + t->queued) % TILE_QUEUE;
+    if (!t->allocated[slot]) {
+        if (avpicture_alloc (&t->queue[slot], PIX_FMT_YUV420P, t->width,
+                             t->height) < 0) {
+            fprintf (stderr, _("Could not allocate buffer for output frame! ... aborting\n"));
+            exit (1);
+        }
+        t->allocated[slot] = 1;
+    }
+    sws_scale (t->sws, frame->data, frame->linesize, 0, t->height,
+               t->queue[slot].data, t->queue[slot].linesize);
+    t->queued++;
+
+    av_free (frame);
+    return 1;
+}
+
+/**
+ * \brief main function of the application stitching the tiles
+ *
+ * @return completion status
+ */
+int
+main (int argc, char *argv[])
+{
+    struct option options[] = {
+        {"output", required_argument, NULL, 0},
+        {NULL, 0, NULL, 0}
+    };
+    int opt_index = 0, c, i, j;
+    char *output = NULL;
+    AVFormatContext *ic = NULL;
+    AVStream *st;
+    AVPacket pkt;
+    FILE *out = stdout;
+
+    while ((c = getopt_long (argc, argv, "", options, &opt_index)) != -1) {
+        switch (c) {
+        case 0:                       // it's a long option
+            switch (opt_index) {
+            case 0:                   // output
+                output = optarg;
+                break;
+            default:
+                usage (argv[0]);
+                break;
+            }
+            break;
+        default:
+            usage (argv[0]);
+            break;
+        }
+    }
+    if (optind != argc - 1)
+        usage (argv[0]);
+
+    av_register_all ();
+    if (av_open_input_file (&ic, argv[optind], NULL, 0, NULL) != 0 ||
+        av_find_stream_info (ic) < 0) {
+        fprintf (stderr, _("Could not open '%s' ... aborting\n"), argv[optind]);
+        exit (1);
+    }
+    if (find_tiles (ic) == 0 || width <= 0 || height <= 0) {
+        fprintf (stderr, _("'%s' is not a tiled recording made by xvidcap\n"),
+                 argv[optind]);
+        exit (1);
+    }
+    for (i = 0; i < num_tiles; i++)
+        open_tile (ic, &tiles[i]);
+
+    // the parts of the full picture not covered by tiles stay black
+    if (avpicture_alloc (&canvas, PIX_FMT_YUV420P, width, height) < 0) {
+        fprintf (stderr, _("Could not allocate buffer for output frame! ... aborting\n"));
+        exit (1);
+    }
+    memset (canvas.data[0], 16, canvas.linesize[0] * height);
+    memset (canvas.data[1], 128, canvas.linesize[1] * ((height + 1) >> 1));
+    memset (canvas.data[2], 128, canvas.linesize[2] * ((height + 1) >> 1));
+
+    if (output && !(out = fopen (output, "wb"))) {
+        fprintf (stderr, _("Could not open '%s' ... aborting\n"), output);
+        exit (1);
+    }
+    st = ic->streams[tiles[0].stream_index];
+    fprintf (out, "YUV4MPEG2 W%i H%i F%i:%i Ip A1:1 C420jpeg\n", width, height,
+             (st->r_frame_rate.num ? st->r_frame_rate.num :
+              st->codec->time_base.den),
+             (st->r_frame_rate.num ? st->r_frame_rate.den :
+              st->codec->time_base.num));
+
+    while (av_read_frame (ic, &pkt) >= 0) {
+        for (i = 0; i < num_tiles; i++) {
+            if (tiles[i].stream_index == pkt.stream_index) {
+                decode_tile (&tiles[i], &pkt, out);
+                break;
+            }
+        }
+        av_free_packet (&pkt);
+        write_complete_frames (out);
+    }
+
+    // pictures held back by decoders with B-frames
+    av_init_packet (&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+    for (i = 0; i < num_tiles; i++) {
+        while (decode_tile (&tiles[i], &pkt, out));
+    }
+    write_complete_frames (out);
+    // tiles whose streams ended early keep their last picture
+    for (i = 0; i < num_tiles; i++) {
+        while (tiles[i].queued > 0)
+            write_frame (out);
+    }
+
+    fprintf (stderr, _("%i frames of %ix%i stitched from %i tiles\n"), frames,
+             width, height, num_tiles);
+
+    if (out != stdout)
+        fclose (out);
+    for (i = 0; i < num_tiles; i++) {
+        for (j = 0; j < TILE_QUEUE; j++) {
+            if (tiles[i].allocated[j])
+                avpicture_free (&tiles[i].queue[j]);
+        }
+        sws_freeContext (tiles[i].sws);
+        avcodec_close (tiles[i].dec);
+    }
+    avpicture_free (&canvas);
+    av_close_input_file (ic);
+
+    return 0;
+}